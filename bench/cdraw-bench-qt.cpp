@@ -0,0 +1,9 @@
+/* Qt needs an application object to exist before fonts and pixmaps can be
+ * used. The benchmark itself is plain C, so it is created here. */
+
+#include <QGuiApplication>
+
+extern "C" void bench_init(int *argc, char **argv) {
+    /* Lives until the process exits */
+    new QGuiApplication(*argc, argv);
+}
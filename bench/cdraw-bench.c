@@ -0,0 +1,717 @@
+/* Benchmarks for CDraw */
+/* Runs a fixed set of workloads against whichever port it was built with and
+ * prints one JSON object per workload, one per line. With -c it checks the
+ * pixel kernels instead. */
+
+#ifdef CDRAW_PORT_QT
+#include "cdraw-qt.h"
+#else
+#include "cdraw-cairo.h"
+#endif
+
+#include "cdraw-blit.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#ifdef CDRAW_PORT_QT
+#define PORT_NAME "qt"
+#else
+#define PORT_NAME "cairo"
+#endif
+
+/* The Qt port needs an application object before it can draw anything, see
+ * cdraw-bench-qt.cpp. The Cairo port needs nothing. */
+#ifdef CDRAW_PORT_QT
+void bench_init(int *argc, char **argv);
+#else
+static void bench_init(int *argc, char **argv) {
+    (void)argc;
+    (void)argv;
+}
+#endif
+
+static const color_t red = { 200, 30, 30 };
+static const color_t blue = { 30, 30, 200 };
+static const color_t black = { 0, 0, 0 };
+
+static const char *labels[] = {
+    "Total", "Subtotal", "Tax", "Net amount", "Quantity", "Unit price",
+    "Description", "Invoice 10442", "Page 3 of 12", "Balance due",
+    "Shipping", "Discount", "Account", "Reference", "Customer", "Date"
+};
+
+#define LABEL_COUNT (int)(sizeof(labels) / sizeof(labels[0]))
+
+/* Each workload does one operation and returns how many pixels the surfaces
+ * it created cover, or 0 when that says nothing useful */
+typedef struct workload_t {
+    const char *name;
+    long (*run)(void);
+    unsigned char lazy;
+} workload_t;
+
+static long pixels_of(surface *surf) {
+    return (long)DL_get_width(surf) * DL_get_height(surf);
+}
+
+static long run_rectangle(void) {
+    surface *surf = DL_rectangle(64, 48, red);
+    long ret = pixels_of(surf);
+
+    DL_free_surface(surf);
+
+    return ret;
+}
+
+static long run_square(void) {
+    surface *surf = DL_square(64, blue);
+    long ret = pixels_of(surf);
+
+    DL_free_surface(surf);
+
+    return ret;
+}
+
+static long run_empty(void) {
+    surface *surf = DL_empty(64, 48);
+
+    DL_free_surface(surf);
+
+    return 0;
+}
+
+/* A row of 200 boxes of different heights, built one DL_beside_align at a
+ * time, the way a caller without DL_beside_n would */
+static long run_beside_chain(void) {
+    surface *row, *box, *next;
+    long ret;
+    int i;
+
+    row = DL_rectangle(4, 10, red);
+
+    for (i = 1; i < 200; i++) {
+        box = DL_rectangle(4, 10 + i % 23, i & 1 ? red : blue);
+        next = DL_beside_align(row, box, i % 3 == 0 ? TOP : CENTER);
+
+        DL_free_surface(row);
+        DL_free_surface(box);
+        row = next;
+    }
+
+    ret = pixels_of(row);
+    DL_free_surface(row);
+
+    return ret;
+}
+
+static long run_above_chain(void) {
+    surface *col, *box, *next;
+    long ret;
+    int i;
+
+    col = DL_rectangle(10, 4, red);
+
+    for (i = 1; i < 200; i++) {
+        box = DL_rectangle(10 + i % 23, 4, i & 1 ? red : blue);
+        next = DL_above_align(col, box, i % 3 == 0 ? LEFT : CENTER);
+
+        DL_free_surface(col);
+        DL_free_surface(box);
+        col = next;
+    }
+
+    ret = pixels_of(col);
+    DL_free_surface(col);
+
+    return ret;
+}
+
+/* The same row as run_beside_chain, put together in one call */
+static long run_beside_n(void) {
+    surface *boxes[200], *row;
+    long ret;
+    int i;
+
+    for (i = 0; i < 200; i++) {
+        boxes[i] = DL_rectangle(4, 10 + i % 23, i & 1 ? red : blue);
+    }
+
+    row = DL_beside_n(boxes, 200, CENTER);
+
+    for (i = 0; i < 200; i++) {
+        DL_free_surface(boxes[i]);
+    }
+
+    ret = pixels_of(row);
+    DL_free_surface(row);
+
+    return ret;
+}
+
+static long run_above_n(void) {
+    surface *boxes[200], *col;
+    long ret;
+    int i;
+
+    for (i = 0; i < 200; i++) {
+        boxes[i] = DL_rectangle(10 + i % 23, 4, i & 1 ? red : blue);
+    }
+
+    col = DL_above_n(boxes, 200, CENTER);
+
+    for (i = 0; i < 200; i++) {
+        DL_free_surface(boxes[i]);
+    }
+
+    ret = pixels_of(col);
+    DL_free_surface(col);
+
+    return ret;
+}
+
+/* Two large rectangles and a label on top of each other */
+static long run_overlay_large(void) {
+    surface *back, *front, *label, *both, *all;
+    long ret;
+
+    back = DL_rectangle(1024, 1024, blue);
+    front = DL_rectangle(768, 512, red);
+    label = DL_text(labels[0], 24, black, "sans", 1, 0);
+
+    both = DL_overlay(back, front);
+    all = DL_overlay(both, label);
+
+    ret = pixels_of(all);
+
+    DL_free_surface(back);
+    DL_free_surface(front);
+    DL_free_surface(label);
+    DL_free_surface(both);
+    DL_free_surface(all);
+
+    return ret;
+}
+
+static long run_overlay_n(void) {
+    surface *layers[8], *all;
+    long ret;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        layers[i] = DL_rectangle(1024 - i * 100, 1024 - i * 60, i & 1 ? red : blue);
+    }
+
+    all = DL_overlay_n(layers, 8);
+
+    for (i = 0; i < 8; i++) {
+        DL_free_surface(layers[i]);
+    }
+
+    ret = pixels_of(all);
+    DL_free_surface(all);
+
+    return ret;
+}
+
+/* A wide table of labels, 40 rows by 12 columns */
+static long run_grid_wide(void) {
+    surface *cells[40 * 12], *grid;
+    long ret;
+    int i;
+
+    for (i = 0; i < 40 * 12; i++) {
+        cells[i] = DL_text(labels[i % LABEL_COUNT], 12, black, "sans", i % 12 == 0, 0);
+    }
+
+    grid = DL_grid(cells, 40, 12, NULL, NULL);
+
+    for (i = 0; i < 40 * 12; i++) {
+        DL_free_surface(cells[i]);
+    }
+
+    ret = pixels_of(grid);
+    DL_free_surface(grid);
+
+    return ret;
+}
+
+/* Labels which mostly repeat, so most of them come out of the text cache */
+static long run_text_cached(void) {
+    static int next = 0;
+    surface *surf;
+    long ret;
+
+    surf = DL_text(labels[next++ % LABEL_COUNT], 14, black, "sans", 0, 0);
+    ret = pixels_of(surf);
+    DL_free_surface(surf);
+
+    return ret;
+}
+
+/* Labels which never repeat, so every one of them is drawn */
+static long run_text_uncached(void) {
+    static int next = 0;
+    char text[64];
+    surface *surf;
+    long ret;
+
+    snprintf(text, sizeof(text), "%s %d", labels[next % LABEL_COUNT], next);
+    next++;
+
+    surf = DL_text(text, 14, black, "sans", 0, next & 1);
+    ret = pixels_of(surf);
+    DL_free_surface(surf);
+
+    return ret;
+}
+
+/* A report of 100 labelled bars. Run lazily, so all of the drawing happens
+ * in DL_render. */
+static long run_render_report(void) {
+    surface *rows[100], *bar, *label, *report, *image;
+    long ret;
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        label = DL_text(labels[i % LABEL_COUNT], 12, black, "sans", 0, 0);
+        bar = DL_rectangle(40 + (i * 37) % 500, 16, i & 1 ? red : blue);
+        rows[i] = DL_beside_align(label, bar, CENTER);
+
+        DL_free_surface(label);
+        DL_free_surface(bar);
+    }
+
+    report = DL_above_n(rows, 100, LEFT);
+
+    for (i = 0; i < 100; i++) {
+        DL_free_surface(rows[i]);
+    }
+
+    image = DL_render(report);
+    ret = pixels_of(image);
+
+    DL_free_surface(report);
+    DL_free_surface(image);
+
+    return ret;
+}
+
+static long run_make_writable(void) {
+    surface *surf;
+    long ret;
+
+    surf = DL_make_writable(DL_rectangle(512, 512, red));
+    ret = pixels_of(surf);
+    DL_free_surface(surf);
+
+    return ret;
+}
+
+static int discard(void *closure, const unsigned char *data, size_t length) {
+    (void)closure;
+    (void)data;
+    (void)length;
+
+    return 0;
+}
+
+static long run_write_png(void) {
+    surface *back, *front, *all;
+    long ret;
+
+    back = DL_rectangle(1024, 1024, blue);
+    front = DL_rectangle(512, 512, red);
+    all = DL_overlay(back, front);
+
+    DL_write_png_stream(all, discard, NULL);
+    ret = pixels_of(all);
+
+    DL_free_surface(back);
+    DL_free_surface(front);
+    DL_free_surface(all);
+
+    return ret;
+}
+
+static long run_write_raw(void) {
+    surface *back, *front, *all;
+    long ret;
+
+    back = DL_rectangle(1024, 1024, blue);
+    front = DL_rectangle(512, 512, red);
+    all = DL_overlay(back, front);
+
+    DL_write_raw_stream(all, discard, NULL);
+    ret = pixels_of(all);
+
+    DL_free_surface(back);
+    DL_free_surface(front);
+    DL_free_surface(all);
+
+    return ret;
+}
+
+static const workload_t workloads[] = {
+    { "rectangle", run_rectangle, 0 },
+    { "square", run_square, 0 },
+    { "empty", run_empty, 0 },
+    { "beside_chain", run_beside_chain, 0 },
+    { "beside_chain_lazy", run_beside_chain, 1 },
+    { "above_chain", run_above_chain, 0 },
+    { "above_chain_lazy", run_above_chain, 1 },
+    { "beside_n", run_beside_n, 0 },
+    { "above_n", run_above_n, 0 },
+    { "overlay_large", run_overlay_large, 0 },
+    { "overlay_n", run_overlay_n, 0 },
+    { "grid_wide", run_grid_wide, 0 },
+    { "text_cached", run_text_cached, 0 },
+    { "text_uncached", run_text_uncached, 0 },
+    { "render_report", run_render_report, 1 },
+    { "make_writable", run_make_writable, 0 },
+    { "write_png", run_write_png, 0 },
+    { "write_raw", run_write_raw, 0 }
+};
+
+#define WORKLOAD_COUNT (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long peak_rss_kb(void) {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    return usage.ru_maxrss;
+}
+
+/* Runs the workload for at least minTime seconds and prints its results */
+static void run_workload(const workload_t *work, double minTime, int threads) {
+    pool_stats_t before, after;
+    double start, elapsed;
+    long ops, pixels;
+
+    DL_set_lazy(work->lazy);
+
+    /* One run first, so the caches are warm */
+    work->run();
+
+    DL_pool_get_stats(&before);
+
+    ops = 0;
+    pixels = 0;
+    start = now();
+
+    do {
+        pixels += work->run();
+        ops++;
+        elapsed = now() - start;
+    } while (elapsed < minTime);
+
+    DL_pool_get_stats(&after);
+
+    DL_set_lazy(0);
+
+    printf("{\"port\": \"%s\", \"workload\": \"%s\", \"threads\": %d, \"ops\": %ld, "
+           "\"ns_per_op\": %.1f, \"pixels_per_sec\": %.0f, "
+           "\"buffer_allocs_per_op\": %.2f, \"buffer_reuses_per_op\": %.2f, "
+           "\"peak_rss_kb\": %ld}\n",
+           PORT_NAME, work->name, threads, ops,
+           elapsed * 1e9 / ops, pixels / elapsed,
+           (double)(after.requests - after.reuses - (before.requests - before.reuses)) / ops,
+           (double)(after.reuses - before.reuses) / ops,
+           peak_rss_kb());
+
+    fflush(stdout);
+}
+
+/* The kernels dl_blit_over can use. The first is the plain C one the others
+ * are checked against. */
+static const char *kernels[] = { "c", "sse2", "avx2" };
+
+#define KERNEL_COUNT (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+/* Widths around every multiple of 4 and 8 pixels the kernels step by */
+static const int checkWidths[] = {
+    1, 2, 3, 4, 5, 6, 7, 8, 9, 11, 12, 13, 15, 16, 17, 23, 24, 25, 31, 32, 33,
+    63, 64, 65, 127, 128, 129, 255, 257, 1021
+};
+
+#define CHECK_WIDTH_COUNT (int)(sizeof(checkWidths) / sizeof(checkWidths[0]))
+
+/* Bytes of padding after each row, and how far off a 32 byte boundary the
+ * first row starts. Either keeps the rows off the boundaries the vector
+ * loads like. */
+static const int checkPads[] = { 0, 4, 12 };
+static const int checkOffsets[] = { 0, 4, 12 };
+
+#define CHECK_HEIGHT 3
+
+/* xorshift32, so every run checks the same pixels */
+static uint32_t next_random(uint32_t *state) {
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+
+    return x;
+}
+
+/* Fills a width by height block with premultiplied pixels in runs of up to
+ * 16 of the same kind: transparent, opaque, alpha 1 or 254, or anything.
+ * Runs long enough to fill a vector take the kernels' shortcuts. */
+static void fill_random(unsigned char *data, int stride, int width, int height, uint32_t *state) {
+    uint32_t *row, r, a, pixel;
+    int x, y, run, kind;
+
+    run = 0;
+    kind = 0;
+
+    for (y = 0; y < height; y++) {
+        row = (uint32_t*)(data + (size_t)y * stride);
+
+        for (x = 0; x < width; x++) {
+            if (run == 0) {
+                r = next_random(state);
+                run = 1 + r % 16;
+                kind = (r >> 4) % 5;
+            }
+
+            run--;
+            r = next_random(state);
+
+            switch (kind) {
+            case 0:     a = 0;                  break;
+            case 1:     a = 255;                break;
+            case 2:     a = 1;                  break;
+            case 3:     a = 254;                break;
+            default:    a = r >> 24;            break;
+            }
+
+            /* No channel of a premultiplied pixel is above its alpha */
+            pixel = a << 24;
+            pixel |= ((r & 0xff) * a / 255) << 16;
+            pixel |= (((r >> 8) & 0xff) * a / 255) << 8;
+            pixel |= ((r >> 16) & 0xff) * a / 255;
+
+            row[x] = pixel;
+        }
+    }
+}
+
+/* Reports where got first differs from want, both size bytes long */
+static void report_mismatch(const char *kernel, const unsigned char *got, const unsigned char *want, size_t size,
+                            int width, int pad, int offset, int stride) {
+    size_t i;
+
+    for (i = 0; i < size && got[i] == want[i]; i++);
+
+    fprintf(stderr, "%s: width %d pad %d offset %d differs at row %d byte %d: %02x, want %02x\n",
+            kernel, width, pad, offset, (int)(i / stride), (int)(i % stride), got[i], want[i]);
+}
+
+#ifdef CDRAW_PORT_CAIRO
+/* Composites src over dst the way the port would without the kernels */
+static void paint_over(unsigned char *dst, unsigned char *src, int stride, int width, int height) {
+    cairo_surface_t *d, *s;
+    cairo_t *cr;
+
+    d = cairo_image_surface_create_for_data(dst, CAIRO_FORMAT_ARGB32, width, height, stride);
+    s = cairo_image_surface_create_for_data(src, CAIRO_FORMAT_ARGB32, width, height, stride);
+
+    cr = cairo_create(d);
+    cairo_set_source_surface(cr, s, 0, 0);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+
+    cairo_surface_flush(d);
+    cairo_surface_destroy(s);
+    cairo_surface_destroy(d);
+}
+#endif
+
+/* Composites random pixels with every vector kernel the CPU has, and with
+ * cairo in the Cairo port, checking each result byte for byte, row padding
+ * included, against the plain C kernel. Prints one JSON object per kernel and returns
+ * how many cases did not match. */
+static int check_kernels(void) {
+    const char *picked;
+    unsigned char *start, *src, *under, *want, *got;
+    size_t size;
+    uint32_t state;
+    int mismatches[KERNEL_COUNT + 1], available[KERNEL_COUNT + 1];
+    int cases, ret, i, k, p, o, width, stride;
+
+    picked = dl_blit_kernel();
+
+    for (k = 0; k < KERNEL_COUNT; k++) {
+        available[k] = dl_blit_set_kernel(kernels[k]) == 0;
+        mismatches[k] = 0;
+    }
+
+#ifdef CDRAW_PORT_CAIRO
+    available[KERNEL_COUNT] = 1;
+#else
+    available[KERNEL_COUNT] = 0;
+#endif
+    mismatches[KERNEL_COUNT] = 0;
+
+    state = 2463534242u;
+    cases = 0;
+
+    for (i = 0; i < CHECK_WIDTH_COUNT; i++) {
+        for (p = 0; p < (int)(sizeof(checkPads) / sizeof(checkPads[0])); p++) {
+            for (o = 0; o < (int)(sizeof(checkOffsets) / sizeof(checkOffsets[0])); o++) {
+                width = checkWidths[i];
+                stride = width * 4 + checkPads[p];
+                size = (size_t)stride * CHECK_HEIGHT;
+
+                /* Four blocks a multiple of 32 bytes apart, all offset from
+                 * the start. The padding is left as garbage, which must come
+                 * through. */
+                start = malloc((size + 32) * 4 + 32);
+                memset(start, 0xa5, (size + 32) * 4 + 32);
+
+                src = start + checkOffsets[o];
+                under = src + (size + 32 - size % 32);
+                want = under + (size + 32 - size % 32);
+                got = want + (size + 32 - size % 32);
+
+                fill_random(src, stride, width, CHECK_HEIGHT, &state);
+                fill_random(under, stride, width, CHECK_HEIGHT, &state);
+
+                memcpy(want, under, size);
+                dl_blit_set_kernel(kernels[0]);
+                dl_blit_over(want, stride, src, stride, width, CHECK_HEIGHT);
+
+                for (k = 1; k <= KERNEL_COUNT; k++) {
+                    if (!available[k]) {
+                        continue;
+                    }
+
+                    memcpy(got, under, size);
+
+                    if (k < KERNEL_COUNT) {
+                        dl_blit_set_kernel(kernels[k]);
+                        dl_blit_over(got, stride, src, stride, width, CHECK_HEIGHT);
+                    }
+#ifdef CDRAW_PORT_CAIRO
+                    else {
+                        paint_over(got, src, stride, width, CHECK_HEIGHT);
+                    }
+#endif
+
+                    if (memcmp(got, want, size) != 0 && mismatches[k]++ == 0) {
+                        report_mismatch(k < KERNEL_COUNT ? kernels[k] : "cairo_paint", got, want, size,
+                                        width, checkPads[p], checkOffsets[o], stride);
+                    }
+                }
+
+                free(start);
+                cases++;
+            }
+        }
+    }
+
+    dl_blit_set_kernel(picked);
+
+    ret = 0;
+
+    for (k = 1; k <= KERNEL_COUNT; k++) {
+        if (!available[k]) {
+            continue;
+        }
+
+        printf("{\"port\": \"%s\", \"check\": \"over\", \"kernel\": \"%s\", \"cases\": %d, \"mismatches\": %d}\n",
+               PORT_NAME, k < KERNEL_COUNT ? kernels[k] : "cairo_paint", cases, mismatches[k]);
+
+        ret += mismatches[k];
+    }
+
+    fflush(stdout);
+
+    return ret;
+}
+
+static void usage(const char *name) {
+    int i;
+
+    fprintf(stderr, "usage: %s [-t seconds] [-j threads] [workload...]\n       %s -c\n\nworkloads:\n",
+            name, name);
+
+    for (i = 0; i < WORKLOAD_COUNT; i++) {
+        fprintf(stderr, "  %s\n", workloads[i].name);
+    }
+}
+
+int main(int argc, char **argv) {
+    double minTime;
+    int threads, i, j, picked, found;
+
+    bench_init(&argc, argv);
+
+    minTime = 1.0;
+    threads = 1;
+    picked = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            minTime = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-c") == 0) {
+            return check_kernels() == 0 ? 0 : 1;
+        }
+        else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    DL_set_threads(threads);
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "-j") == 0) {
+            i++;
+            continue;
+        }
+
+        found = 0;
+
+        for (j = 0; j < WORKLOAD_COUNT; j++) {
+            if (strcmp(argv[i], workloads[j].name) == 0) {
+                run_workload(&workloads[j], minTime, threads);
+                found = 1;
+            }
+        }
+
+        if (!found) {
+            usage(argv[0]);
+            return 1;
+        }
+
+        picked = 1;
+    }
+
+    if (!picked) {
+        for (j = 0; j < WORKLOAD_COUNT; j++) {
+            run_workload(&workloads[j], minTime, threads);
+        }
+    }
+
+    return 0;
+}
@@ -1,9 +1,14 @@
 /* CDraw designed for use with Qt's Pixmaps */
 /* This port is a C++ port, however this can be used with C just fine. */
+/* Built with CDRAW_QT_IMAGE it uses QImages instead, which need no display
+ * server and can be used from any thread. DL_text still needs a
+ * QGuiApplication for its fonts, the "offscreen" platform works for that. */
 
 #ifndef CDRAW_H
 #define CDRAW_H
 
+#include <stddef.h>
+
 typedef struct color_t {
     unsigned char r;
     unsigned char g;
@@ -19,11 +24,95 @@ typedef enum align_t {
     RIGHT
 } align_t;
 
+/* Pixel formats images may be kept in, see DL_set_text_format and
+ * DL_set_opaque_format */
+typedef enum format_t {
+    FORMAT_ARGB32,
+    FORMAT_RGB24,
+    FORMAT_A8,
+    FORMAT_RGB16_565
+} format_t;
+
+/* Where DL_write_png_stream and DL_write_raw_stream send their output. It is
+ * called with each piece of output in order and returns 0 on success, anything
+ * else stops the write. */
+typedef int (*write_func_t)(void *closure, const unsigned char *data, size_t length);
+
+/* Called with the closure given to DL_from_buffer once the surface made out
+ * of the buffer, and everything composed from it, is done with its pixels */
+typedef void (*release_func_t)(void *closure);
+
+/* A rectangle in pixels, see DL_composition_update */
+typedef struct rect_t {
+    int x;
+    int y;
+    int width;
+    int height;
+} rect_t;
+
+/* A tree of surfaces kept together with the image it was rendered into, see
+ * DL_composition_new */
+typedef struct composition_t composition_t;
+
+/* A render running in the background, see DL_render_async */
+typedef struct future_t future_t;
+
+/* Counters for the text cache, see DL_text_cache_get_stats */
+typedef struct text_cache_stats_t {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t bytes;
+    size_t budget;
+} text_cache_stats_t;
+
+/* The size of a line of text, see DL_text_measure. ascent and descent add
+ * up to height. */
+typedef struct text_metrics_t {
+    int width;
+    int height;
+    int ascent;
+    int descent;
+} text_metrics_t;
+
+/* Counters for the combinator memo table, see DL_memo_get_stats */
+typedef struct memo_stats_t {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t bytes;
+    size_t budget;
+} memo_stats_t;
+
+/* Counters for the pixel buffer pool, see DL_pool_get_stats. requests is how
+ * many buffers were asked for and reuses how many of those came out of the
+ * pool. bytes are in use by live surfaces, pooled are held for reuse and
+ * peak is the most there ever were of both together. */
+typedef struct pool_stats_t {
+    unsigned long requests;
+    unsigned long reuses;
+    size_t bytes;
+    size_t pooled;
+    size_t peak;
+    size_t budget;
+} pool_stats_t;
+
+/* Counters for one DL_* function or backend operation, see DL_get_stats.
+ * bytes, pixels and nanoseconds include everything done under the call. */
+typedef struct call_stats_t {
+    const char *name;
+    unsigned long calls;
+    unsigned long long bytes;
+    unsigned long long pixels;
+    unsigned long long nanoseconds;
+} call_stats_t;
+
 /* We typedef surface to 'void' here because this is a c library and qt is a 
  * C++ library, while there is nothing truly stoping us from using and 
  * returning a C++ class, which we are doing, C will not recognize it as such. 
- * Therefore we just say our surface, which is a QPixmap class, is actually 
- * just a void pointer. */
+ * Therefore we just say our surface, which is a node_t holding a QPixmap (or
+ * a QImage when built with CDRAW_QT_IMAGE), is actually just a void
+ * pointer. */
 typedef void surface;
 
 /* Creates a new surface with the given left and right surfaces drawn beside
@@ -47,30 +136,362 @@ surface *DL_above_align(surface *top, surface *bottom, align_t align);
 surface *DL_above(surface *top, surface *bot);
 
 /* Creates a new surface with a rectangle drawn based on the given width,
- * height, and color. */
+ * height, and color. No pixels are allocated for it, the rectangle is filled
+ * in wherever it gets drawn. */
 surface *DL_rectangle (int w, int h, color_t color);
 
 /* Creates a new surface with a square drawn based on the given side length and
  * color */
 surface *DL_square (int s, color_t color);
 
-/* Create a new empty surface based on the given width and height */
+/* Create a new empty surface based on the given width and height. No pixels
+ * are allocated for it. */
 surface *DL_empty (int w, int h);
 
+/* Creates a new image surface out of the caller's width by height pixels,
+ * with rows stride bytes apart. ARGB32 pixels are premultiplied 32 bit words
+ * in native byte order, RGB24 the same with the top byte unused, and
+ * RGB16_565 16 bit words. data and stride must be multiples of 4. Nothing is
+ * copied, the surface takes the buffer over and calls release, which may be
+ * NULL, with closure once it is done with it. Returns NULL if the pixels can
+ * not be read in place, and the buffer then stays the caller's. Unless built
+ * with CDRAW_QT_IMAGE the pixels are turned into a pixmap right away, and
+ * release is called before this returns. */
+surface *DL_from_buffer(unsigned char *data, int width, int height, int stride, format_t format, release_func_t release, void *closure);
+
+/* Like DL_from_buffer, but the buffer stays the caller's, who must keep it
+ * alive and unchanged for as long as the surface or anything composed from
+ * it is around. It is never drawn on, DL_make_writable copies it. */
+surface *DL_from_buffer_borrowed(const unsigned char *data, int width, int height, int stride, format_t format);
+
 /* Creates a new surface with the given text drawn on it with the given font 
- * and font size and color used. */
+ * and font size and color used. Surfaces for text that was drawn before are
+ * shared out of the text cache. */
 surface *DL_text(const char* text, int size, color_t color, const char* font, unsigned char bold, unsigned char italics);
 
+/* Creates a new surface with the given text drawn on it as a paragraph,
+ * breaking lines at its line breaks and, if maxWidth is above 0, between
+ * words so no line is wider than maxWidth. A word wider than maxWidth gets a
+ * line of its own. Paragraphs are shared out of the text cache too. */
+surface *DL_paragraph(const char* text, int size, color_t color, const char* font, unsigned char bold, unsigned char italics, int maxWidth);
+
+/* Fills in metrics with the size of the surface DL_text would draw text on,
+ * and the ascent and descent of the font, without drawing anything */
+void DL_text_measure(const char* text, int size, const char* font, unsigned char bold, unsigned char italics, text_metrics_t *metrics);
+
+/* The same for count texts in the same font at once, filling in metrics[i]
+ * for texts[i]. The font is looked up once for all of them. */
+void DL_text_measure_batch(const char* const* texts, int count, int size, const char* font, unsigned char bold, unsigned char italics, text_metrics_t *metrics);
+
+/* Sets how many bytes of finished text surfaces and cached glyph coverage
+ * the text cache may hold. Setting it to 0 turns the cache off. The default
+ * is 16MB. */
+void DL_text_cache_set_budget(size_t bytes);
+
+/* Fills in stats with the text cache's hit and miss counters and how many
+ * bytes it currently holds. */
+void DL_text_cache_get_stats(text_cache_stats_t *stats);
+
+/* Empties the text and font caches and resets the counters. Surfaces handed
+ * out from the cache stay valid. */
+void DL_text_cache_clear(void);
+
+/* Sets how many bytes of surfaces the combinators may keep to share between
+ * identical calls. While set, DL_rectangle, DL_empty, DL_beside_align,
+ * DL_above_align, DL_overlay, their _n forms and DL_grid hand back the
+ * surface an earlier call with the same arguments made, rather than making it
+ * again. Surfaces passed in are matched by identity, so leaves should come
+ * from here or the text cache for their combinations to match. Setting it to
+ * 0, the default, turns memoization off and frees what it held. */
+void DL_memo_set_budget(size_t bytes);
+
+/* Fills in stats with the memo table's hit and miss counters and how many
+ * bytes of surfaces it currently holds. */
+void DL_memo_get_stats(memo_stats_t *stats);
+
+/* Empties the memo table and resets the counters. Surfaces handed out from
+ * it stay valid. */
+void DL_memo_clear(void);
+
 /* Overlays the front surface over the back surface, aligned at the middle */
 surface *DL_overlay (surface *back, surface *front);
 
+/* Creates a new surface with all count surfaces drawn beside each other from
+ * left to right, aligned as per align. The result is drawn in one go, so
+ * this is much cheaper than chaining DL_beside_align. Centered surfaces are
+ * centered against the whole result, which can put them a pixel away from
+ * where chained calls would.
+ *
+ * Alignments are either TOP, BOTTOM, or CENTER */
+surface *DL_beside_n (surface **surfs, int count, align_t align);
+
+/* Creates a new surface with all count surfaces drawn above each other from
+ * top to bottom, aligned as per align. The result is drawn in one go, so
+ * this is much cheaper than chaining DL_above_align. Centered surfaces are
+ * centered against the whole result, which can put them a pixel away from
+ * where chained calls would.
+ *
+ * Alignments are either LEFT, RIGHT, or CENTER */
+surface *DL_above_n (surface **surfs, int count, align_t align);
+
+/* Overlays all count surfaces on top of each other, aligned at the middle.
+ * The first surface is at the back and the last one is at the front. Like
+ * DL_overlay, but drawn in one go. */
+surface *DL_overlay_n (surface **surfs, int count);
+
+/* Creates a new surface with rows * cols cells laid out in a grid. cells is
+ * row major, so the cell at row r and column c is cells[r * cols + c], and a
+ * cell may be NULL to leave it blank. Every column is as wide as its widest
+ * cell and every row as tall as its tallest cell. Within its row a cell is
+ * aligned by rowAlign[r], TOP, BOTTOM, or CENTER, and within its column by
+ * colAlign[c], LEFT, RIGHT, or CENTER. Either array may be NULL to center
+ * everything that way. The whole grid is drawn into the result in one go. */
+surface *DL_grid (surface **cells, int rows, int cols, align_t *rowAlign, align_t *colAlign);
+
+/* Creates a new surface showing the width by height part of surf whose top
+ * left corner is at x, y, clipped to surf. No pixels are copied, the result
+ * reads them out of surf, which it keeps alive. */
+surface *DL_crop (surface *surf, int x, int y, int width, int height);
+
+/* Creates a new surface with surf in it and left, top, right and bottom
+ * pixels of transparent space around it. Negative amounts are taken as 0.
+ * No pixels are copied or allocated. */
+surface *DL_pad (surface *surf, int left, int top, int right, int bottom);
+
 /* Get the width of the surface */
 int DL_get_width(surface *surf);
 
 /* Get the height of the surface */
 int DL_get_height(surface *surf);
 
-/* Free the surface */
+/* Free the surface. Surfaces are reference counted, this drops one
+ * reference and the surface goes away once the last one is dropped. */
 void DL_free_surface(surface *surf);
 
+/* Takes another reference to the surface and returns it. Each reference is
+ * dropped with its own call to DL_free_surface. */
+surface *DL_retain_surface(surface *surf);
+
+/* Surfaces may be shared, by other references, by the text cache, or by the
+ * surfaces composed from them, so they must not be drawn on directly. This
+ * takes over the caller's reference to surf and returns an image surface
+ * which the caller is the only owner of and may draw on. If surf already is
+ * such a surface it is returned as is, otherwise it is copied. A surface
+ * owned by an arena must be retained before it is passed in, and what comes
+ * back is never owned by an arena. */
+surface *DL_make_writable(surface *surf);
+
+#ifdef __cplusplus
+#ifdef CDRAW_QT_IMAGE
+class QImage;
+
+/* Get the image behind an image surface, or NULL if the surface is not an
+ * image. Call DL_make_writable first if you are going to draw on it. */
+QImage *DL_get_image(surface *surf);
+#else
+class QPixmap;
+
+/* Get the pixmap behind an image surface, or NULL if the surface is not an
+ * image. Call DL_make_writable first if you are going to draw on it. */
+QPixmap *DL_get_pixmap(surface *surf);
+#endif
+#endif
+
+/* Turns lazy composition on or off. While lazy mode is on, DL_beside_align,
+ * DL_above_align and DL_overlay do not draw anything, they return a small
+ * node which remembers its children and where they go. The pixels are only
+ * produced once, when the final surface is passed to DL_render. Lazy mode is
+ * off by default. */
+void DL_set_lazy(unsigned char lazy);
+
+/* Sets what DL_text draws text into. FORMAT_A8 keeps just how much of each
+ * pixel the glyphs cover, as a QImage::Format_Alpha8 image a quarter of the
+ * size, and the color is filled through it wherever the text is drawn.
+ * DL_get_image hands such images back as they are, so draw them with
+ * DL_render rather than directly. Anything else is taken as FORMAT_ARGB32,
+ * the default. Text already in the text cache keeps the format it was drawn
+ * in. Only takes effect when built with CDRAW_QT_IMAGE, pixmaps are kept in
+ * whatever format the platform wants. */
+void DL_set_text_format(format_t format);
+
+/* Sets what opaque images are kept in once drawn by the combinators or by
+ * DL_render. FORMAT_RGB24 keeps them as QImage::Format_RGB32, and
+ * FORMAT_RGB16_565 as QImage::Format_RGB16, half the memory at the cost of
+ * the low bits of each channel. Anything else is taken as FORMAT_ARGB32, the
+ * default. Surfaces of any format may be composed together, the result is
+ * ARGB32 unless it is opaque. Only takes effect when built with
+ * CDRAW_QT_IMAGE. */
+void DL_set_opaque_format(format_t format);
+
+/* Returns the format the pixels of the surface are kept in. Surfaces which
+ * have not been drawn yet, like rectangles or lazy groups, and pixmaps, are
+ * reported as FORMAT_ARGB32. */
+format_t DL_get_format(surface *surf);
+
+/* Draws the given surface, and everything it was composed from, into a new
+ * image. This is where a surface built in lazy mode actually gets its
+ * pixels. */
+surface *DL_render(surface *surf);
+
+/* Sets how many threads are used to draw large images, counting the calling
+ * thread. 1, the default, draws everything on the calling thread. 0 uses
+ * one thread per core. The output is the same either way. Only builds with
+ * CDRAW_QT_IMAGE use more than one thread. Pixmaps are only safe to paint on
+ * the GUI thread, so other builds draw everything on the calling thread,
+ * DL_render_async included. */
+void DL_set_threads(int count);
+
+/* Starts drawing the given surface, and everything it was composed from, on
+ * a render thread, and returns straight away. Renders are started in the
+ * order they were asked for, on as many threads as DL_set_threads allows,
+ * so independent surfaces are drawn side by side. The future holds its own
+ * reference on the surface, and is freed with DL_future_free. Unless built
+ * with CDRAW_QT_IMAGE, pixmaps are only safe to paint on the GUI thread, so
+ * the surface is drawn before this returns and the future is done straight
+ * away. */
+future_t *DL_render_async(surface *surf);
+
+/* Whether the render is done, so DL_future_wait will not block */
+int DL_future_ready(future_t *future);
+
+/* Waits for the render to be done and returns the image it drew. The caller
+ * gets a reference of its own. */
+surface *DL_future_wait(future_t *future);
+
+/* Returns a surface the size of the image the render will draw, which can be
+ * composed like any other while the render is still running. Only drawing
+ * it waits for the render, so a tree built on it in lazy mode can itself be
+ * handed to DL_render_async without waiting. Composing it in eager mode
+ * draws it, and so waits. */
+surface *DL_future_get_surface(future_t *future);
+
+/* Drops the caller's reference to the future. A render still running is
+ * finished regardless. */
+void DL_future_free(future_t *future);
+
+/* Draws the given surface and writes it to fd as a PNG. The image is drawn
+ * and encoded a band of rows at a time, so only a band is ever held in
+ * memory, however tall the surface is. Returns 0 on success and -1 if
+ * anything could not be written. */
+int DL_write_png(surface *surf, int fd);
+
+/* Like DL_write_png, but the PNG is handed to write, along with closure,
+ * instead of being written to a file descriptor. */
+int DL_write_png_stream(surface *surf, write_func_t write, void *closure);
+
+/* Draws the given surface and writes its raw pixels to fd, a band of rows at
+ * a time. There is no header, the rows are written top to bottom, each
+ * width * 4 bytes long, with every pixel a native endian premultiplied ARGB32
+ * value. Returns 0 on success and -1 if anything could not be written. */
+int DL_write_raw(surface *surf, int fd);
+
+/* Like DL_write_raw, but the pixels are handed to write, along with closure,
+ * instead of being written to a file descriptor. */
+int DL_write_raw_stream(surface *surf, write_func_t write, void *closure);
+
+/* Sets the directory surfaces are stored in by DL_disk_cache_store and
+ * loaded from by DL_disk_cache_load. It must already exist. Several
+ * processes may share one, each file is written whole under a temporary
+ * name and then renamed into place. NULL, the default, turns the cache off. */
+void DL_disk_cache_set_dir(const char *dir);
+
+/* Draws the given surface and stores it in the disk cache under key, in place
+ * of anything stored under it before. The key should name everything the
+ * surface was made from, a later DL_disk_cache_load with the same key gets
+ * these pixels back without drawing anything. Returns 0 on success and -1 if
+ * there is no cache directory or the file could not be written. */
+int DL_disk_cache_store(surface *surface, const char *key);
+
+/* Returns the surface stored in the disk cache under key, or NULL if there
+ * is none. Nothing is decoded, the file is mapped read only and shared with
+ * every other process that loaded it. Built with CDRAW_QT_IMAGE the image
+ * uses the mapped pages as they are, otherwise they are copied once into a
+ * pixmap. Drawing on the image copies it first, as with any QImage. */
+surface *DL_disk_cache_load(const char *key);
+
+/* Sets how many bytes of free pixel buffers the pool may hold on to for
+ * reuse. Images of about the same size as one freed earlier reuse its buffer
+ * rather than allocating a new one. Setting it to 0 turns the pool off. The
+ * default is 32MB. */
+void DL_pool_set_budget(size_t bytes);
+
+/* Fills in stats with the pool's counters */
+void DL_pool_get_stats(pool_stats_t *stats);
+
+/* Frees every buffer the pool holds and resets the counters. Buffers of live
+ * surfaces are not affected. */
+void DL_pool_clear(void);
+
+/* Opens an arena on the calling thread. Until the matching DL_arena_end, all
+ * surfaces created on that thread belong to the arena and must not be passed
+ * to DL_free_surface. Arenas nest, a surface belongs to the innermost one.
+ * This suits building a frame out of many throwaway surfaces. */
+void DL_arena_begin(void);
+
+/* Closes the arena last opened on the calling thread and frees every surface
+ * created while it was open. Surfaces needed afterwards must be kept with
+ * DL_retain_surface first. */
+void DL_arena_end(void);
+
+/* The functions below report what CDraw spends its time on. They are only
+ * useful when CDraw is built with CDRAW_STATS, otherwise nothing is counted
+ * and the instrumentation costs nothing. */
+
+/* Fills in up to count entries of stats, one for each counted DL_* function
+ * and backend operation, and returns how many entries there are in all.
+ * Calls which make, draw, wait for or write out a surface are counted;
+ * settings, cache controls and the like are not. Returns 0 if CDraw was
+ * built without CDRAW_STATS. */
+int DL_get_stats(call_stats_t *stats, int count);
+
+/* Sets every counter back to zero and throws away the trace events */
+void DL_reset_stats(void);
+
+/* Turns recording of trace events on or off. While on, every counted call
+ * also leaves an event behind for DL_write_trace, up to 65536 of them. Off by
+ * default. */
+void DL_set_tracing(unsigned char on);
+
+/* Writes the counters out through write as a JSON object holding an array
+ * of calls, each with its name, calls, bytes, pixels and nanoseconds.
+ * Returns 0 on success and -1 if anything could not be written. */
+int DL_write_stats_json(write_func_t write, void *closure);
+
+/* Writes the trace events recorded so far out through write in the Chrome
+ * trace event format, which chrome://tracing and Perfetto load. Should not
+ * be called while other threads are drawing. Returns 0 on success and -1 if
+ * anything could not be written. */
+int DL_write_trace(write_func_t write, void *closure);
+
+/* Renders root into an image and keeps both, so that leaves of root can be
+ * swapped later on and only the parts of the image they cover repainted.
+ * This suits panels redrawn many times a second where little changes from
+ * one frame to the next. root should be built in lazy mode, since a surface
+ * drawn eagerly no longer knows what it was made of. The composition takes
+ * its own reference on root. */
+composition_t *DL_composition_new(surface *root);
+
+/* Returns the image the composition was last rendered into. It belongs to
+ * the composition and is only valid until the next DL_composition_update.
+ * Retain it to keep it, the composition then leaves it alone and repaints
+ * a copy instead. */
+surface *DL_composition_get_image(composition_t *comp);
+
+/* Swaps every use of the leaf old in the composition's tree for replacement,
+ * which must be the same size, and marks where it was as damaged. Nothing is
+ * drawn until DL_composition_update. Returns how many uses were swapped, or
+ * -1 if the sizes differ. To swap in a label of a different width, give the
+ * label a fixed size to begin with, say by overlaying it on a DL_empty. */
+int DL_composition_replace(composition_t *comp, surface *old, surface *replacement);
+
+/* Repaints the damaged parts of the composition's image. Up to max of the
+ * repainted rectangles are stored in damage, so just those parts can be
+ * uploaded, and the number stored is returned. If there were more than max
+ * of them, damage[0] is set to a rectangle covering all of them. Returns 0
+ * if nothing had changed. */
+int DL_composition_update(composition_t *comp, rect_t *damage, int max);
+
+/* Frees the composition, its tree, and its image unless it was retained */
+void DL_composition_free(composition_t *comp);
+
 #endif /* CDRAW_H */
@@ -0,0 +1,475 @@
+/* Pixel copying shared by the CDraw ports */
+
+#include "cdraw-blit.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+/* The vector kernels need GCC or clang to build them for a CPU the rest of
+ * the library is not built for, and to ask the CPU what it has */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLIT_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*over_row_t)(uint32_t *dst, const uint32_t *src, int count);
+
+/* Adds two pixels channel by channel, stopping at 255 */
+static uint32_t add_saturate(uint32_t x, uint32_t y) {
+    uint32_t rb, ag;
+
+    rb = (x & 0xff00ff) + (y & 0xff00ff);
+    rb |= 0x10000100 - ((rb >> 8) & 0xff00ff);
+
+    ag = ((x >> 8) & 0xff00ff) + ((y >> 8) & 0xff00ff);
+    ag |= 0x10000100 - ((ag >> 8) & 0xff00ff);
+
+    return (rb & 0xff00ff) | ((ag & 0xff00ff) << 8);
+}
+
+/* Each channel of p scaled by a, divided by 255 with rounding */
+static uint32_t scale_pixel(uint32_t p, uint32_t a) {
+    uint32_t rb, ag;
+
+    rb = (p & 0xff00ff) * a + 0x800080;
+    rb = ((rb + ((rb >> 8) & 0xff00ff)) >> 8) & 0xff00ff;
+
+    ag = ((p >> 8) & 0xff00ff) * a + 0x800080;
+    ag = (ag + ((ag >> 8) & 0xff00ff)) & 0xff00ff00;
+
+    return rb | ag;
+}
+
+/* s over d. Each channel of d is scaled by 255 minus the alpha of s and s
+ * added on. */
+static uint32_t over_pixel(uint32_t d, uint32_t s) {
+    return add_saturate(scale_pixel(d, 255 - (s >> 24)), s);
+}
+
+static void over_row_c(uint32_t *dst, const uint32_t *src, int count) {
+    uint32_t s;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        s = src[i];
+
+        /* Most pixels are either fully opaque or fully transparent */
+        if (s >= 0xff000000) {
+            dst[i] = s;
+        }
+        else if (s != 0) {
+            dst[i] = over_pixel(dst[i], s);
+        }
+    }
+}
+
+#ifdef BLIT_X86
+/* The same sum as over_pixel, four pixels at a time */
+__attribute__((target("sse2")))
+static __m128i over_sse2(__m128i d, __m128i s) {
+    __m128i zero, alpha, lo, hi, round;
+
+    zero = _mm_setzero_si128();
+    round = _mm_set1_epi16(0x80);
+
+    /* 255 minus the alpha of each pixel, in all four of its channels */
+    alpha = _mm_srli_epi32(s, 24);
+    alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 8));
+    alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 16));
+    alpha = _mm_xor_si128(alpha, _mm_set1_epi32(-1));
+
+    lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(alpha, zero));
+    hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(alpha, zero));
+
+    lo = _mm_add_epi16(lo, round);
+    hi = _mm_add_epi16(hi, round);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+    return _mm_adds_epu8(_mm_packus_epi16(lo, hi), s);
+}
+
+__attribute__((target("sse2")))
+static void over_row_sse2(uint32_t *dst, const uint32_t *src, int count) {
+    __m128i s, opaque, zero;
+    int i, mask;
+
+    zero = _mm_setzero_si128();
+    opaque = _mm_set1_epi32(0xff000000);
+
+    for (i = 0; i + 4 <= count; i += 4) {
+        s = _mm_loadu_si128((const __m128i*)(src + i));
+
+        /* Skip runs of transparent pixels and copy runs of opaque ones */
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi32(s, zero));
+
+        if (mask == 0xffff) {
+            continue;
+        }
+
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(s, opaque), opaque));
+
+        if (mask == 0xffff) {
+            _mm_storeu_si128((__m128i*)(dst + i), s);
+            continue;
+        }
+
+        _mm_storeu_si128((__m128i*)(dst + i),
+                         over_sse2(_mm_loadu_si128((const __m128i*)(dst + i)), s));
+    }
+
+    over_row_c(dst + i, src + i, count - i);
+}
+
+/* The same again, eight pixels at a time */
+__attribute__((target("avx2")))
+static __m256i over_avx2(__m256i d, __m256i s) {
+    __m256i zero, alpha, lo, hi, round;
+
+    zero = _mm256_setzero_si256();
+    round = _mm256_set1_epi16(0x80);
+
+    alpha = _mm256_srli_epi32(s, 24);
+    alpha = _mm256_or_si256(alpha, _mm256_slli_epi32(alpha, 8));
+    alpha = _mm256_or_si256(alpha, _mm256_slli_epi32(alpha, 16));
+    alpha = _mm256_xor_si256(alpha, _mm256_set1_epi32(-1));
+
+    /* Unpacking works within each 128 bit lane, and so does packing, so the
+     * pixels come back out in the order they went in */
+    lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(alpha, zero));
+    hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(alpha, zero));
+
+    lo = _mm256_add_epi16(lo, round);
+    hi = _mm256_add_epi16(hi, round);
+    lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+    hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+
+    return _mm256_adds_epu8(_mm256_packus_epi16(lo, hi), s);
+}
+
+__attribute__((target("avx2")))
+static void over_row_avx2(uint32_t *dst, const uint32_t *src, int count) {
+    __m256i s, opaque;
+    int i;
+
+    opaque = _mm256_set1_epi32(0xff000000);
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        s = _mm256_loadu_si256((const __m256i*)(src + i));
+
+        if (_mm256_testz_si256(s, s)) {
+            continue;
+        }
+
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(s, opaque), opaque)) == -1) {
+            _mm256_storeu_si256((__m256i*)(dst + i), s);
+            continue;
+        }
+
+        _mm256_storeu_si256((__m256i*)(dst + i),
+                            over_avx2(_mm256_loadu_si256((const __m256i*)(dst + i)), s));
+    }
+
+    over_row_sse2(dst + i, src + i, count - i);
+}
+#endif
+
+/* Picked on first use. Every thread picks the same one, so it does not
+ * matter which of them gets to store it. */
+static _Atomic(over_row_t) overRow = NULL;
+static const char *overName = "c";
+
+static over_row_t pick_over_row(void) {
+#ifdef BLIT_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        overName = "avx2";
+        return over_row_avx2;
+    }
+
+    if (__builtin_cpu_supports("sse2")) {
+        overName = "sse2";
+        return over_row_sse2;
+    }
+#endif
+
+    overName = "c";
+    return over_row_c;
+}
+
+static over_row_t get_over_row(void) {
+    over_row_t row = atomic_load_explicit(&overRow, memory_order_acquire);
+
+    if (row == NULL) {
+        row = pick_over_row();
+        atomic_store_explicit(&overRow, row, memory_order_release);
+    }
+
+    return row;
+}
+
+void dl_blit_copy(unsigned char *dst, int dstStride, const unsigned char *src, int srcStride,
+                  int width, int height) {
+    int y;
+
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+
+    /* Whole images with no padding between rows go in one copy */
+    if (dstStride == srcStride && srcStride == width * 4) {
+        memcpy(dst, src, (size_t)srcStride * height);
+        return;
+    }
+
+    for (y = 0; y < height; y++) {
+        memcpy(dst + (size_t)y * dstStride, src + (size_t)y * srcStride, (size_t)width * 4);
+    }
+}
+
+void dl_blit_over(unsigned char *dst, int dstStride, const unsigned char *src, int srcStride,
+                  int width, int height) {
+    over_row_t row;
+    int y;
+
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+
+    row = get_over_row();
+
+    for (y = 0; y < height; y++) {
+        row((uint32_t*)(dst + (size_t)y * dstStride), (const uint32_t*)(src + (size_t)y * srcStride), width);
+    }
+}
+
+void dl_blit_fill(unsigned char *dst, int dstStride, uint32_t pixel, int width, int height) {
+    uint32_t *row;
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        row = (uint32_t*)(dst + (size_t)y * dstStride);
+
+        for (x = 0; x < width; x++) {
+            row[x] = pixel;
+        }
+    }
+}
+
+void dl_blit_copy_opaque(unsigned char *dst, int dstStride, const unsigned char *src, int srcStride,
+                         int width, int height) {
+    const uint32_t *s;
+    uint32_t *d;
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        d = (uint32_t*)(dst + (size_t)y * dstStride);
+        s = (const uint32_t*)(src + (size_t)y * srcStride);
+
+        for (x = 0; x < width; x++) {
+            d[x] = s[x] | 0xff000000;
+        }
+    }
+}
+
+void dl_blit_mask(unsigned char *dst, int dstStride, const unsigned char *mask, int maskStride,
+                  uint32_t pixel, int width, int height) {
+    const unsigned char *m;
+    uint32_t *d;
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        d = (uint32_t*)(dst + (size_t)y * dstStride);
+        m = mask + (size_t)y * maskStride;
+
+        for (x = 0; x < width; x++) {
+            /* Glyphs are mostly either solid or not there at all */
+            if (m[x] == 255 && pixel >= 0xff000000) {
+                d[x] = pixel;
+            }
+            else if (m[x] != 0) {
+                d[x] = over_pixel(d[x], scale_pixel(pixel, m[x]));
+            }
+        }
+    }
+}
+
+void dl_blit_add_mask(unsigned char *dst, int dstStride, const unsigned char *src, int srcStride,
+                      int width, int height) {
+    const unsigned char *s;
+    unsigned char *d;
+    int x, y, sum;
+
+    for (y = 0; y < height; y++) {
+        d = dst + (size_t)y * dstStride;
+        s = src + (size_t)y * srcStride;
+
+        for (x = 0; x < width; x++) {
+            sum = d[x] + s[x];
+            d[x] = sum > 255 ? 255 : sum;
+        }
+    }
+}
+
+void dl_blit_from_565(unsigned char *dst, int dstStride, const unsigned char *src, int srcStride,
+                      int width, int height) {
+    const uint16_t *s;
+    uint32_t *d, r, g, b;
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        d = (uint32_t*)(dst + (size_t)y * dstStride);
+        s = (const uint16_t*)(src + (size_t)y * srcStride);
+
+        for (x = 0; x < width; x++) {
+            /* Repeat the top bits in the bottom ones, so white stays white */
+            r = s[x] >> 11;
+            g = (s[x] >> 5) & 0x3f;
+            b = s[x] & 0x1f;
+
+            d[x] = 0xff000000 | ((r << 3 | r >> 2) << 16) | ((g << 2 | g >> 4) << 8) | (b << 3 | b >> 2);
+        }
+    }
+}
+
+void dl_blit_to_565(unsigned char *dst, int dstStride, const unsigned char *src, int srcStride,
+                    int width, int height) {
+    const uint32_t *s;
+    uint16_t *d;
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        d = (uint16_t*)(dst + (size_t)y * dstStride);
+        s = (const uint32_t*)(src + (size_t)y * srcStride);
+
+        for (x = 0; x < width; x++) {
+            d[x] = (uint16_t)(((s[x] >> 8) & 0xf800) | ((s[x] >> 5) & 0x07e0) | ((s[x] >> 3) & 0x001f));
+        }
+    }
+}
+
+const char *dl_blit_kernel(void) {
+    get_over_row();
+
+    return overName;
+}
+
+int dl_blit_set_kernel(const char *name) {
+    over_row_t row;
+
+    if (strcmp(name, "c") == 0) {
+        overName = "c";
+        row = over_row_c;
+    }
+#ifdef BLIT_X86
+    else if (strcmp(name, "sse2") == 0 && (__builtin_cpu_init(), __builtin_cpu_supports("sse2"))) {
+        overName = "sse2";
+        row = over_row_sse2;
+    }
+    else if (strcmp(name, "avx2") == 0 && (__builtin_cpu_init(), __builtin_cpu_supports("avx2"))) {
+        overName = "avx2";
+        row = over_row_avx2;
+    }
+#endif
+    else {
+        return -1;
+    }
+
+    atomic_store_explicit(&overRow, row, memory_order_release);
+
+    return 0;
+}
+
+void dl_blit_bounds(const unsigned char *data, int stride, int width, int height,
+                    int *x1, int *y1, int *x2, int *y2) {
+    const uint32_t *row;
+    int left, right, top, bottom, x, y;
+
+    left = width;
+    right = 0;
+    top = height;
+    bottom = 0;
+
+    for (y = 0; y < height; y++) {
+        row = (const uint32_t*)(data + (size_t)y * stride);
+
+        /* Premultiplied, so a transparent pixel is all zeroes */
+        for (x = 0; x < width && row[x] == 0; x++);
+
+        if (x == width) {
+            continue;
+        }
+
+        if (x < left) {
+            left = x;
+        }
+
+        for (x = width - 1; row[x] == 0; x--);
+
+        if (x + 1 > right) {
+            right = x + 1;
+        }
+
+        if (top == height) {
+            top = y;
+        }
+
+        bottom = y + 1;
+    }
+
+    if (left >= right) {
+        left = right = top = bottom = 0;
+    }
+
+    *x1 = left;
+    *y1 = top;
+    *x2 = right;
+    *y2 = bottom;
+}
+
+void dl_blit_mask_bounds(const unsigned char *data, int stride, int width, int height,
+                         int *x1, int *y1, int *x2, int *y2) {
+    const unsigned char *row;
+    int left, right, top, bottom, x, y;
+
+    left = width;
+    right = 0;
+    top = height;
+    bottom = 0;
+
+    for (y = 0; y < height; y++) {
+        row = data + (size_t)y * stride;
+
+        for (x = 0; x < width && row[x] == 0; x++);
+
+        if (x == width) {
+            continue;
+        }
+
+        if (x < left) {
+            left = x;
+        }
+
+        for (x = width - 1; row[x] == 0; x--);
+
+        if (x + 1 > right) {
+            right = x + 1;
+        }
+
+        if (top == height) {
+            top = y;
+        }
+
+        bottom = y + 1;
+    }
+
+    if (left >= right) {
+        left = right = top = bottom = 0;
+    }
+
+    *x1 = left;
+    *y1 = top;
+    *x2 = right;
+    *y2 = bottom;
+}
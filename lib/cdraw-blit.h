@@ -0,0 +1,76 @@
+/* Pixel copying shared by the CDraw ports */
+/* Everything the combinators place lands at a whole pixel offset, unscaled,
+ * so drawing it comes down to copying or compositing rows of premultiplied
+ * ARGB32 pixels. These do that directly, with SSE2 or AVX2 where the CPU
+ * has them, picked the first time they are used. */
+
+#ifndef CDRAW_BLIT_H
+#define CDRAW_BLIT_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Copies a width by height block of pixels from src to dst. Rows are
+ * srcStride and dstStride bytes apart. */
+void dl_blit_copy(unsigned char *dst, int dstStride, const unsigned char *src, int srcStride,
+                  int width, int height);
+
+/* Composites a width by height block of premultiplied pixels from src over
+ * dst. Rounds the same way pixman does, so the result matches cairo's. */
+void dl_blit_over(unsigned char *dst, int dstStride, const unsigned char *src, int srcStride,
+                  int width, int height);
+
+/* Sets a width by height block of dst to pixel */
+void dl_blit_fill(unsigned char *dst, int dstStride, uint32_t pixel, int width, int height);
+
+/* Copies a width by height block of pixels whose alpha is undefined, as in
+ * RGB24 images, from src to dst, making them fully opaque */
+void dl_blit_copy_opaque(unsigned char *dst, int dstStride, const unsigned char *src, int srcStride,
+                         int width, int height);
+
+/* Composites pixel, premultiplied, over a width by height block of dst
+ * through the 8 bit coverage in mask. Rounds the same way pixman does. */
+void dl_blit_mask(unsigned char *dst, int dstStride, const unsigned char *mask, int maskStride,
+                  uint32_t pixel, int width, int height);
+
+/* Adds a width by height block of 8 bit coverage from src to dst, clamping
+ * at 255, the way pixman builds up the mask for a run of glyphs */
+void dl_blit_add_mask(unsigned char *dst, int dstStride, const unsigned char *src, int srcStride,
+                      int width, int height);
+
+/* Copies a width by height block of RGB16_565 pixels from src to dst,
+ * widening them to opaque ARGB32 */
+void dl_blit_from_565(unsigned char *dst, int dstStride, const unsigned char *src, int srcStride,
+                      int width, int height);
+
+/* Copies a width by height block of opaque ARGB32 pixels from src to dst,
+ * packing them into RGB16_565 by dropping the low bits as pixman does */
+void dl_blit_to_565(unsigned char *dst, int dstStride, const unsigned char *src, int srcStride,
+                    int width, int height);
+
+/* Finds the smallest rectangle, from x1, y1 up to but not including x2, y2,
+ * outside of which every pixel of a width by height image is transparent.
+ * All four are 0 if every pixel is. */
+void dl_blit_bounds(const unsigned char *data, int stride, int width, int height,
+                    int *x1, int *y1, int *x2, int *y2);
+
+/* The same for an 8 bit mask */
+void dl_blit_mask_bounds(const unsigned char *data, int stride, int width, int height,
+                         int *x1, int *y1, int *x2, int *y2);
+
+/* The name of the kernel dl_blit_over uses, "avx2", "sse2" or "c" */
+const char *dl_blit_kernel(void);
+
+/* Makes dl_blit_over use the kernel of the given name from now on, so the
+ * kernels can be checked against each other. Returns 0 on success, -1 if
+ * there is no such kernel or the CPU does not have what it needs. */
+int dl_blit_set_kernel(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CDRAW_BLIT_H */
@@ -2,6 +2,31 @@
 /* This port is for the most part platform agnostic */
 
 #include <cairo/cairo.h>
+#ifdef CDRAW_PANGO
+#include <pango/pangocairo.h>
+#endif
+#ifdef CAIRO_HAS_PDF_SURFACE
+#include <cairo/cairo-pdf.h>
+#endif
+#ifdef CAIRO_HAS_SVG_SURFACE
+#include <cairo/cairo-svg.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cdraw-blit.h"
+#include "cdraw-disk.h"
+#include "cdraw-png.h"
+#include "cdraw-pool.h"
+#include "cdraw-stats.h"
 
 typedef struct color_t {
     unsigned char r;
@@ -18,300 +43,5068 @@ typedef enum align_t {
     RIGHT
 } align_t;
 
+/* Pixel formats images may be kept in, see DL_set_text_format */
+typedef enum format_t {
+    FORMAT_ARGB32,
+    FORMAT_RGB24,
+    FORMAT_A8,
+    FORMAT_RGB16_565
+} format_t;
+
 typedef cairo_surface_t surface;
 
-/* Creates a new surface with the given left and right surfaces drawn beside
- * each other, aligned as per align.
- *
- * Alignments are either TOP, BOTTOM, or CENTER */
-surface *DL_beside_align (surface *left, surface *right, align_t align) {
-    surface *new;
-    cairo_t *cr;
-    int newWidth, newHeight;
-    int x, y;
-    int leftW, leftH, rightW, rightH;
+/* Counters for the text cache, see DL_text_cache_get_stats */
+typedef struct text_cache_stats_t {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t bytes;
+    size_t budget;
+} text_cache_stats_t;
 
-    /* Get the width of our left surface */
-    leftW = cairo_image_surface_get_width(left);
-    leftH = cairo_image_surface_get_height(left);
+/* The size of a line of text, see DL_text_measure */
+typedef struct text_metrics_t {
+    int width;
+    int height;
+    int ascent;
+    int descent;
+} text_metrics_t;
 
-    /* Same for the right */
-    rightW = cairo_image_surface_get_width(right);
-    rightH = cairo_image_surface_get_height(right);
+/* Counters for the combinator memo table, see DL_memo_get_stats */
+typedef struct memo_stats_t {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t bytes;
+    size_t budget;
+} memo_stats_t;
 
-    /* Since we are placing the images beside one another, the new width will
-     * be the sum of the left and right width. And the height will be the
-     * height of the larger surface */
+/* Counters for the pixel buffer pool, see DL_pool_get_stats */
+typedef struct pool_stats_t {
+    unsigned long requests;
+    unsigned long reuses;
+    size_t bytes;
+    size_t pooled;
+    size_t peak;
+    size_t budget;
+} pool_stats_t;
 
-    newWidth = leftW + rightW;
+typedef int (*write_func_t)(void *closure, const unsigned char *data, size_t length);
 
-    if(leftH > rightH) {
-        newHeight = leftH;
-    }
-    else{
-        newHeight = rightH;
-    }
+typedef void (*release_func_t)(void *closure);
 
-    /* Create our new surface, and get a cairo context for it */
-    new = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, newWidth, newHeight);
-    cr = cairo_create(new);
+/* A rectangle in pixels, see DL_composition_update */
+typedef struct rect_t {
+    int x;
+    int y;
+    int width;
+    int height;
+} rect_t;
 
-    /* The x to draw our left side image will always be 0, our y will change
-     * based on our align, so perform those calculations here then draw it to
-     * our new surface */
-    x = 0;
+/* Every surface we hand out is a real cairo surface. Surfaces which are not
+ * plain image surfaces carry a node describing what they hold, attached to
+ * the cairo surface as user data. A surface without a node is treated as an
+ * image surface. */
+typedef enum node_kind_t {
+    NODE_EMPTY,
+    NODE_SOLID,
+    NODE_GROUP,
+    NODE_TEXT,
+    NODE_PENDING,
+    NODE_VIEW
+} node_kind_t;
 
-    if (align == TOP)           y = 0;
-    else if(align == BOTTOM)    y = newHeight - leftH;
-    else                        y = (newHeight / 2.0) - (leftH / 2.0);
+/* A child of a group, drawn at x, y relative to the top left of the group */
+typedef struct child_t {
+    surface *surf;
+    int x;
+    int y;
 
-    cairo_set_source_surface (cr, left, x, y);
-    cairo_paint (cr);
+    /* Set by mark_hidden on children which draw nothing, or which are
+     * entirely under an opaque child drawn after them. Painting skips them. */
+    unsigned char hidden;
+} child_t;
 
-    /* Now do the same for the right side. The y is the same process as the
-     * left, but this time the x is the width of left image. */
-    x = leftW;
+typedef struct node_t {
+    node_kind_t kind;
+    int width;
+    int height;
 
-    if (align == TOP)           y = 0;
-    else if(align == BOTTOM)    y = newHeight - rightH;
-    else                        y = (newHeight / 2.0) - (rightH / 2.0);
+    /* The color of a solid or a text */
+    color_t color;
 
-    cairo_set_source_surface (cr, right, x, y);
-    cairo_paint (cr);
+    /* A text recorded in vector mode, laid out once to be drawn from */
+    struct text_layout_t *layout;
 
-    /* We are done drawing, kill our cairo context */
-    cairo_destroy(cr);
+    /* Set when every pixel is fully opaque, so drawing it is a plain copy */
+    unsigned char opaque;
+
+    /* Set once what the node shows has been recorded into its surface, see
+     * DL_get_cairo_surface */
+    unsigned char recorded;
+
+    /* Every pixel outside of bounds is fully transparent */
+    rect_t bounds;
+
+    /* Children of a group, in the order they are painted. The group holds a
+     * reference on each of them. A view has one child, the surface it shows
+     * part of. */
+    int count;
+    child_t *children;
+
+    /* The render a pending surface stands in for. The node holds a
+     * reference on it. */
+    struct future_t *future;
+} node_t;
+
+static const cairo_user_data_key_t nodeKey;
+
+/* What we know about the pixels of an image surface, worked out when it is
+ * made. Image surfaces without one may have anything anywhere. */
+typedef struct image_info_t {
+    unsigned char opaque;
+    rect_t bounds;
+
+    /* Set on A8 images of text, which are drawn by filling color through
+     * them rather than as they are */
+    unsigned char mask;
+    color_t color;
+} image_info_t;
+
+static const cairo_user_data_key_t infoKey;
+
+/* Image surfaces loaded from the disk cache draw their pixels straight out
+ * of a read only mapping of the file, which this unmaps when they go */
+typedef struct mapping_t {
+    void *data;
+    size_t length;
+} mapping_t;
+
+static const cairo_user_data_key_t mappingKey;
+
+/* Image surfaces made by DL_from_buffer and DL_from_buffer_borrowed draw
+ * their pixels straight out of the caller's buffer. Buffers which were
+ * handed over are given back through release once the surface goes. */
+typedef struct import_t {
+    unsigned char borrowed;
+    release_func_t release;
+    void *closure;
+} import_t;
+
+static const cairo_user_data_key_t importKey;
+
+/* Image surfaces made by DL_crop draw their pixels straight out of the image
+ * they were cut from, and hold a reference on it under this key */
+static const cairo_user_data_key_t viewKey;
 
-    return new;
+/* Whether the combinators build groups instead of drawing right away */
+static unsigned char lazyMode = 0;
+
+/* Whether DL_text records text instead of drawing it. Combinators build
+ * groups as well, so nothing is drawn at a fixed size. */
+static unsigned char vectorMode = 0;
+
+/* What DL_text draws into, ARGB32 or an A8 mask */
+static cairo_format_t textFormat = CAIRO_FORMAT_ARGB32;
+
+/* What opaque images are kept in once drawn, ARGB32, RGB24 or RGB16_565 */
+static cairo_format_t opaqueFormat = CAIRO_FORMAT_ARGB32;
+
+static node_t *get_node(surface *surf) {
+    return cairo_surface_get_user_data(surf, &nodeKey);
 }
 
-/* Creates a new surface with the given left and right surfaces drawn beside
- * each other, aligned at the center of each surface. */
-surface *DL_beside (surface *left, surface *right) {
-    return DL_beside_align(left, right, CENTER);
+static int get_width(surface *surf) {
+    node_t *node = get_node(surf);
+
+    if (node != NULL) {
+        return node->width;
+    }
+
+    return cairo_image_surface_get_width(surf);
 }
 
-/* Creates a new surface with the given top and bottom surfaces on positioned
- * vertically relative to each other, algined by align.
- *
- * Alignments are either LEFT, RIGHT, or CENTER */
-surface *DL_above_align(surface *top, surface *bottom, align_t align) {
-    surface *ret;
-    cairo_t *cr;
-    int newWidth, newHeight;
-    int topW, topH, botW, botH;
-    int x, y;
+static int get_height(surface *surf) {
+    node_t *node = get_node(surf);
+
+    if (node != NULL) {
+        return node->height;
+    }
 
-    topW = cairo_image_surface_get_width(top);
-    topH = cairo_image_surface_get_height(top);
+    return cairo_image_surface_get_height(surf);
+}
 
-    botW = cairo_image_surface_get_width(bottom);
-    botH = cairo_image_surface_get_height(bottom);
+/* Whether every pixel of surf is fully opaque */
+static int is_opaque(surface *surf) {
+    node_t *node = get_node(surf);
+    image_info_t *info;
 
-    if (botW > topW) {
-        newWidth = botW;
+    if (node != NULL) {
+        return node->opaque;
     }
-    else{
-        newWidth = topW;
+
+    info = cairo_surface_get_user_data(surf, &infoKey);
+
+    return info != NULL && info->opaque;
+}
+
+/* The part of surf outside of which every pixel is fully transparent */
+static rect_t get_bounds(surface *surf) {
+    node_t *node = get_node(surf);
+    image_info_t *info;
+    rect_t ret;
+
+    if (node != NULL) {
+        return node->bounds;
     }
 
-    newHeight = topH + botH;
+    info = cairo_surface_get_user_data(surf, &infoKey);
 
-    ret = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, newWidth, newHeight);
-    cr = cairo_create(ret);
+    if (info != NULL) {
+        return info->bounds;
+    }
 
-    y = 0;
+    ret.x = 0;
+    ret.y = 0;
+    ret.width = get_width(surf);
+    ret.height = get_height(surf);
 
-    if (align == LEFT)          x = 0;
-    else if(align == RIGHT)     x = newWidth - topW;
-    else                        x = (newWidth / 2.0) - (topW / 2.0);
+    return ret;
+}
 
-    cairo_set_source_surface (cr, top, x, y);
-    cairo_paint (cr);
+/* Records what is known about the pixels of the image surface surf */
+static void set_info(surface *surf, int opaque, rect_t bounds) {
+    image_info_t *info = cairo_surface_get_user_data(surf, &infoKey);
 
-    y = topH;
-    if (align == LEFT)          x = 0;
-    else if(align == RIGHT)     x = newWidth - botW;
-    else                        x = (newWidth / 2.0) - (botW / 2.0);
+    if (info == NULL) {
+        info = calloc(1, sizeof(image_info_t));
 
-    cairo_set_source_surface (cr, bottom, x, y);
-    cairo_paint (cr);
+        if (cairo_surface_set_user_data(surf, &infoKey, info, free) != CAIRO_STATUS_SUCCESS) {
+            free(info);
+            return;
+        }
+    }
 
-    cairo_destroy(cr);
+    info->opaque = opaque;
+    info->bounds = bounds;
+}
 
-    return ret;
+/* Marks the A8 image surface surf, which has been through find_bounds, as a
+ * mask color is filled through */
+static void set_mask(surface *surf, color_t color) {
+    image_info_t *info = cairo_surface_get_user_data(surf, &infoKey);
+
+    if (info != NULL) {
+        info->mask = 1;
+        info->color = color;
+    }
 }
 
-/* Creates a new surface with the given top and bottom surfaces on positioned
- * vertically relative to each other, algined at the center. */
-surface *DL_above(surface *top, surface *bot) {
-    return DL_above_align(top, bot, CENTER);
+/* Whether surf reads its pixels out of a buffer the caller kept */
+static int is_borrowed(surface *surf) {
+    import_t *import = cairo_surface_get_user_data(surf, &importKey);
+
+    return import != NULL && import->borrowed;
 }
 
-/* Creates a new surface with a rectangle drawn based on the given width,
- * height, and color. */
-surface *DL_rectangle (int width, int height, color_t color) {
-    surface *ret;
-    cairo_t *cr;
+/* Forgets everything known about the pixels of the image surface surf */
+static void clear_info(surface *surf) {
+    cairo_surface_set_user_data(surf, &infoKey, NULL, NULL);
+}
 
-    /* Create our new surface and get a cairo context for it */
-    ret = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-    cr = cairo_create(ret);
+/* Looks over the pixels of the freshly drawn image surface surf for the
+ * part that is not transparent, for surfaces whose drawing leaves a lot of
+ * it empty, like text */
+static void find_bounds(surface *surf) {
+    rect_t bounds;
+    int x2, y2;
 
-    /* Set our brush color for the rectangle, then draw it */
-    cairo_set_source_rgb(cr, (double)(color.r / 255.0), (double)(color.g / 255.0), (double)(color.b / 255.0));
+    cairo_surface_flush(surf);
 
-    cairo_rectangle(cr, 0, 0, width, height);
-    cairo_paint(cr);
+    if (cairo_image_surface_get_data(surf) == NULL) {
+        return;
+    }
 
-    /* We are done drawing here */
-    cairo_destroy(cr);
+    if (cairo_image_surface_get_format(surf) == CAIRO_FORMAT_A8) {
+        dl_blit_mask_bounds(cairo_image_surface_get_data(surf), cairo_image_surface_get_stride(surf),
+                            cairo_image_surface_get_width(surf), cairo_image_surface_get_height(surf),
+                            &bounds.x, &bounds.y, &x2, &y2);
+    }
+    else {
+        dl_blit_bounds(cairo_image_surface_get_data(surf), cairo_image_surface_get_stride(surf),
+                       cairo_image_surface_get_width(surf), cairo_image_surface_get_height(surf),
+                       &bounds.x, &bounds.y, &x2, &y2);
+    }
 
-    return ret;
+    bounds.width = x2 - bounds.x;
+    bounds.height = y2 - bounds.y;
+
+    set_info(surf, 0, bounds);
 }
 
-/* Creates a new surface with a square drawn based on the given side length and
- * color */
-surface *DL_square (int side, color_t color) {
-    return DL_rectangle(side, side, color);
+/* Grows into so it also covers r. Empty rectangles cover nothing. */
+static void union_rect(rect_t *into, const rect_t *r) {
+    int x2, y2;
+
+    if (r->width <= 0 || r->height <= 0) {
+        return;
+    }
+
+    if (into->width <= 0 || into->height <= 0) {
+        *into = *r;
+        return;
+    }
+
+    x2 = into->x + into->width > r->x + r->width ? into->x + into->width : r->x + r->width;
+    y2 = into->y + into->height > r->y + r->height ? into->y + into->height : r->y + r->height;
+
+    into->x = into->x < r->x ? into->x : r->x;
+    into->y = into->y < r->y ? into->y : r->y;
+    into->width = x2 - into->x;
+    into->height = y2 - into->y;
 }
 
-/* Create a new empty surface based on the given width and height */
-surface *DL_empty (int width, int height) {
-    surface *ret;
+/* The part of r inside the width by height rectangle at x, y, moved so that
+ * rectangle's top left corner is at 0, 0 */
+static rect_t crop_rect(rect_t r, int x, int y, int width, int height) {
+    rect_t ret;
+    int x2, y2;
 
-    ret = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    ret.x = r.x > x ? r.x : x;
+    ret.y = r.y > y ? r.y : y;
+    x2 = r.x + r.width < x + width ? r.x + r.width : x + width;
+    y2 = r.y + r.height < y + height ? r.y + r.height : y + height;
+
+    if (ret.x >= x2 || ret.y >= y2) {
+        ret.x = 0;
+        ret.y = 0;
+        ret.width = 0;
+        ret.height = 0;
+        return ret;
+    }
+
+    ret.width = x2 - ret.x;
+    ret.height = y2 - ret.y;
+    ret.x -= x;
+    ret.y -= y;
 
     return ret;
 }
 
-/* Creates a new surface with the given text drawn on it with the given font 
- * and font size and color used. */
-surface *DL_text(const char* text, int size, color_t color, const char* font, unsigned char bold, unsigned char italics) {
-    /* We need to create a dummy surface so we can size up our text before creating 
-     * our actual surface */
-    surface *ret;
-    cairo_t *cr;
+/* A render running on the render threads. The caller of DL_render_async,
+ * the queue until the render is done, and every pending surface made from
+ * it each hold a reference. result is set under renderLock once the render
+ * is done, and source let go of then. */
+typedef struct future_t {
+    atomic_int refs;
+    surface *source;
+    surface *result;
 
-    cairo_text_extents_t te;
-    cairo_font_extents_t fe;
+    /* What opaque images were kept in when the render was asked for, which
+     * it keeps to whatever DL_set_opaque_format is called with meanwhile */
+    cairo_format_t opaqueFormat;
 
-    int w, h;
-    int fontSlant, fontWeight;
+    /* The next render in the queue */
+    struct future_t *next;
+} future_t;
 
-    /* Select our font properties and then size up our font */ 
-    ret = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 0, 0);
-    cr = cairo_create(ret);
+static pthread_mutex_t renderLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t renderDone = PTHREAD_COND_INITIALIZER;
 
-    if (bold) {
-        fontWeight = CAIRO_FONT_WEIGHT_BOLD;
+static void release_future(future_t *future) {
+    if (atomic_fetch_sub(&future->refs, 1) != 1) {
+        return;
     }
-    else {
-        fontWeight = CAIRO_FONT_WEIGHT_NORMAL;
+
+    if (future->source != NULL) {
+        cairo_surface_destroy(future->source);
     }
 
-    if(italics) {
-        fontSlant = CAIRO_FONT_SLANT_ITALIC;
+    if (future->result != NULL) {
+        cairo_surface_destroy(future->result);
     }
-    else {
-        fontSlant = CAIRO_FONT_SLANT_NORMAL;
+
+    free(future);
+}
+
+/* Waits for the render to be done and returns the image it drew, which
+ * stays the future's */
+static surface *wait_future(future_t *future) {
+    surface *ret;
+
+    pthread_mutex_lock(&renderLock);
+
+    while (future->result == NULL) {
+        pthread_cond_wait(&renderDone, &renderLock);
     }
 
-    cairo_select_font_face (cr, font, fontSlant, fontWeight);
-    cairo_set_font_size (cr, size);
+    ret = future->result;
 
-    cairo_text_extents(cr, text, &te);
-    cairo_font_extents(cr, &fe);
+    pthread_mutex_unlock(&renderLock);
 
-    /* Since we were just drawing to the dummy surface, we need to free it and 
-     * destroy the context */
-    cairo_destroy(cr);
-    cairo_surface_destroy(ret);
+    return ret;
+}
 
-    w = te.x_advance;
-    h = fe.ascent + fe.descent;
+/* A text laid out once, so it can be drawn any number of times and at any
+ * scale without being measured or shaped again */
+typedef struct text_layout_t {
+#ifdef CDRAW_PANGO
+    /* Shaped by Pango, drawn with the top left of its logical extents at
+     * x, y from where it is put */
+    PangoLayout *pango;
+    int x;
+    int y;
+#else
+    /* The lines one after the other, each ending in a nul, drawn with font
+     * with the first baseline ascent from the top and lineHeight between
+     * one baseline and the next */
+    cairo_scaled_font_t *font;
+    char *lines;
+    int count;
+    double ascent;
+    double lineHeight;
+#endif
 
-    /* Now create our real context and surface we will actually use */
-    ret = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, w, h);
-    cr = cairo_create (ret);
+    int width;
+    int height;
 
-    cairo_select_font_face (cr, font, fontSlant, fontWeight);
-    cairo_set_font_size (cr, size);
+    /* Every pixel outside of ink is left transparent */
+    rect_t ink;
 
-    cairo_set_source_rgb(cr, (double)(color.r / 255.0), (double)(color.g / 255.0), (double)(color.b / 255.0));
-    
-    cairo_move_to (cr, 0, fe.ascent);
+    /* Held by the layout cache and by every text node drawn from it */
+    atomic_int refs;
+} text_layout_t;
 
-    /* Since cairo_show_text is described as a "toy api", we should probably move
-     * away from it or port to pango (or have a compile flag to use it) */
-    cairo_show_text (cr, text);
+#ifdef CDRAW_PANGO
+/* Pango objects are not thread safe. Every layout comes out of one context
+ * and is shaped and drawn with pangoLock held. */
+static pthread_mutex_t pangoLock = PTHREAD_MUTEX_INITIALIZER;
+static PangoContext *pangoContext = NULL;
+#endif
 
-    cairo_destroy (cr);
+static void free_layout(text_layout_t *layout) {
+#ifdef CDRAW_PANGO
+    pthread_mutex_lock(&pangoLock);
+    g_object_unref(layout->pango);
+    pthread_mutex_unlock(&pangoLock);
+#else
+    cairo_scaled_font_destroy(layout->font);
+    free(layout->lines);
+#endif
+    free(layout);
+}
 
-    return ret;
+/* Drops a reference to layout, freeing it with the last one */
+static void release_layout(text_layout_t *layout) {
+    if (atomic_fetch_sub(&layout->refs, 1) == 1) {
+        free_layout(layout);
+    }
 }
 
-/* TODO: Add DL_overlay_align */
+/* Draws layout onto cr in the current source with its top left at x, y */
+static void draw_layout(cairo_t *cr, text_layout_t *layout, double x, double y) {
+#ifdef CDRAW_PANGO
+    pthread_mutex_lock(&pangoLock);
+    cairo_move_to(cr, x + layout->x, y + layout->y);
+    pango_cairo_show_layout(cr, layout->pango);
+    pthread_mutex_unlock(&pangoLock);
+#else
+    const char *line = layout->lines;
+    int i;
 
-/* Overlays the front surface over the back surface, aligned at the middle */
-surface *DL_overlay (surface *back, surface *front) {
+    cairo_set_scaled_font(cr, layout->font);
+
+    for (i = 0; i < layout->count; i++) {
+        cairo_move_to(cr, x, y + layout->ascent + i * layout->lineHeight);
+        cairo_show_text(cr, line);
+        line += strlen(line) + 1;
+    }
+#endif
+}
+
+static void free_node(void *data) {
+    node_t *node = data;
+    int i;
+
+    for (i = 0; i < node->count; i++) {
+        cairo_surface_destroy(node->children[i].surf);
+    }
+
+    if (node->layout != NULL) {
+        release_layout(node->layout);
+    }
+
+    if (node->future != NULL) {
+        release_future(node->future);
+    }
+
+    free(node->children);
+    free(node);
+}
+
+/* The pixels of the image surfaces we create come out of the shared buffer
+ * pool, see cdraw-pool.h. Each surface holds its block under this key and
+ * gives it back when it goes. */
+static const cairo_user_data_key_t bufferKey;
+
+/* Creates an image surface of the given format with its pixels from the
+ * pool. With clear set it starts out transparent, otherwise its pixels are
+ * left as they are, for images which are about to be drawn over completely. */
+static surface *new_image(cairo_format_t format, int width, int height, int clear) {
+    dl_pool_block_t *block;
     surface *ret;
-    cairo_t *cr;
-    int backW, backH, frontW, frontH;
-    int newWidth, newHeight;
-    int x, y;
+    int stride;
 
-    /* Get the width and height of the back, then make sure the new height and 
-     * width of the new image is the larger height and the larger width */
-    backW = cairo_image_surface_get_width(back);
-    backH = cairo_image_surface_get_height(back);
-    frontW = cairo_image_surface_get_width(front);
-    frontH = cairo_image_surface_get_height(front);
+    stride = cairo_format_stride_for_width(format, width);
 
-    if(frontW > backW) {
-        newWidth = frontW;
+    if (stride < 0 || width <= 0 || height <= 0) {
+        return cairo_image_surface_create(format, width, height);
     }
-    else{
-        newWidth = backW;
+
+    STATS_BEGIN(STAT_NEW_IMAGE);
+
+    block = dl_pool_get((size_t)stride * height);
+
+    /* Without a buffer of our own cairo gets to try */
+    if (block == NULL) {
+        STATS_END(STAT_NEW_IMAGE);
+        return cairo_image_surface_create(format, width, height);
     }
 
-    if(frontH > backH) {
-        newHeight = frontH;
+    if (clear) {
+        memset(block->data, 0, (size_t)stride * height);
     }
-    else{
-        newHeight = backH;
+
+    ret = cairo_image_surface_create_for_data(block->data, format, width, height, stride);
+
+    /* The surface must be gone before the buffer can go back to the pool */
+    if (cairo_surface_set_user_data(ret, &bufferKey, block, dl_pool_put) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(ret);
+        dl_pool_put(block);
+        STATS_END(STAT_NEW_IMAGE);
+        return cairo_image_surface_create(format, width, height);
     }
 
-    ret = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, newWidth, newHeight);
-    cr = cairo_create(ret);
+    STATS_ALLOC((size_t)stride * height);
+    STATS_END(STAT_NEW_IMAGE);
 
-    x = (newWidth / 2.0) - (backW / 2.0);
-    y = (newHeight / 2.0) - (backH / 2.0);
+    return ret;
+}
 
-    cairo_set_source_surface (cr, back, x, y);
-    cairo_paint(cr);
+/* What to draw an image into which is kept once drawn, when opaque images
+ * are kept in format. Our blitters only write 32 bit pixels, so opaque
+ * images kept as RGB16_565 are drawn as ARGB32 and packed afterwards by
+ * pack_image. The format is passed in rather than read from opaqueFormat,
+ * since render threads must not see it change under them. */
+static cairo_format_t draw_format(int opaque, cairo_format_t format) {
+    return opaque && format == CAIRO_FORMAT_RGB24 ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32;
+}
 
-    x = (newWidth / 2.0) - (frontW / 2.0);
-    y = (newHeight / 2.0) - (frontH / 2.0);
+/* Takes over surf, a freshly drawn image surface, and returns it packed into
+ * RGB16_565 if it is opaque and format, what opaque images are kept in, is
+ * RGB16_565 */
+static surface *pack_image(surface *surf, cairo_format_t format) {
+    surface *ret;
 
-    cairo_set_source_surface (cr, front, x, y);
-    cairo_paint(cr);
+    if (format != CAIRO_FORMAT_RGB16_565 || !is_opaque(surf) ||
+        cairo_image_surface_get_format(surf) != CAIRO_FORMAT_ARGB32 ||
+        cairo_image_surface_get_data(surf) == NULL) {
+        return surf;
+    }
+
+    ret = new_image(CAIRO_FORMAT_RGB16_565, cairo_image_surface_get_width(surf), cairo_image_surface_get_height(surf), 0);
+
+    if (cairo_image_surface_get_data(ret) == NULL) {
+        cairo_surface_destroy(ret);
+        return surf;
+    }
+
+    cairo_surface_flush(surf);
+    dl_blit_to_565(cairo_image_surface_get_data(ret), cairo_image_surface_get_stride(ret),
+                   cairo_image_surface_get_data(surf), cairo_image_surface_get_stride(surf),
+                   cairo_image_surface_get_width(surf), cairo_image_surface_get_height(surf));
+    cairo_surface_mark_dirty(ret);
+
+    set_info(ret, 1, get_bounds(surf));
+    cairo_surface_destroy(surf);
 
-    cairo_destroy(cr);
     return ret;
 }
 
-/* Get the width of the surface */
-int DL_get_width(surface *surf) {
-    return cairo_image_surface_get_width(surf);
+/* Cairo shares one pixman image between everyone painting from the same
+ * image surface, and pixman does not count its references atomically. So
+ * when several threads may be painting the same surface at once, image
+ * surfaces are wrapped in a surface of our own pointing at the same pixels,
+ * and anything else is painted under a lock. */
+static pthread_mutex_t sharedLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Paints surf, or the image surface wrap pointing at its pixels, onto cr.
+ * Masks have their color filled through them. */
+static void paint_pixels(cairo_t *cr, surface *surf, surface *wrap, int x, int y) {
+    image_info_t *info = cairo_surface_get_user_data(surf, &infoKey);
+
+    if (info != NULL && info->mask) {
+        cairo_set_source_rgb(cr, (double)(info->color.r / 255.0), (double)(info->color.g / 255.0), (double)(info->color.b / 255.0));
+        cairo_mask_surface(cr, wrap, x, y);
+        return;
+    }
+
+    cairo_set_source_surface(cr, wrap, x, y);
+    cairo_paint(cr);
 }
 
-/* Get the height of the surface */
-int DL_get_height(surface *surf) {
-    return cairo_image_surface_get_height(surf);
+static void paint_shared(cairo_t *cr, surface *surf, int x, int y) {
+    surface *wrap;
+
+    if (cairo_surface_get_type(surf) == CAIRO_SURFACE_TYPE_IMAGE) {
+        if (cairo_image_surface_get_width(surf) == 0 || cairo_image_surface_get_height(surf) == 0) {
+            return;
+        }
+
+        wrap = cairo_image_surface_create_for_data(cairo_image_surface_get_data(surf),
+                                                   cairo_image_surface_get_format(surf),
+                                                   cairo_image_surface_get_width(surf),
+                                                   cairo_image_surface_get_height(surf),
+                                                   cairo_image_surface_get_stride(surf));
+
+        paint_pixels(cr, surf, wrap, x, y);
+
+        cairo_surface_destroy(wrap);
+        return;
+    }
+
+    pthread_mutex_lock(&sharedLock);
+
+    paint_pixels(cr, surf, surf, x, y);
+
+    /* Let go of surf before anyone else gets to it */
+    cairo_set_source_rgb(cr, 0, 0, 0);
+
+    pthread_mutex_unlock(&sharedLock);
 }
 
-/* Free the surface */
-void DL_free_surface(surface *surf) {
-    cairo_surface_destroy(surf);
+/* Draws the text of node onto cr with its top left corner at x, y */
+static void paint_text(cairo_t *cr, node_t *node, int x, int y) {
+    cairo_set_source_rgb(cr, (double)(node->color.r / 255.0), (double)(node->color.g / 255.0), (double)(node->color.b / 255.0));
+    draw_layout(cr, node->layout, x, y);
+}
+
+/* Draws surf onto cr with its top left corner at x, y. Solids are filled in
+ * place and groups are walked directly so their children land on cr without
+ * any intermediate surface. Anything outside the current clip is skipped.
+ * threaded is set when other threads may be painting the same surfaces. */
+static void paint_surface(cairo_t *cr, surface *surf, int x, int y, int threaded) {
+    node_t *node;
+    double x1, y1, x2, y2;
+    int i;
+
+    node = get_node(surf);
+
+    if (node == NULL) {
+        if (threaded) {
+            paint_shared(cr, surf, x, y);
+            return;
+        }
+
+        paint_pixels(cr, surf, surf, x, y);
+        return;
+    }
+
+    cairo_clip_extents(cr, &x1, &y1, &x2, &y2);
+
+    x += node->bounds.x;
+    y += node->bounds.y;
+
+    if (x >= x2 || y >= y2 || x + node->bounds.width <= x1 || y + node->bounds.height <= y1) {
+        return;
+    }
+
+    x -= node->bounds.x;
+    y -= node->bounds.y;
+
+    switch (node->kind) {
+    case NODE_EMPTY:
+        break;
+
+    case NODE_SOLID:
+        cairo_set_source_rgb(cr, (double)(node->color.r / 255.0), (double)(node->color.g / 255.0), (double)(node->color.b / 255.0));
+        cairo_rectangle(cr, x, y, node->width, node->height);
+        cairo_fill(cr);
+        break;
+
+    case NODE_GROUP:
+        for (i = 0; i < node->count; i++) {
+            if (!node->children[i].hidden) {
+                paint_surface(cr, node->children[i].surf,
+                              x + node->children[i].x, y + node->children[i].y, threaded);
+            }
+        }
+        break;
+
+    case NODE_TEXT:
+        paint_text(cr, node, x, y);
+        break;
+
+    case NODE_PENDING:
+        paint_surface(cr, wait_future(node->future), x, y, threaded);
+        break;
+
+    case NODE_VIEW:
+        cairo_save(cr);
+        cairo_rectangle(cr, x, y, node->width, node->height);
+        cairo_clip(cr);
+        paint_surface(cr, node->children[0].surf,
+                      x + node->children[0].x, y + node->children[0].y, threaded);
+        cairo_restore(cr);
+        break;
+    }
+}
+
+/* Where blit_surface draws: an ARGB32 image surface whose top left corner
+ * is at originX, originY, of which only the part between x1, y1 and x2, y2
+ * is touched. Surfaces which cannot be copied directly, such as images of
+ * other formats, are painted through cr instead, made when first needed. */
+typedef struct blit_target_t {
+    surface *target;
+    unsigned char *data;
+    int stride;
+    int originX;
+    int originY;
+
+    int x1;
+    int y1;
+    int x2;
+    int y2;
+
+    int threaded;
+    cairo_t *cr;
+} blit_target_t;
+
+/* Sets t up to draw anywhere on target. threaded is set when other threads
+ * may be painting the same surfaces. */
+static void blit_begin(blit_target_t *t, surface *target, int originX, int originY, int threaded) {
+    cairo_surface_flush(target);
+
+    t->target = target;
+    t->data = cairo_image_surface_get_data(target);
+    t->stride = cairo_image_surface_get_stride(target);
+    t->originX = originX;
+    t->originY = originY;
+
+    t->x1 = originX;
+    t->y1 = originY;
+    t->x2 = originX + cairo_image_surface_get_width(target);
+    t->y2 = originY + cairo_image_surface_get_height(target);
+
+    t->threaded = threaded;
+    t->cr = NULL;
+}
+
+static void blit_end(blit_target_t *t) {
+    if (t->cr != NULL) {
+        cairo_destroy(t->cr);
+    }
+
+    cairo_surface_mark_dirty(t->target);
+}
+
+/* Paints surf, which blit_surface cannot copy itself, through cairo */
+static void blit_cairo(blit_target_t *t, surface *surf, int x, int y) {
+    if (t->cr == NULL) {
+        t->cr = cairo_create(t->target);
+        cairo_translate(t->cr, -t->originX, -t->originY);
+    }
+
+    cairo_reset_clip(t->cr);
+    cairo_rectangle(t->cr, t->x1, t->y1, t->x2 - t->x1, t->y2 - t->y1);
+    cairo_clip(t->cr);
+
+    /* Cairo has to be told about the pixels we wrote behind its back, and
+     * has to be done with its own before we carry on */
+    cairo_surface_mark_dirty(t->target);
+    paint_surface(t->cr, surf, x, y, t->threaded);
+    cairo_surface_flush(t->target);
+}
+
+/* color as an opaque ARGB32 pixel */
+static uint32_t color_pixel(color_t color) {
+    return 0xff000000 | (uint32_t)color.r << 16 | (uint32_t)color.g << 8 | color.b;
+}
+
+/* Whether blit_surface can draw the image surface surf itself */
+static int can_blit(surface *surf) {
+    image_info_t *info;
+
+    if (cairo_surface_get_type(surf) != CAIRO_SURFACE_TYPE_IMAGE ||
+        cairo_image_surface_get_data(surf) == NULL) {
+        return 0;
+    }
+
+    switch (cairo_image_surface_get_format(surf)) {
+    case CAIRO_FORMAT_ARGB32:
+    case CAIRO_FORMAT_RGB24:
+    case CAIRO_FORMAT_RGB16_565:
+        return 1;
+
+    /* Masks of anything but text are left to cairo */
+    case CAIRO_FORMAT_A8:
+        info = cairo_surface_get_user_data(surf, &infoKey);
+        return info != NULL && info->mask;
+
+    default:
+        return 0;
+    }
+}
+
+/* Draws surf onto t with its top left corner at x, y, working on the pixels
+ * directly. Everything is placed at a whole pixel offset, so opaque images
+ * are copied row by row, other images composited, RGB16_565 widened, masks
+ * filled through, solids filled, and groups walked. Anything outside the
+ * clip is skipped. */
+static void blit_surface(blit_target_t *t, surface *surf, int x, int y) {
+    node_t *node;
+    rect_t bounds;
+    image_info_t *info;
+    unsigned char *src, *dst;
+    int x1, y1, x2, y2, stride, i;
+    int clip[4];
+
+    node = get_node(surf);
+
+    if (node == NULL && !can_blit(surf)) {
+        blit_cairo(t, surf, x, y);
+        return;
+    }
+
+    /* Only the part of surf which is not transparent and lies inside the
+     * clip needs drawing */
+    bounds = get_bounds(surf);
+    bounds.x += x;
+    bounds.y += y;
+
+    x1 = bounds.x > t->x1 ? bounds.x : t->x1;
+    y1 = bounds.y > t->y1 ? bounds.y : t->y1;
+    x2 = bounds.x + bounds.width < t->x2 ? bounds.x + bounds.width : t->x2;
+    y2 = bounds.y + bounds.height < t->y2 ? bounds.y + bounds.height : t->y2;
+
+    if (x1 >= x2 || y1 >= y2) {
+        return;
+    }
+
+    dst = t->data + (size_t)(y1 - t->originY) * t->stride + (size_t)(x1 - t->originX) * 4;
+
+    if (node == NULL) {
+        stride = cairo_image_surface_get_stride(surf);
+        src = cairo_image_surface_get_data(surf) + (size_t)(y1 - y) * stride;
+
+        switch (cairo_image_surface_get_format(surf)) {
+        case CAIRO_FORMAT_A8:
+            info = cairo_surface_get_user_data(surf, &infoKey);
+            dl_blit_mask(dst, t->stride, src + (x1 - x), stride, color_pixel(info->color), x2 - x1, y2 - y1);
+            break;
+
+        case CAIRO_FORMAT_RGB24:
+            dl_blit_copy_opaque(dst, t->stride, src + (size_t)(x1 - x) * 4, stride, x2 - x1, y2 - y1);
+            break;
+
+        case CAIRO_FORMAT_RGB16_565:
+            dl_blit_from_565(dst, t->stride, src + (size_t)(x1 - x) * 2, stride, x2 - x1, y2 - y1);
+            break;
+
+        default:
+            src += (size_t)(x1 - x) * 4;
+
+            if (is_opaque(surf)) {
+                dl_blit_copy(dst, t->stride, src, stride, x2 - x1, y2 - y1);
+            }
+            else {
+                dl_blit_over(dst, t->stride, src, stride, x2 - x1, y2 - y1);
+            }
+            break;
+        }
+
+        return;
+    }
+
+    switch (node->kind) {
+    case NODE_EMPTY:
+        break;
+
+    case NODE_SOLID:
+        dl_blit_fill(dst, t->stride, color_pixel(node->color), x2 - x1, y2 - y1);
+        break;
+
+    case NODE_GROUP:
+        for (i = 0; i < node->count; i++) {
+            if (!node->children[i].hidden) {
+                blit_surface(t, node->children[i].surf,
+                             x + node->children[i].x, y + node->children[i].y);
+            }
+        }
+        break;
+
+    /* Glyphs need cairo to draw them */
+    case NODE_TEXT:
+        blit_cairo(t, surf, x, y);
+        break;
+
+    case NODE_PENDING:
+        blit_surface(t, wait_future(node->future), x, y);
+        break;
+
+    /* Narrow the clip to the part shown for as long as the child draws */
+    case NODE_VIEW:
+        clip[0] = t->x1;
+        clip[1] = t->y1;
+        clip[2] = t->x2;
+        clip[3] = t->y2;
+
+        t->x1 = x1;
+        t->y1 = y1;
+        t->x2 = x2;
+        t->y2 = y2;
+
+        blit_surface(t, node->children[0].surf,
+                     x + node->children[0].x, y + node->children[0].y);
+
+        t->x1 = clip[0];
+        t->y1 = clip[1];
+        t->x2 = clip[2];
+        t->y2 = clip[3];
+        break;
+    }
+}
+
+/* Large images are drawn in tiles, spread over a pool of worker threads.
+ * Each tile gets its own cairo surface pointing into the output's pixels
+ * and only draws the children that reach into it. Tiles are handed out one
+ * at a time from a shared counter, so a thread which finishes early simply
+ * takes the next one and no thread sits idle while tiles are left. The
+ * calling thread works on tiles as well. */
+#define TILE_SIZE 256
+
+typedef struct tile_job_t {
+    unsigned char *data;
+    int stride;
+    int width;
+    int height;
+
+    child_t *children;
+    int count;
+
+    int columns;
+    int tiles;
+    atomic_int next;
+
+    /* How many workers may join, how many have, and how many are still
+     * working. Protected by poolLock. */
+    int maxHelpers;
+    int joined;
+    int helpers;
+} tile_job_t;
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t poolIdle = PTHREAD_COND_INITIALIZER;
+static tile_job_t *poolJob = NULL;
+static int poolSize = 0;
+
+/* How many threads draw a large image, counting the calling thread */
+static atomic_int threadCount = 1;
+
+/* Set for good once the first render thread starts, from then on the
+ * calling thread may be painting the same surfaces as the render threads */
+static atomic_int renderStarted = 0;
+
+static void run_tiles(tile_job_t *job) {
+    blit_target_t target;
+    surface *tile;
+    int t, tx, ty, tw, th, i;
+
+    while ((t = atomic_fetch_add(&job->next, 1)) < job->tiles) {
+        tx = (t % job->columns) * TILE_SIZE;
+        ty = (t / job->columns) * TILE_SIZE;
+
+        tw = job->width - tx < TILE_SIZE ? job->width - tx : TILE_SIZE;
+        th = job->height - ty < TILE_SIZE ? job->height - ty : TILE_SIZE;
+
+        tile = cairo_image_surface_create_for_data(job->data + (size_t)ty * job->stride + (size_t)tx * 4,
+                                                   CAIRO_FORMAT_ARGB32, tw, th, job->stride);
+
+        blit_begin(&target, tile, tx, ty, 1);
+
+        for (i = 0; i < job->count; i++) {
+            if (!job->children[i].hidden) {
+                blit_surface(&target, job->children[i].surf, job->children[i].x, job->children[i].y);
+            }
+        }
+
+        blit_end(&target);
+        cairo_surface_finish(tile);
+        cairo_surface_destroy(tile);
+    }
+}
+
+static void *tile_worker(void *arg) {
+    tile_job_t *job;
+
+    (void)arg;
+
+    pthread_mutex_lock(&poolLock);
+
+    for (;;) {
+        while (poolJob == NULL || poolJob->joined >= poolJob->maxHelpers ||
+               atomic_load(&poolJob->next) >= poolJob->tiles) {
+            pthread_cond_wait(&poolWake, &poolLock);
+        }
+
+        job = poolJob;
+        job->joined++;
+        job->helpers++;
+
+        pthread_mutex_unlock(&poolLock);
+
+        run_tiles(job);
+
+        pthread_mutex_lock(&poolLock);
+
+        job->helpers--;
+
+        if (job->helpers == 0) {
+            pthread_cond_broadcast(&poolIdle);
+        }
+    }
+
+    return NULL;
+}
+
+/* Draws children into target in tiles on the worker pool. Returns 0 without
+ * drawing anything if the pool is already busy with another image. */
+static int paint_tiled(surface *target, child_t *children, int count) {
+    tile_job_t job;
+    pthread_t thread;
+
+    job.width = cairo_image_surface_get_width(target);
+    job.height = cairo_image_surface_get_height(target);
+    job.stride = cairo_image_surface_get_stride(target);
+    job.children = children;
+    job.count = count;
+    job.columns = (job.width + TILE_SIZE - 1) / TILE_SIZE;
+    job.tiles = job.columns * ((job.height + TILE_SIZE - 1) / TILE_SIZE);
+    atomic_init(&job.next, 0);
+    job.joined = 0;
+    job.helpers = 0;
+
+    pthread_mutex_lock(&poolLock);
+
+    if (poolJob != NULL) {
+        pthread_mutex_unlock(&poolLock);
+        return 0;
+    }
+
+    job.maxHelpers = atomic_load(&threadCount) - 1;
+
+    while (poolSize < job.maxHelpers) {
+        if (pthread_create(&thread, NULL, tile_worker, NULL) != 0) {
+            break;
+        }
+
+        pthread_detach(thread);
+        poolSize++;
+    }
+
+    cairo_surface_flush(target);
+    job.data = cairo_image_surface_get_data(target);
+
+    poolJob = &job;
+    pthread_cond_broadcast(&poolWake);
+
+    pthread_mutex_unlock(&poolLock);
+
+    run_tiles(&job);
+
+    /* Wait for any worker still finishing its last tile */
+    pthread_mutex_lock(&poolLock);
+
+    poolJob = NULL;
+
+    while (job.helpers > 0) {
+        pthread_cond_wait(&poolIdle, &poolLock);
+    }
+
+    pthread_mutex_unlock(&poolLock);
+
+    cairo_surface_mark_dirty(target);
+
+    return 1;
+}
+
+/* Draws children into target, a fresh image surface, splitting the work over
+ * threads if it is worth it */
+static void paint_children(surface *target, child_t *children, int count) {
+    blit_target_t t;
+    int i;
+
+    STATS_BEGIN(STAT_PAINT);
+    STATS_PIXELS((unsigned long long)cairo_image_surface_get_width(target) * cairo_image_surface_get_height(target));
+
+    if (atomic_load(&threadCount) > 1 &&
+        cairo_image_surface_get_width(target) * cairo_image_surface_get_height(target) > TILE_SIZE * TILE_SIZE &&
+        paint_tiled(target, children, count)) {
+        STATS_END(STAT_PAINT);
+        return;
+    }
+
+    blit_begin(&t, target, 0, 0, atomic_load(&renderStarted));
+
+    for (i = 0; i < count; i++) {
+        if (!children[i].hidden) {
+            blit_surface(&t, children[i].surf, children[i].x, children[i].y);
+        }
+    }
+
+    blit_end(&t);
+
+    STATS_END(STAT_PAINT);
+}
+
+/* Creates a surface of the given size carrying a node of the given kind. The
+ * surface is a recording surface with no pixels of its own. We draw nodes by
+ * walking them, so nothing is recorded into it until DL_get_cairo_surface
+ * hands it to plain cairo calls. */
+static surface *new_node(node_kind_t kind, int width, int height) {
+    surface *ret;
+    node_t *node;
+    cairo_rectangle_t extents;
+
+    extents.x = 0;
+    extents.y = 0;
+    extents.width = width;
+    extents.height = height;
+
+    ret = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents);
+
+    node = calloc(1, sizeof(node_t));
+    STATS_ALLOC(sizeof(node_t));
+
+    node->kind = kind;
+    node->width = width;
+    node->height = height;
+
+    /* Empties draw nothing, anything else may draw anywhere until we know
+     * better */
+    if (kind != NODE_EMPTY) {
+        node->bounds.width = width;
+        node->bounds.height = height;
+    }
+
+    cairo_surface_set_user_data(ret, &nodeKey, node, free_node);
+
+    return ret;
+}
+
+/* Whether children leave no pixel of a width by height surface uncovered or
+ * see through. Only the cases the combinators make are caught, one opaque
+ * child covering everything, or opaque children laid out side by side or
+ * one above the other that fill it exactly. */
+static int covers(int width, int height, child_t *children, int count) {
+    int i, x, y, row, column;
+
+    x = 0;
+    y = 0;
+    row = 1;
+    column = 1;
+
+    for (i = 0; i < count; i++) {
+        if (get_width(children[i].surf) == 0 || get_height(children[i].surf) == 0) {
+            continue;
+        }
+
+        if (!is_opaque(children[i].surf)) {
+            row = 0;
+            column = 0;
+            continue;
+        }
+
+        if (children[i].x <= 0 && children[i].y <= 0 &&
+            children[i].x + get_width(children[i].surf) >= width &&
+            children[i].y + get_height(children[i].surf) >= height) {
+            return 1;
+        }
+
+        row = row && children[i].x == x && children[i].y == 0 && get_height(children[i].surf) == height;
+        column = column && children[i].y == y && children[i].x == 0 && get_width(children[i].surf) == width;
+
+        x += get_width(children[i].surf);
+        y += get_height(children[i].surf);
+    }
+
+    return width > 0 && height > 0 && ((row && x == width) || (column && y == height));
+}
+
+/* The part of the parent child may draw on */
+static rect_t child_bounds(const child_t *child) {
+    rect_t ret = get_bounds(child->surf);
+
+    ret.x += child->x;
+    ret.y += child->y;
+
+    return ret;
+}
+
+/* Whether inner lies entirely within outer */
+static int contains_rect(const rect_t *outer, const rect_t *inner) {
+    return inner->x >= outer->x && inner->y >= outer->y &&
+           inner->x + inner->width <= outer->x + outer->width &&
+           inner->y + inner->height <= outer->y + outer->height;
+}
+
+/* Sets the hidden flag of each of children. Only the HIDING_CHILDREN
+ * opaque children nearest the top are tried as covers, which catches an
+ * opaque front in an overlay while keeping long rows and grids cheap. */
+#define HIDING_CHILDREN 4
+
+static void mark_hidden(child_t *children, int count) {
+    rect_t covering[HIDING_CHILDREN], bounds;
+    int found, i, j;
+
+    found = 0;
+
+    for (i = count - 1; i >= 0; i--) {
+        bounds = child_bounds(&children[i]);
+        children[i].hidden = bounds.width <= 0 || bounds.height <= 0;
+
+        for (j = 0; j < found && !children[i].hidden; j++) {
+            children[i].hidden = contains_rect(&covering[j], &bounds);
+        }
+
+        if (!children[i].hidden && found < HIDING_CHILDREN && is_opaque(children[i].surf)) {
+            covering[found].x = children[i].x;
+            covering[found].y = children[i].y;
+            covering[found].width = get_width(children[i].surf);
+            covering[found].height = get_height(children[i].surf);
+            found++;
+        }
+    }
+}
+
+/* The part of the parent that children, once marked, may draw on */
+static rect_t children_bounds(const child_t *children, int count) {
+    rect_t ret, bounds;
+    int i;
+
+    ret.x = 0;
+    ret.y = 0;
+    ret.width = 0;
+    ret.height = 0;
+
+    for (i = 0; i < count; i++) {
+        if (!children[i].hidden) {
+            bounds = child_bounds(&children[i]);
+            union_rect(&ret, &bounds);
+        }
+    }
+
+    return ret;
+}
+
+/* Creates a group of the given size out of children, which have been
+ * through mark_hidden. None of its pixels exist until it is painted. */
+static surface *new_group(int width, int height, child_t *children, int count) {
+    surface *ret;
+    node_t *node;
+    int i;
+
+    ret = new_node(NODE_GROUP, width, height);
+    node = get_node(ret);
+
+    node->opaque = covers(width, height, children, count);
+    node->bounds = children_bounds(children, count);
+    node->count = count;
+    node->children = malloc(sizeof(child_t) * count);
+    STATS_ALLOC(sizeof(child_t) * count);
+
+    for (i = 0; i < count; i++) {
+        node->children[i] = children[i];
+        cairo_surface_reference(children[i].surf);
+    }
+
+    return ret;
+}
+
+/* Puts children together into a new surface of the given size, either by
+ * drawing them into a new image or, in lazy mode, by making a group. */
+static surface *compose(int width, int height, child_t *children, int count) {
+    surface *ret;
+    int i, shown, opaque;
+
+    mark_hidden(children, count);
+
+    /* If only one child shows and it fills the whole surface, the result
+     * looks exactly like that child. Surfaces are never drawn on once
+     * handed out, so we can share it rather than copy it. */
+    shown = -1;
+
+    for (i = 0; i < count; i++) {
+        if (children[i].hidden) {
+            continue;
+        }
+
+        if (shown != -1) {
+            shown = -1;
+            break;
+        }
+
+        shown = i;
+    }
+
+    if (shown != -1 && children[shown].x == 0 && children[shown].y == 0 &&
+        get_width(children[shown].surf) == width && get_height(children[shown].surf) == height) {
+        return cairo_surface_reference(children[shown].surf);
+    }
+
+    if (lazyMode || vectorMode) {
+        return new_group(width, height, children, count);
+    }
+
+    /* Opaque children will write every pixel, so there is no need to clear
+     * them first */
+    opaque = covers(width, height, children, count);
+
+    ret = new_image(draw_format(opaque, opaqueFormat), width, height, !opaque);
+    paint_children(ret, children, count);
+    set_info(ret, opaque, children_bounds(children, count));
+
+    return pack_image(ret, opaqueFormat);
+}
+
+/* Surfaces created while an arena is open belong to it, and are freed all
+ * at once when it is closed. Arenas are per thread and nest. */
+typedef struct arena_t {
+    surface **surfs;
+    int count;
+    int size;
+    struct arena_t *prev;
+} arena_t;
+
+static _Thread_local arena_t *arena = NULL;
+
+/* Hands surf over to the open arena, if there is one, and returns it */
+static surface *arena_add(surface *surf) {
+    if (arena == NULL) {
+        return surf;
+    }
+
+    if (arena->count == arena->size) {
+        arena->size = arena->size ? arena->size * 2 : 64;
+        arena->surfs = realloc(arena->surfs, arena->size * sizeof(surface*));
+    }
+
+    arena->surfs[arena->count++] = surf;
+
+    return surf;
+}
+
+/* FNV-1a, continued from hash over len bytes of data */
+static unsigned long hash_bytes(unsigned long hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619UL;
+    }
+
+    return hash;
+}
+
+/* The combinators can be memoized, see DL_memo_set_budget. Every call is
+ * looked up by what it was asked for, its sizes, colors and alignments, and
+ * which surfaces it was given, and a surface made by an identical call
+ * earlier is shared rather than made again. Calls which draw into an image
+ * are also looked up by the opaque format, see DL_set_opaque_format, since
+ * it decides the format of that image. Surfaces are compared by
+ * identity, so this works from the leaves up: identical rectangles come back
+ * as the same surface, so combinations of them match as well. Each entry
+ * holds references to its inputs, so their addresses can not be reused by
+ * other surfaces while it is cached. */
+typedef enum memo_op_t {
+    MEMO_RECTANGLE,
+    MEMO_EMPTY,
+    MEMO_BESIDE,
+    MEMO_ABOVE,
+    MEMO_OVERLAY,
+    MEMO_BESIDE_N,
+    MEMO_ABOVE_N,
+    MEMO_OVERLAY_N,
+    MEMO_GRID,
+    MEMO_CROP,
+    MEMO_PAD
+} memo_op_t;
+
+typedef struct memo_entry_t {
+    unsigned long hash;
+    int *params;
+    int paramCount;
+    surface **inputs;
+    int inputCount;
+
+    surface *surf;
+    size_t bytes;
+
+    /* Chain within a hash bucket */
+    struct memo_entry_t *next;
+
+    /* Most recently used is at the head of the list */
+    struct memo_entry_t *newer;
+    struct memo_entry_t *older;
+} memo_entry_t;
+
+static pthread_mutex_t memoLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Checked without the lock, so calls cost nothing extra while it is off */
+static _Atomic unsigned char memoOn = 0;
+
+static memo_entry_t **memoBuckets = NULL;
+static size_t memoBucketCount = 0;
+static size_t memoCount = 0;
+static memo_entry_t *memoNewest = NULL;
+static memo_entry_t *memoOldest = NULL;
+static memo_stats_t memoStats = { 0, 0, 0, 0, 0 };
+
+/* Roughly how much memory surf holds on to by itself */
+static size_t surface_bytes(surface *surf) {
+    node_t *node = get_node(surf);
+
+    if (node != NULL) {
+        return sizeof(node_t) + (size_t)node->count * sizeof(child_t);
+    }
+
+    /* The pixels of a crop belong to the image it was cut from */
+    if (cairo_surface_get_user_data(surf, &viewKey) != NULL) {
+        return sizeof(image_info_t);
+    }
+
+    return (size_t)cairo_image_surface_get_stride(surf) * cairo_image_surface_get_height(surf);
+}
+
+static unsigned long hash_memo(const int *params, int paramCount, surface **inputs, int inputCount) {
+    unsigned long hash = 2166136261UL;
+
+    hash = hash_bytes(hash, params, paramCount * sizeof(int));
+    hash = hash_bytes(hash, inputs, inputCount * sizeof(surface*));
+
+    return hash;
+}
+
+static void unlink_memo(memo_entry_t *entry) {
+    if (entry->newer != NULL)   entry->newer->older = entry->older;
+    else                        memoNewest = entry->older;
+
+    if (entry->older != NULL)   entry->older->newer = entry->newer;
+    else                        memoOldest = entry->newer;
+}
+
+static void push_memo(memo_entry_t *entry) {
+    entry->newer = NULL;
+    entry->older = memoNewest;
+
+    if (memoNewest != NULL)     memoNewest->newer = entry;
+    else                        memoOldest = entry;
+
+    memoNewest = entry;
+}
+
+static void remove_memo(memo_entry_t *entry) {
+    memo_entry_t **link;
+    int i;
+
+    link = &memoBuckets[entry->hash % memoBucketCount];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+
+    unlink_memo(entry);
+
+    memoCount--;
+    memoStats.bytes -= entry->bytes;
+
+    for (i = 0; i < entry->inputCount; i++) {
+        cairo_surface_destroy(entry->inputs[i]);
+    }
+
+    cairo_surface_destroy(entry->surf);
+    free(entry->params);
+    free(entry->inputs);
+    free(entry);
+}
+
+/* Drops the least recently used entries until what is left fits in budget.
+ * Must be called with memoLock held. */
+static void trim_memo(size_t budget) {
+    while (memoOldest != NULL && (memoStats.bytes > budget || budget == 0)) {
+        remove_memo(memoOldest);
+        memoStats.evictions++;
+    }
+}
+
+/* Finds the entry for a call. Must be called with memoLock held. */
+static memo_entry_t *find_memo(unsigned long hash, const int *params, int paramCount, surface **inputs, int inputCount) {
+    memo_entry_t *entry;
+
+    if (memoBucketCount == 0) {
+        return NULL;
+    }
+
+    for (entry = memoBuckets[hash % memoBucketCount]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash &&
+            entry->paramCount == paramCount && entry->inputCount == inputCount &&
+            memcmp(entry->params, params, paramCount * sizeof(int)) == 0 &&
+            (inputCount == 0 || memcmp(entry->inputs, inputs, inputCount * sizeof(surface*)) == 0)) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Returns a new reference to the surface an identical call made earlier, or
+ * NULL. params starts with the memo_op_t of the call. Inputs may be NULL. */
+static surface *memo_get(const int *params, int paramCount, surface **inputs, int inputCount) {
+    memo_entry_t *entry;
+    unsigned long hash;
+    surface *ret = NULL;
+
+    if (!atomic_load_explicit(&memoOn, memory_order_relaxed)) {
+        return NULL;
+    }
+
+    hash = hash_memo(params, paramCount, inputs, inputCount);
+
+    pthread_mutex_lock(&memoLock);
+
+    entry = find_memo(hash, params, paramCount, inputs, inputCount);
+
+    if (entry != NULL) {
+        unlink_memo(entry);
+        push_memo(entry);
+
+        ret = cairo_surface_reference(entry->surf);
+        memoStats.hits++;
+    }
+    else {
+        memoStats.misses++;
+    }
+
+    pthread_mutex_unlock(&memoLock);
+
+    return ret;
+}
+
+/* Remembers surf as what the call made, if it fits in the budget */
+static void memo_put(const int *params, int paramCount, surface **inputs, int inputCount, surface *surf) {
+    memo_entry_t *entry, *next;
+    memo_entry_t **buckets;
+    unsigned long hash;
+    size_t bytes, count, i;
+    int j;
+
+    if (!atomic_load_explicit(&memoOn, memory_order_relaxed)) {
+        return;
+    }
+
+    hash = hash_memo(params, paramCount, inputs, inputCount);
+    bytes = surface_bytes(surf);
+
+    pthread_mutex_lock(&memoLock);
+
+    /* Another thread may have made the same call in the meantime */
+    if (bytes > memoStats.budget || find_memo(hash, params, paramCount, inputs, inputCount) != NULL) {
+        pthread_mutex_unlock(&memoLock);
+        return;
+    }
+
+    trim_memo(memoStats.budget - bytes);
+
+    /* Keep the table at most one entry per bucket on average */
+    if (memoCount >= memoBucketCount) {
+        count = memoBucketCount ? memoBucketCount * 2 : 256;
+        buckets = calloc(count, sizeof(memo_entry_t*));
+
+        for (i = 0; i < memoBucketCount; i++) {
+            for (entry = memoBuckets[i]; entry != NULL; entry = next) {
+                next = entry->next;
+                entry->next = buckets[entry->hash % count];
+                buckets[entry->hash % count] = entry;
+            }
+        }
+
+        free(memoBuckets);
+        memoBuckets = buckets;
+        memoBucketCount = count;
+    }
+
+    entry = malloc(sizeof(memo_entry_t));
+    entry->hash = hash;
+    entry->params = malloc(paramCount * sizeof(int));
+    entry->paramCount = paramCount;
+    entry->inputs = malloc((inputCount ? inputCount : 1) * sizeof(surface*));
+    entry->inputCount = inputCount;
+    entry->surf = cairo_surface_reference(surf);
+    entry->bytes = bytes;
+
+    memcpy(entry->params, params, paramCount * sizeof(int));
+
+    for (j = 0; j < inputCount; j++) {
+        entry->inputs[j] = inputs[j] != NULL ? cairo_surface_reference(inputs[j]) : NULL;
+    }
+
+    entry->next = memoBuckets[hash % memoBucketCount];
+    memoBuckets[hash % memoBucketCount] = entry;
+    push_memo(entry);
+
+    memoCount++;
+    memoStats.bytes += bytes;
+
+    pthread_mutex_unlock(&memoLock);
+}
+
+/* Sets how many bytes of surfaces the combinators may keep to share between
+ * identical calls. While set, DL_rectangle, DL_empty, DL_beside_align,
+ * DL_above_align, DL_overlay, their _n forms and DL_grid hand back the
+ * surface an earlier call with the same arguments made, rather than making it
+ * again. Surfaces passed in are matched by identity, so leaves should come
+ * from here or the text cache for their combinations to match. Setting it to
+ * 0, the default, turns memoization off and frees what it held. */
+void DL_memo_set_budget(size_t bytes) {
+    pthread_mutex_lock(&memoLock);
+
+    memoStats.budget = bytes;
+    trim_memo(bytes);
+    atomic_store_explicit(&memoOn, bytes > 0, memory_order_relaxed);
+
+    pthread_mutex_unlock(&memoLock);
+}
+
+/* Fills in stats with the memo table's hit and miss counters and how many
+ * bytes of surfaces it currently holds. */
+void DL_memo_get_stats(memo_stats_t *stats) {
+    pthread_mutex_lock(&memoLock);
+    *stats = memoStats;
+    pthread_mutex_unlock(&memoLock);
+}
+
+/* Empties the memo table and resets the counters. Surfaces handed out from
+ * it stay valid. */
+void DL_memo_clear(void) {
+    pthread_mutex_lock(&memoLock);
+
+    trim_memo(0);
+
+    memoStats.hits = 0;
+    memoStats.misses = 0;
+    memoStats.evictions = 0;
+
+    pthread_mutex_unlock(&memoLock);
+}
+
+/* Creates a new surface with the given left and right surfaces drawn beside
+ * each other, aligned as per align.
+ *
+ * Alignments are either TOP, BOTTOM, or CENTER */
+surface *DL_beside_align (surface *left, surface *right, align_t align) {
+    child_t children[2];
+    int newWidth, newHeight;
+    int x, y;
+    int leftW, leftH, rightW, rightH;
+    surface *ret;
+    int params[] = { MEMO_BESIDE, lazyMode || vectorMode, opaqueFormat, align };
+    surface *inputs[] = { left, right };
+
+    STATS_BEGIN(STAT_BESIDE_ALIGN);
+
+    ret = memo_get(params, 4, inputs, 2);
+
+    if (ret != NULL) {
+        STATS_END(STAT_BESIDE_ALIGN);
+        return arena_add(ret);
+    }
+
+    /* Get the width of our left surface */
+    leftW = get_width(left);
+    leftH = get_height(left);
+
+    /* Same for the right */
+    rightW = get_width(right);
+    rightH = get_height(right);
+
+    /* Since we are placing the images beside one another, the new width will
+     * be the sum of the left and right width. And the height will be the
+     * height of the larger surface */
+
+    newWidth = leftW + rightW;
+
+    if(leftH > rightH) {
+        newHeight = leftH;
+    }
+    else{
+        newHeight = rightH;
+    }
+
+    /* The x to draw our left side image will always be 0, our y will change
+     * based on our align, so perform those calculations here */
+    x = 0;
+
+    if (align == TOP)           y = 0;
+    else if(align == BOTTOM)    y = newHeight - leftH;
+    else                        y = (newHeight / 2.0) - (leftH / 2.0);
+
+    children[0].surf = left;
+    children[0].x = x;
+    children[0].y = y;
+
+    /* Now do the same for the right side. The y is the same process as the
+     * left, but this time the x is the width of left image. */
+    x = leftW;
+
+    if (align == TOP)           y = 0;
+    else if(align == BOTTOM)    y = newHeight - rightH;
+    else                        y = (newHeight / 2.0) - (rightH / 2.0);
+
+    children[1].surf = right;
+    children[1].x = x;
+    children[1].y = y;
+
+    /* Now draw both sides into our new surface */
+    ret = compose(newWidth, newHeight, children, 2);
+
+    memo_put(params, 4, inputs, 2, ret);
+
+    STATS_END(STAT_BESIDE_ALIGN);
+
+    return arena_add(ret);
+}
+
+/* Creates a new surface with the given left and right surfaces drawn beside
+ * each other, aligned at the center of each surface. */
+surface *DL_beside (surface *left, surface *right) {
+    surface *ret;
+
+    STATS_BEGIN(STAT_BESIDE);
+    ret = DL_beside_align(left, right, CENTER);
+    STATS_END(STAT_BESIDE);
+
+    return ret;
+}
+
+/* Creates a new surface with the given top and bottom surfaces on positioned
+ * vertically relative to each other, algined by align.
+ *
+ * Alignments are either LEFT, RIGHT, or CENTER */
+surface *DL_above_align(surface *top, surface *bottom, align_t align) {
+    child_t children[2];
+    int newWidth, newHeight;
+    int topW, topH, botW, botH;
+    int x, y;
+    surface *ret;
+    int params[] = { MEMO_ABOVE, lazyMode || vectorMode, opaqueFormat, align };
+    surface *inputs[] = { top, bottom };
+
+    STATS_BEGIN(STAT_ABOVE_ALIGN);
+
+    ret = memo_get(params, 4, inputs, 2);
+
+    if (ret != NULL) {
+        STATS_END(STAT_ABOVE_ALIGN);
+        return arena_add(ret);
+    }
+
+    topW = get_width(top);
+    topH = get_height(top);
+
+    botW = get_width(bottom);
+    botH = get_height(bottom);
+
+    if (botW > topW) {
+        newWidth = botW;
+    }
+    else{
+        newWidth = topW;
+    }
+
+    newHeight = topH + botH;
+
+    y = 0;
+
+    if (align == LEFT)          x = 0;
+    else if(align == RIGHT)     x = newWidth - topW;
+    else                        x = (newWidth / 2.0) - (topW / 2.0);
+
+    children[0].surf = top;
+    children[0].x = x;
+    children[0].y = y;
+
+    y = topH;
+    if (align == LEFT)          x = 0;
+    else if(align == RIGHT)     x = newWidth - botW;
+    else                        x = (newWidth / 2.0) - (botW / 2.0);
+
+    children[1].surf = bottom;
+    children[1].x = x;
+    children[1].y = y;
+
+    ret = compose(newWidth, newHeight, children, 2);
+
+    memo_put(params, 4, inputs, 2, ret);
+
+    STATS_END(STAT_ABOVE_ALIGN);
+
+    return arena_add(ret);
+}
+
+/* Creates a new surface with the given top and bottom surfaces on positioned
+ * vertically relative to each other, algined at the center. */
+surface *DL_above(surface *top, surface *bot) {
+    surface *ret;
+
+    STATS_BEGIN(STAT_ABOVE);
+    ret = DL_above_align(top, bot, CENTER);
+    STATS_END(STAT_ABOVE);
+
+    return ret;
+}
+
+/* A rectangle is one flat color, so rather than filling a whole image we
+ * only remember its size and color, and fill it in when it is painted */
+static surface *new_solid(int width, int height, color_t color) {
+    surface *ret;
+
+    ret = new_node(NODE_SOLID, width, height);
+    get_node(ret)->color = color;
+    get_node(ret)->opaque = 1;
+
+    return ret;
+}
+
+/* Creates a new surface with a rectangle drawn based on the given width,
+ * height, and color. No pixels are allocated for it, the rectangle is filled
+ * in wherever it gets drawn. */
+surface *DL_rectangle (int width, int height, color_t color) {
+    surface *ret;
+    int params[] = { MEMO_RECTANGLE, width, height, color.r, color.g, color.b };
+
+    STATS_BEGIN(STAT_RECTANGLE);
+
+    ret = memo_get(params, 6, NULL, 0);
+
+    if (ret != NULL) {
+        STATS_END(STAT_RECTANGLE);
+        return arena_add(ret);
+    }
+
+    ret = new_solid(width, height, color);
+
+    memo_put(params, 6, NULL, 0, ret);
+
+    STATS_END(STAT_RECTANGLE);
+
+    return arena_add(ret);
+}
+
+/* Creates a new surface with a square drawn based on the given side length and
+ * color */
+surface *DL_square (int side, color_t color) {
+    surface *ret;
+
+    STATS_BEGIN(STAT_SQUARE);
+    ret = DL_rectangle(side, side, color);
+    STATS_END(STAT_SQUARE);
+
+    return ret;
+}
+
+/* Create a new empty surface based on the given width and height. No pixels
+ * are allocated for it. */
+surface *DL_empty (int width, int height) {
+    surface *ret;
+    int params[] = { MEMO_EMPTY, width, height };
+
+    STATS_BEGIN(STAT_EMPTY);
+
+    ret = memo_get(params, 3, NULL, 0);
+
+    if (ret != NULL) {
+        STATS_END(STAT_EMPTY);
+        return arena_add(ret);
+    }
+
+    /* There is nothing to draw, so this is only a size */
+    ret = new_node(NODE_EMPTY, width, height);
+
+    memo_put(params, 3, NULL, 0, ret);
+
+    STATS_END(STAT_EMPTY);
+
+    return arena_add(ret);
+}
+
+static void release_import(void *data) {
+    import_t *import = data;
+
+    if (import->release != NULL) {
+        import->release(import->closure);
+    }
+
+    free(import);
+}
+
+/* Wraps the caller's pixels in an image surface which reads them in place,
+ * or returns NULL if cairo can not */
+static surface *wrap_buffer(unsigned char *data, int width, int height, int stride, format_t format, import_t *import) {
+    surface *ret;
+    rect_t bounds;
+    cairo_format_t cformat;
+
+    switch (format) {
+    case FORMAT_RGB24:
+        cformat = CAIRO_FORMAT_RGB24;
+        break;
+
+    case FORMAT_A8:
+        cformat = CAIRO_FORMAT_A8;
+        break;
+
+    case FORMAT_RGB16_565:
+        cformat = CAIRO_FORMAT_RGB16_565;
+        break;
+
+    default:
+        cformat = CAIRO_FORMAT_ARGB32;
+        break;
+    }
+
+    /* Cairo reads the rows of an image a 32 bit word at a time */
+    if (data == NULL || width <= 0 || height <= 0 || (uintptr_t)data % 4 != 0 ||
+        stride % 4 != 0 || stride < cairo_format_stride_for_width(cformat, width)) {
+        return NULL;
+    }
+
+    ret = cairo_image_surface_create_for_data(data, cformat, width, height, stride);
+
+    if (cairo_surface_set_user_data(ret, &importKey, import, release_import) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(ret);
+        return NULL;
+    }
+
+    /* Nothing is known about the pixels of the other formats, looking would
+     * mean reading all of them */
+    if (cformat == CAIRO_FORMAT_RGB24 || cformat == CAIRO_FORMAT_RGB16_565) {
+        bounds.x = 0;
+        bounds.y = 0;
+        bounds.width = width;
+        bounds.height = height;
+        set_info(ret, 1, bounds);
+    }
+
+    return ret;
+}
+
+/* Creates a new image surface out of the caller's width by height pixels,
+ * with rows stride bytes apart. Nothing is copied, the surface takes the
+ * buffer over and calls release, which may be NULL, with closure once it is
+ * done with it. Returns NULL if the pixels can not be read in place, and the
+ * buffer then stays the caller's. */
+surface *DL_from_buffer(unsigned char *data, int width, int height, int stride, format_t format, release_func_t release, void *closure) {
+    surface *ret;
+    import_t *import;
+
+    STATS_BEGIN(STAT_FROM_BUFFER);
+
+    import = malloc(sizeof(import_t));
+
+    if (import == NULL) {
+        STATS_END(STAT_FROM_BUFFER);
+        return NULL;
+    }
+
+    import->borrowed = 0;
+    import->release = release;
+    import->closure = closure;
+
+    ret = wrap_buffer(data, width, height, stride, format, import);
+
+    if (ret == NULL) {
+        free(import);
+        STATS_END(STAT_FROM_BUFFER);
+        return NULL;
+    }
+
+    STATS_END(STAT_FROM_BUFFER);
+
+    return arena_add(ret);
+}
+
+/* Like DL_from_buffer, but the buffer stays the caller's, who must keep it
+ * alive and unchanged for as long as the surface or anything composed from
+ * it is around */
+surface *DL_from_buffer_borrowed(const unsigned char *data, int width, int height, int stride, format_t format) {
+    surface *ret;
+    import_t *import;
+
+    STATS_BEGIN(STAT_FROM_BUFFER_BORROWED);
+
+    import = calloc(1, sizeof(import_t));
+
+    if (import == NULL) {
+        STATS_END(STAT_FROM_BUFFER_BORROWED);
+        return NULL;
+    }
+
+    import->borrowed = 1;
+
+    /* Cairo only ever reads it, DL_make_writable copies it first */
+    ret = wrap_buffer((unsigned char*)data, width, height, stride, format, import);
+
+    if (ret == NULL) {
+        free(import);
+        STATS_END(STAT_FROM_BUFFER_BORROWED);
+        return NULL;
+    }
+
+    STATS_END(STAT_FROM_BUFFER_BORROWED);
+
+    return arena_add(ret);
+}
+
+/* DL_text keeps two caches. Fonts are looked up once per family, size, and
+ * style and kept as cairo scaled fonts, or as Pango font descriptions when
+ * built with CDRAW_PANGO, which we can lay text out with without a surface.
+ * Finished texts are kept in a hash table keyed by everything they are drawn
+ * from, so drawing the same label or paragraph again hands back the surface
+ * we already have, and in vector mode the text node laid out for it. The
+ * cache is bounded by a byte budget and drops the least recently used
+ * entries to stay under it.
+ *
+ * Without Pango each font also keeps every glyph it has drawn as 8 bit
+ * coverage, and text is built up out of those rather than drawn glyph by
+ * glyph again. Tables of numbers use a dozen or so glyphs over and over.
+ * The coverage counts against the same budget, see fit_text.
+ * Each glyph is kept at GLYPH_PHASES offsets across and down a pixel, and
+ * pens are put at the nearest of them, so the spacing follows the font's
+ * fractional advances. This matches cairo_show_text to within a quarter
+ * pixel of position, not bit for bit. With hinted metrics lines start on
+ * whole pixels, so only the phases across are ever drawn. */
+#ifndef CDRAW_PANGO
+#define GLYPH_PHASES 4
+
+/* A glyph drawn once at one phase. Its coverage goes left, top from the
+ * whole pixel the pen is put at, and glyphs without ink, like spaces, have
+ * none. key is made of the glyph index and the phases, see glyph_key, and 0
+ * marks a free slot. */
+typedef struct glyph_entry_t {
+    unsigned long key;
+    surface *coverage;
+    int left;
+    int top;
+    double advance;
+} glyph_entry_t;
+#endif
+
+typedef struct font_entry_t {
+    char *family;
+    int size;
+    unsigned char bold;
+    unsigned char italics;
+
+#ifdef CDRAW_PANGO
+    PangoFontDescription *desc;
+#else
+    cairo_scaled_font_t *scaled;
+    cairo_font_extents_t extents;
+
+    /* Open addressed, at most half full */
+    glyph_entry_t *glyphs;
+    size_t glyphCount;
+    size_t glyphCapacity;
+
+    /* What the glyphs take up, and when text was last built out of them */
+    size_t glyphBytes;
+    unsigned long glyphUse;
+#endif
+
+    struct font_entry_t *next;
+} font_entry_t;
+
+/* Everything a text is drawn from. width is -1 for a single line, 0 to break
+ * lines only at line breaks, or the width to wrap lines at. vector is set
+ * when the text is kept as a text node rather than pixels, and format is the
+ * text format pixels are drawn in, see DL_set_text_format. */
+typedef struct text_key_t {
+    const char *text;
+    const char *font;
+    int size;
+    color_t color;
+    unsigned char bold;
+    unsigned char italics;
+    int width;
+    unsigned char vector;
+    cairo_format_t format;
+} text_key_t;
+
+typedef struct text_entry_t {
+    unsigned long hash;
+    char *text;
+    char *font;
+    int size;
+    color_t color;
+    unsigned char bold;
+    unsigned char italics;
+    int width;
+    unsigned char vector;
+    cairo_format_t format;
+
+    surface *surf;
+    size_t bytes;
+
+    /* Chain within a hash bucket */
+    struct text_entry_t *next;
+
+    /* Most recently used is at the head of the list */
+    struct text_entry_t *newer;
+    struct text_entry_t *older;
+} text_entry_t;
+
+#define TEXT_CACHE_DEFAULT_BUDGET (16 * 1024 * 1024)
+
+static pthread_mutex_t textLock = PTHREAD_MUTEX_INITIALIZER;
+
+static font_entry_t *fonts = NULL;
+
+static text_entry_t **textBuckets = NULL;
+static size_t textBucketCount = 0;
+static size_t textCount = 0;
+static text_entry_t *textNewest = NULL;
+static text_entry_t *textOldest = NULL;
+static text_cache_stats_t textStats = { 0, 0, 0, 0, TEXT_CACHE_DEFAULT_BUDGET };
+
+#ifndef CDRAW_PANGO
+/* The part of textStats.bytes taken up by the glyphs of every font, and a
+ * clock the fonts' glyphUse is set from */
+static size_t glyphBytes = 0;
+static unsigned long glyphClock = 0;
+#endif
+
+static char *copy_string(const char *str) {
+    size_t len = strlen(str) + 1;
+    char *ret = malloc(len);
+
+    memcpy(ret, str, len);
+
+    return ret;
+}
+
+static unsigned long hash_text(const text_key_t *key) {
+    unsigned long hash = 2166136261UL;
+
+    hash = hash_bytes(hash, key->text, strlen(key->text) + 1);
+    hash = hash_bytes(hash, key->font, strlen(key->font) + 1);
+    hash = hash_bytes(hash, &key->size, sizeof(key->size));
+    hash = hash_bytes(hash, &key->color, sizeof(key->color));
+    hash = hash_bytes(hash, &key->bold, sizeof(key->bold));
+    hash = hash_bytes(hash, &key->italics, sizeof(key->italics));
+    hash = hash_bytes(hash, &key->width, sizeof(key->width));
+    hash = hash_bytes(hash, &key->vector, sizeof(key->vector));
+    hash = hash_bytes(hash, &key->format, sizeof(key->format));
+
+    return hash;
+}
+
+/* Finds the font for the given family, size and style, creating it the first
+ * time it is asked for. Must be called with textLock held. */
+static font_entry_t *get_font(const char *font, int size, unsigned char bold, unsigned char italics) {
+    font_entry_t *entry;
+#ifndef CDRAW_PANGO
+    surface *dummy;
+    cairo_t *cr;
+#endif
+
+    for (entry = fonts; entry != NULL; entry = entry->next) {
+        if (entry->size == size && entry->bold == bold && entry->italics == italics &&
+            strcmp(entry->family, font) == 0) {
+            return entry;
+        }
+    }
+
+    entry = malloc(sizeof(font_entry_t));
+    entry->family = copy_string(font);
+    entry->size = size;
+    entry->bold = bold;
+    entry->italics = italics;
+
+#ifdef CDRAW_PANGO
+    /* Sized in pixels like the cairo fonts, not in points */
+    entry->desc = pango_font_description_new();
+    pango_font_description_set_family(entry->desc, font);
+    pango_font_description_set_absolute_size(entry->desc, size * PANGO_SCALE);
+    pango_font_description_set_weight(entry->desc, bold ? PANGO_WEIGHT_BOLD : PANGO_WEIGHT_NORMAL);
+    pango_font_description_set_style(entry->desc, italics ? PANGO_STYLE_ITALIC : PANGO_STYLE_NORMAL);
+#else
+    /* Select our font properties on a dummy context to get cairo to pick the
+     * scaled font it would draw with, then keep that around */
+    dummy = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 0, 0);
+    cr = cairo_create(dummy);
+
+    cairo_select_font_face (cr, font,
+                            italics ? CAIRO_FONT_SLANT_ITALIC : CAIRO_FONT_SLANT_NORMAL,
+                            bold ? CAIRO_FONT_WEIGHT_BOLD : CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size (cr, size);
+
+    entry->scaled = cairo_scaled_font_reference(cairo_get_scaled_font(cr));
+    cairo_scaled_font_extents(entry->scaled, &entry->extents);
+
+    entry->glyphs = NULL;
+    entry->glyphCount = 0;
+    entry->glyphCapacity = 0;
+    entry->glyphBytes = 0;
+    entry->glyphUse = 0;
+
+    cairo_destroy(cr);
+    cairo_surface_destroy(dummy);
+#endif
+
+    entry->next = fonts;
+    fonts = entry;
+
+    return entry;
+}
+
+#ifndef CDRAW_PANGO
+/* The largest whole number no bigger than v, and the smallest no smaller */
+static int floor_int(double v) {
+    int i = (int)v;
+
+    return i > v ? i - 1 : i;
+}
+
+static int ceil_int(double v) {
+    int i = (int)v;
+
+    return i < v ? i + 1 : i;
+}
+
+/* The whole pixel a position in steps of 1 / GLYPH_PHASES of a pixel falls
+ * in, and how many steps into it */
+static int pixel_of(int steps) {
+    return floor_int((double)steps / GLYPH_PHASES);
+}
+
+static int phase_of(int steps) {
+    return steps - pixel_of(steps) * GLYPH_PHASES;
+}
+
+static unsigned long glyph_key(unsigned long index, int phaseX, int phaseY) {
+    return (index * GLYPH_PHASES + phaseY) * GLYPH_PHASES + phaseX + 1;
+}
+
+/* Draws glyph index of fnt as 8 bit coverage into entry, phaseX steps of
+ * 1 / GLYPH_PHASES of a pixel right of a whole pixel and phaseY steps down */
+static void draw_glyph(font_entry_t *fnt, unsigned long index, int phaseX, int phaseY, glyph_entry_t *entry) {
+    cairo_glyph_t glyph = { index, 0, 0 };
+    cairo_text_extents_t te;
+    cairo_t *cr;
+    double offsetX, offsetY;
+    int right, bottom;
+
+    cairo_scaled_font_glyph_extents(fnt->scaled, &glyph, 1, &te);
+
+    offsetX = (double)phaseX / GLYPH_PHASES;
+    offsetY = (double)phaseY / GLYPH_PHASES;
+
+    entry->key = glyph_key(index, phaseX, phaseY);
+    entry->coverage = NULL;
+    entry->left = 0;
+    entry->top = 0;
+    entry->advance = te.x_advance;
+
+    if (te.width <= 0 || te.height <= 0) {
+        return;
+    }
+
+    /* Leave room around the ink for antialiasing */
+    entry->left = floor_int(te.x_bearing + offsetX) - 2;
+    entry->top = floor_int(te.y_bearing + offsetY) - 2;
+    right = ceil_int(te.x_bearing + te.width + offsetX) + 2;
+    bottom = ceil_int(te.y_bearing + te.height + offsetY) + 2;
+
+    entry->coverage = new_image(CAIRO_FORMAT_A8, right - entry->left, bottom - entry->top, 1);
+
+    glyph.x = offsetX - entry->left;
+    glyph.y = offsetY - entry->top;
+
+    cr = cairo_create(entry->coverage);
+    cairo_set_scaled_font(cr, fnt->scaled);
+    cairo_show_glyphs(cr, &glyph, 1);
+    cairo_destroy(cr);
+
+    cairo_surface_flush(entry->coverage);
+}
+
+/* Finds glyph index of fnt at the given phases, drawing it the first time
+ * it is asked for. The entry moves when more glyphs are added. Must be
+ * called with textLock held. */
+static glyph_entry_t *find_glyph(font_entry_t *fnt, unsigned long index, int phaseX, int phaseY) {
+    glyph_entry_t *glyphs;
+    unsigned long key;
+    size_t capacity, bytes, i, j;
+
+    if (fnt->glyphCount * 2 >= fnt->glyphCapacity) {
+        capacity = fnt->glyphCapacity ? fnt->glyphCapacity * 2 : 64;
+        glyphs = calloc(capacity, sizeof(glyph_entry_t));
+
+        for (i = 0; i < fnt->glyphCapacity; i++) {
+            if (fnt->glyphs[i].key != 0) {
+                j = fnt->glyphs[i].key & (capacity - 1);
+                while (glyphs[j].key != 0) {
+                    j = (j + 1) & (capacity - 1);
+                }
+                glyphs[j] = fnt->glyphs[i];
+            }
+        }
+
+        free(fnt->glyphs);
+        fnt->glyphs = glyphs;
+        fnt->glyphCapacity = capacity;
+    }
+
+    key = glyph_key(index, phaseX, phaseY);
+
+    i = key & (fnt->glyphCapacity - 1);
+    while (fnt->glyphs[i].key != 0) {
+        if (fnt->glyphs[i].key == key) {
+            return &fnt->glyphs[i];
+        }
+        i = (i + 1) & (fnt->glyphCapacity - 1);
+    }
+
+    draw_glyph(fnt, index, phaseX, phaseY, &fnt->glyphs[i]);
+    fnt->glyphCount++;
+
+    bytes = sizeof(glyph_entry_t);
+    if (fnt->glyphs[i].coverage != NULL) {
+        bytes += surface_bytes(fnt->glyphs[i].coverage);
+    }
+
+    fnt->glyphBytes += bytes;
+    glyphBytes += bytes;
+    textStats.bytes += bytes;
+
+    return &fnt->glyphs[i];
+}
+#endif
+
+static void unlink_text(text_entry_t *entry) {
+    if (entry->newer != NULL)   entry->newer->older = entry->older;
+    else                        textNewest = entry->older;
+
+    if (entry->older != NULL)   entry->older->newer = entry->newer;
+    else                        textOldest = entry->newer;
+}
+
+static void push_text(text_entry_t *entry) {
+    entry->newer = NULL;
+    entry->older = textNewest;
+
+    if (textNewest != NULL)     textNewest->newer = entry;
+    else                        textOldest = entry;
+
+    textNewest = entry;
+}
+
+static void remove_text(text_entry_t *entry) {
+    text_entry_t **link;
+
+    link = &textBuckets[entry->hash % textBucketCount];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+
+    unlink_text(entry);
+
+    textCount--;
+    textStats.bytes -= entry->bytes;
+
+    cairo_surface_destroy(entry->surf);
+    free(entry->text);
+    free(entry->font);
+    free(entry);
+}
+
+/* Drops the least recently used text until what is left fits in budget.
+ * Must be called with textLock held. */
+static void trim_text(size_t budget) {
+    while (textOldest != NULL && textStats.bytes > budget) {
+        remove_text(textOldest);
+        textStats.evictions++;
+    }
+}
+
+#ifndef CDRAW_PANGO
+/* Lets go of every glyph fnt has drawn. Text being built out of them holds
+ * its own references on their coverage. Must be called with textLock held. */
+static void clear_glyphs(font_entry_t *fnt) {
+    size_t i;
+
+    for (i = 0; i < fnt->glyphCapacity; i++) {
+        if (fnt->glyphs[i].coverage != NULL) {
+            cairo_surface_destroy(fnt->glyphs[i].coverage);
+        }
+    }
+
+    free(fnt->glyphs);
+    fnt->glyphs = NULL;
+    fnt->glyphCount = 0;
+    fnt->glyphCapacity = 0;
+
+    glyphBytes -= fnt->glyphBytes;
+    textStats.bytes -= fnt->glyphBytes;
+    fnt->glyphBytes = 0;
+}
+#endif
+
+/* Drops finished texts, and glyphs without Pango, until what is left fits
+ * in budget. Texts are built out of the glyphs, so those only go once they
+ * alone are over budget, all of a font's at once, the font text was least
+ * recently built from first. Must be called with textLock held. */
+static void fit_text(size_t budget) {
+#ifndef CDRAW_PANGO
+    font_entry_t *fnt, *oldest;
+
+    while (glyphBytes > budget) {
+        oldest = NULL;
+
+        for (fnt = fonts; fnt != NULL; fnt = fnt->next) {
+            if (fnt->glyphBytes > 0 && (oldest == NULL || fnt->glyphUse < oldest->glyphUse)) {
+                oldest = fnt;
+            }
+        }
+
+        clear_glyphs(oldest);
+        textStats.evictions++;
+    }
+#endif
+
+    trim_text(budget);
+}
+
+/* Looks up a finished text, returning a new reference to it or NULL. Must be
+ * called with textLock held. */
+static surface *find_text(unsigned long hash, const text_key_t *key) {
+    text_entry_t *entry;
+
+    if (textBucketCount == 0) {
+        return NULL;
+    }
+
+    for (entry = textBuckets[hash % textBucketCount]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->size == key->size &&
+            entry->color.r == key->color.r && entry->color.g == key->color.g && entry->color.b == key->color.b &&
+            entry->bold == key->bold && entry->italics == key->italics &&
+            entry->width == key->width && entry->vector == key->vector && entry->format == key->format &&
+            strcmp(entry->text, key->text) == 0 && strcmp(entry->font, key->font) == 0) {
+            unlink_text(entry);
+            push_text(entry);
+
+            return cairo_surface_reference(entry->surf);
+        }
+    }
+
+    return NULL;
+}
+
+/* Adds a finished text to the cache, if it fits in the budget. Must be called
+ * with textLock held. */
+static void add_text(unsigned long hash, const text_key_t *key, surface *surf) {
+    text_entry_t *entry, *next;
+    text_entry_t **buckets;
+    size_t bytes, count, i;
+
+    bytes = surface_bytes(surf);
+
+    if (bytes > textStats.budget) {
+        return;
+    }
+
+    fit_text(textStats.budget - bytes);
+
+    /* Keep the table at most one entry per bucket on average */
+    if (textCount >= textBucketCount) {
+        count = textBucketCount ? textBucketCount * 2 : 64;
+        buckets = calloc(count, sizeof(text_entry_t*));
+
+        for (i = 0; i < textBucketCount; i++) {
+            for (entry = textBuckets[i]; entry != NULL; entry = next) {
+                next = entry->next;
+                entry->next = buckets[entry->hash % count];
+                buckets[entry->hash % count] = entry;
+            }
+        }
+
+        free(textBuckets);
+        textBuckets = buckets;
+        textBucketCount = count;
+    }
+
+    entry = malloc(sizeof(text_entry_t));
+    entry->hash = hash;
+    entry->text = copy_string(key->text);
+    entry->font = copy_string(key->font);
+    entry->size = key->size;
+    entry->color = key->color;
+    entry->bold = key->bold;
+    entry->italics = key->italics;
+    entry->width = key->width;
+    entry->vector = key->vector;
+    entry->format = key->format;
+    entry->surf = cairo_surface_reference(surf);
+    entry->bytes = bytes;
+
+    entry->next = textBuckets[hash % textBucketCount];
+    textBuckets[hash % textBucketCount] = entry;
+    push_text(entry);
+
+    textCount++;
+    textStats.bytes += bytes;
+}
+
+/* The pixels between x1, y1 and x2, y2 give or take a pixel or two of
+ * antialiasing, kept within a width by height text */
+static rect_t ink_bounds(double x1, double y1, double x2, double y2, int width, int height) {
+    rect_t ret = { 0, 0, 0, 0 };
+    int left = (int)x1 - 2;
+    int top = (int)y1 - 2;
+    int right = (int)x2 + 2;
+    int bottom = (int)y2 + 2;
+
+    if (left < 0)               left = 0;
+    if (top < 0)                top = 0;
+    if (right > width)          right = width;
+    if (bottom > height)        bottom = height;
+
+    if (left < right && top < bottom) {
+        ret.x = left;
+        ret.y = top;
+        ret.width = right - left;
+        ret.height = bottom - top;
+    }
+
+    return ret;
+}
+
+#ifdef CDRAW_PANGO
+/* A copy of the Pango font description for the given family, size and
+ * style, for the caller to free */
+static PangoFontDescription *copy_font(const char *font, int size, unsigned char bold, unsigned char italics) {
+    PangoFontDescription *ret;
+
+    pthread_mutex_lock(&textLock);
+
+    STATS_BEGIN(STAT_FONT_LOOKUP);
+    ret = pango_font_description_copy(get_font(font, size, bold, italics)->desc);
+    STATS_END(STAT_FONT_LOOKUP);
+
+    pthread_mutex_unlock(&textLock);
+
+    return ret;
+}
+
+/* Creates an empty Pango layout in desc, wrapped as width says, see
+ * text_key_t. Must be called with pangoLock held. */
+static PangoLayout *create_layout(const PangoFontDescription *desc, int width) {
+    PangoFontMap *fontMap;
+    PangoLayout *ret;
+
+    if (pangoContext == NULL) {
+        fontMap = pango_cairo_font_map_new();
+        pangoContext = pango_font_map_create_context(fontMap);
+        g_object_unref(fontMap);
+    }
+
+    ret = pango_layout_new(pangoContext);
+    pango_layout_set_font_description(ret, desc);
+
+    if (width < 0) {
+        pango_layout_set_single_paragraph_mode(ret, TRUE);
+    } else if (width > 0) {
+        pango_layout_set_width(ret, width * PANGO_SCALE);
+        pango_layout_set_wrap(ret, PANGO_WRAP_WORD);
+    }
+
+    return ret;
+}
+
+/* Lays key out with Pango. The text is shaped here, once, and the layout
+ * keeps the shaped runs for every time it is drawn. */
+static text_layout_t *new_layout(const text_key_t *key) {
+    text_layout_t *layout = calloc(1, sizeof(text_layout_t));
+    PangoFontDescription *desc;
+    PangoRectangle ink, logical;
+
+    desc = copy_font(key->font, key->size, key->bold, key->italics);
+
+    pthread_mutex_lock(&pangoLock);
+
+    layout->pango = create_layout(desc, key->width);
+    pango_layout_set_text(layout->pango, key->text, -1);
+    pango_layout_get_pixel_extents(layout->pango, &ink, &logical);
+
+    pthread_mutex_unlock(&pangoLock);
+
+    pango_font_description_free(desc);
+
+    layout->x = -logical.x;
+    layout->y = -logical.y;
+    layout->width = logical.width;
+    layout->height = logical.height;
+
+    if (ink.width > 0 && ink.height > 0) {
+        layout->ink = ink_bounds(ink.x - logical.x, ink.y - logical.y,
+                                 ink.x - logical.x + ink.width, ink.y - logical.y + ink.height,
+                                 layout->width, layout->height);
+    }
+
+    return layout;
+}
+#else
+/* How far drawing text with font moves along */
+static double text_advance(cairo_scaled_font_t *font, const char *text) {
+    cairo_text_extents_t te;
+
+    cairo_scaled_font_text_extents(font, text, &te);
+
+    return te.x_advance;
+}
+
+/* Breaks text into lines at its line breaks and, when width is above 0,
+ * between words where a line would get wider than width. A word wider than
+ * width gets a line of its own. Returns the lines one after the other, each
+ * ending in a nul, and sets count to how many there are. */
+static char *break_lines(cairo_scaled_font_t *font, const char *text, int width, int *count) {
+    char *ret = copy_string(text);
+    char *line, *end, *space, *p;
+    char saved;
+    int wide;
+
+    *count = 0;
+    line = ret;
+
+    for (;;) {
+        end = line + strcspn(line, "\n");
+        space = NULL;
+
+        /* Measure up to each space in turn, breaking at the last one that
+         * still fit when a line gets too wide */
+        for (p = line; width > 0 && p <= end; p++) {
+            if (p != end && *p != ' ') {
+                continue;
+            }
+
+            saved = *p;
+            *p = '\0';
+            wide = text_advance(font, line) > width;
+            *p = saved;
+
+            if (wide && space != NULL) {
+                *space = '\0';
+                (*count)++;
+
+                line = space + 1;
+                p = space;
+                space = NULL;
+            } else if (p != end) {
+                space = p;
+            }
+        }
+
+        (*count)++;
+
+        if (*end == '\0') {
+            break;
+        }
+
+        *end = '\0';
+        line = end + 1;
+    }
+
+    return ret;
+}
+
+/* Lays key out with the cairo font, one line per line break and wherever a
+ * line would get wider than the width asked for */
+static text_layout_t *new_layout(const text_key_t *key) {
+    text_layout_t *layout = calloc(1, sizeof(text_layout_t));
+    font_entry_t *fnt;
+    const char *line;
+    int i, inked = 0;
+    double top, x1 = 0, y1 = 0, x2 = 0, y2 = 0;
+
+    cairo_text_extents_t te;
+    cairo_font_extents_t fe;
+
+    /* Size up our text with the cached font, so no dummy surface is needed */
+    pthread_mutex_lock(&textLock);
+
+    STATS_BEGIN(STAT_FONT_LOOKUP);
+    fnt = get_font(key->font, key->size, key->bold, key->italics);
+    layout->font = cairo_scaled_font_reference(fnt->scaled);
+    fe = fnt->extents;
+    STATS_END(STAT_FONT_LOOKUP);
+
+    pthread_mutex_unlock(&textLock);
+
+    if (key->width < 0) {
+        layout->lines = copy_string(key->text);
+        layout->count = 1;
+    } else {
+        layout->lines = break_lines(layout->font, key->text, key->width, &layout->count);
+    }
+
+    layout->ascent = fe.ascent;
+    layout->lineHeight = fe.ascent + fe.descent;
+    layout->height = layout->count * layout->lineHeight;
+
+    /* Only the ink of the glyphs shows */
+    line = layout->lines;
+    for (i = 0; i < layout->count; i++) {
+        cairo_scaled_font_text_extents(layout->font, line, &te);
+
+        if ((int)te.x_advance > layout->width) {
+            layout->width = te.x_advance;
+        }
+
+        if (te.width > 0 && te.height > 0) {
+            top = i * layout->lineHeight + fe.ascent + te.y_bearing;
+
+            if (!inked || te.x_bearing < x1)                x1 = te.x_bearing;
+            if (!inked || top < y1)                         y1 = top;
+            if (!inked || te.x_bearing + te.width > x2)     x2 = te.x_bearing + te.width;
+            if (!inked || top + te.height > y2)             y2 = top + te.height;
+
+            inked = 1;
+        }
+
+        line += strlen(line) + 1;
+    }
+
+    if (inked) {
+        layout->ink = ink_bounds(x1, y1, x2, y2, layout->width, layout->height);
+    }
+
+    return layout;
+}
+
+/* Builds the text of key, laid out as layout, up out of the glyphs its font
+ * has drawn before, adding their coverage into an A8 mask. Each pen goes to
+ * the nearest phase. */
+static surface *draw_glyphs(const text_key_t *key, text_layout_t *layout) {
+    surface *ret;
+    font_entry_t *fnt;
+    glyph_entry_t *entry;
+    cairo_glyph_t *glyphs;
+    glyph_entry_t *placed;
+    const char *line;
+    unsigned char *data, *src;
+    int stride, srcStride, count, i, j;
+    int x, y, x1, y1, x2, y2, *pen, penY;
+
+    ret = new_image(CAIRO_FORMAT_A8, layout->width, layout->height, 1);
+
+    cairo_surface_flush(ret);
+    data = cairo_image_surface_get_data(ret);
+    stride = cairo_image_surface_get_stride(ret);
+
+    line = layout->lines;
+    for (i = 0; i < layout->count; i++, line += strlen(line) + 1) {
+        glyphs = NULL;
+
+        if (cairo_scaled_font_text_to_glyphs(layout->font, 0, layout->ascent + i * layout->lineHeight,
+                                             line, -1, &glyphs, &count, NULL, NULL, NULL) != CAIRO_STATUS_SUCCESS) {
+            continue;
+        }
+
+        /* Take what we need out of the font with the lock held, and a
+         * reference on the coverage so clearing the cache cannot free it
+         * from under us */
+        placed = malloc(sizeof(glyph_entry_t) * (count ? count : 1));
+        pen = malloc(sizeof(int) * (count ? count : 1));
+
+        if (placed == NULL || pen == NULL) {
+            free(placed);
+            free(pen);
+            cairo_glyph_free(glyphs);
+            continue;
+        }
+
+        /* Where each pen goes, in steps of 1 / GLYPH_PHASES of a pixel. The
+         * line is all at one height. */
+        for (j = 0; j < count; j++) {
+            pen[j] = floor_int(glyphs[j].x * GLYPH_PHASES + 0.5);
+        }
+
+        penY = floor_int((layout->ascent + i * layout->lineHeight) * GLYPH_PHASES + 0.5);
+
+        pthread_mutex_lock(&textLock);
+
+        fnt = get_font(key->font, key->size, key->bold, key->italics);
+
+        for (j = 0; j < count; j++) {
+            entry = find_glyph(fnt, glyphs[j].index, phase_of(pen[j]), phase_of(penY));
+
+            placed[j] = *entry;
+            if (entry->coverage != NULL) {
+                cairo_surface_reference(entry->coverage);
+            }
+        }
+
+        /* New glyphs may have taken the cache over budget */
+        fnt->glyphUse = ++glyphClock;
+        fit_text(textStats.budget);
+
+        pthread_mutex_unlock(&textLock);
+
+        for (j = 0; j < count; j++) {
+            if (placed[j].coverage == NULL) {
+                continue;
+            }
+
+            x = pixel_of(pen[j]) + placed[j].left;
+            y = pixel_of(penY) + placed[j].top;
+
+            x1 = x < 0 ? 0 : x;
+            y1 = y < 0 ? 0 : y;
+            x2 = x + cairo_image_surface_get_width(placed[j].coverage);
+            y2 = y + cairo_image_surface_get_height(placed[j].coverage);
+
+            if (x2 > layout->width)     x2 = layout->width;
+            if (y2 > layout->height)    y2 = layout->height;
+
+            if (x1 < x2 && y1 < y2) {
+                src = cairo_image_surface_get_data(placed[j].coverage);
+                srcStride = cairo_image_surface_get_stride(placed[j].coverage);
+
+                dl_blit_add_mask(data + (size_t)y1 * stride + x1, stride,
+                                 src + (size_t)(y1 - y) * srcStride + (x1 - x), srcStride,
+                                 x2 - x1, y2 - y1);
+            }
+
+            cairo_surface_destroy(placed[j].coverage);
+        }
+
+        free(placed);
+        free(pen);
+        cairo_glyph_free(glyphs);
+    }
+
+    cairo_surface_mark_dirty(ret);
+
+    return ret;
+}
+#endif
+
+/* Laid out texts, keyed by everything in text_key_t but the color, format
+ * and vector mode, none of which change the layout. Drawing a text again in
+ * another color or format, or as a node, shapes it only once. Guarded by
+ * textLock and kept to the LAYOUT_CACHE_SIZE most recently used. */
+typedef struct layout_entry_t {
+    unsigned long hash;
+    char *text;
+    char *font;
+    int size;
+    unsigned char bold;
+    unsigned char italics;
+    int width;
+
+    text_layout_t *layout;
+
+    /* Chain within a hash bucket */
+    struct layout_entry_t *next;
+
+    /* Most recently used is at the head of the list */
+    struct layout_entry_t *newer;
+    struct layout_entry_t *older;
+} layout_entry_t;
+
+#define LAYOUT_CACHE_SIZE 256
+
+/* As many buckets as entries, so the table never grows */
+static layout_entry_t *layoutBuckets[LAYOUT_CACHE_SIZE];
+static size_t layoutCount = 0;
+static layout_entry_t *layoutNewest = NULL;
+static layout_entry_t *layoutOldest = NULL;
+
+static unsigned long hash_layout(const text_key_t *key) {
+    unsigned long hash = 2166136261UL;
+
+    hash = hash_bytes(hash, key->text, strlen(key->text) + 1);
+    hash = hash_bytes(hash, key->font, strlen(key->font) + 1);
+    hash = hash_bytes(hash, &key->size, sizeof(key->size));
+    hash = hash_bytes(hash, &key->bold, sizeof(key->bold));
+    hash = hash_bytes(hash, &key->italics, sizeof(key->italics));
+    hash = hash_bytes(hash, &key->width, sizeof(key->width));
+
+    return hash;
+}
+
+static void unlink_layout(layout_entry_t *entry) {
+    if (entry->newer != NULL)   entry->newer->older = entry->older;
+    else                        layoutNewest = entry->older;
+
+    if (entry->older != NULL)   entry->older->newer = entry->newer;
+    else                        layoutOldest = entry->newer;
+}
+
+static void push_layout(layout_entry_t *entry) {
+    entry->newer = NULL;
+    entry->older = layoutNewest;
+
+    if (layoutNewest != NULL)   layoutNewest->newer = entry;
+    else                        layoutOldest = entry;
+
+    layoutNewest = entry;
+}
+
+static void remove_layout(layout_entry_t *entry) {
+    layout_entry_t **link;
+
+    link = &layoutBuckets[entry->hash % LAYOUT_CACHE_SIZE];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+
+    unlink_layout(entry);
+
+    layoutCount--;
+
+    release_layout(entry->layout);
+    free(entry->text);
+    free(entry->font);
+    free(entry);
+}
+
+/* Drops every cached layout. Text nodes keep their own. Must be called with
+ * textLock held. */
+static void clear_layouts(void) {
+    while (layoutOldest != NULL) {
+        remove_layout(layoutOldest);
+    }
+}
+
+/* Looks up the layout for key, returning a new reference to it or NULL. Must
+ * be called with textLock held. */
+static text_layout_t *find_layout(unsigned long hash, const text_key_t *key) {
+    layout_entry_t *entry;
+
+    for (entry = layoutBuckets[hash % LAYOUT_CACHE_SIZE]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->size == key->size &&
+            entry->bold == key->bold && entry->italics == key->italics && entry->width == key->width &&
+            strcmp(entry->text, key->text) == 0 && strcmp(entry->font, key->font) == 0) {
+            unlink_layout(entry);
+            push_layout(entry);
+
+            atomic_fetch_add(&entry->layout->refs, 1);
+
+            return entry->layout;
+        }
+    }
+
+    return NULL;
+}
+
+/* Adds a layout to the cache, dropping the least recently used one if it is
+ * full. Must be called with textLock held. */
+static void add_layout(unsigned long hash, const text_key_t *key, text_layout_t *layout) {
+    layout_entry_t *entry;
+
+    if (layoutCount >= LAYOUT_CACHE_SIZE) {
+        remove_layout(layoutOldest);
+    }
+
+    entry = malloc(sizeof(layout_entry_t));
+    entry->hash = hash;
+    entry->text = copy_string(key->text);
+    entry->font = copy_string(key->font);
+    entry->size = key->size;
+    entry->bold = key->bold;
+    entry->italics = key->italics;
+    entry->width = key->width;
+    entry->layout = layout;
+
+    atomic_fetch_add(&layout->refs, 1);
+
+    entry->next = layoutBuckets[hash % LAYOUT_CACHE_SIZE];
+    layoutBuckets[hash % LAYOUT_CACHE_SIZE] = entry;
+    push_layout(entry);
+
+    layoutCount++;
+}
+
+/* Hands out a reference to the layout of key, laying it out the first time
+ * it is asked for. With the text cache off every call lays it out anew. */
+static text_layout_t *get_layout(const text_key_t *key) {
+    text_layout_t *ret, *found;
+    unsigned long hash;
+
+    hash = hash_layout(key);
+
+    pthread_mutex_lock(&textLock);
+    ret = find_layout(hash, key);
+    pthread_mutex_unlock(&textLock);
+
+    if (ret != NULL) {
+        return ret;
+    }
+
+    ret = new_layout(key);
+    atomic_init(&ret->refs, 1);
+
+    pthread_mutex_lock(&textLock);
+
+    /* Another thread may have laid the same text out in the meantime */
+    found = find_layout(hash, key);
+
+    if (found != NULL) {
+        release_layout(found);
+    } else if (textStats.budget > 0) {
+        add_layout(hash, key, ret);
+    }
+
+    pthread_mutex_unlock(&textLock);
+
+    return ret;
+}
+
+/* Creates a text node, which keeps the text laid out rather than pixels, so
+ * it can be drawn at any scale */
+static surface *new_text(const text_key_t *key) {
+    surface *ret;
+    node_t *node;
+    text_layout_t *layout;
+
+    layout = get_layout(key);
+
+    ret = new_node(NODE_TEXT, layout->width, layout->height);
+    node = get_node(ret);
+
+    node->color = key->color;
+    node->layout = layout;
+    node->bounds = layout->ink;
+
+    return ret;
+}
+
+/* Creates a new image surface with key drawn on it */
+static surface *draw_text(const text_key_t *key) {
+    surface *ret;
+    text_layout_t *layout;
+#ifdef CDRAW_PANGO
+    cairo_t *cr;
+#else
+    surface *mask;
+#endif
+
+    layout = get_layout(key);
+
+    STATS_BEGIN(STAT_TEXT_DRAW);
+    STATS_PIXELS((unsigned long long)layout->width * layout->height);
+
+#ifdef CDRAW_PANGO
+    /* Now create our real context and surface we will actually use */
+    ret = new_image(key->format, layout->width, layout->height, 1);
+
+    cr = cairo_create (ret);
+
+    cairo_set_source_rgb(cr, (double)(key->color.r / 255.0), (double)(key->color.g / 255.0), (double)(key->color.b / 255.0));
+    draw_layout(cr, layout, 0, 0);
+
+    cairo_destroy (cr);
+#else
+    mask = draw_glyphs(key, layout);
+
+    /* The coverage is all a mask needs, anything else is tinted with it */
+    if (key->format == CAIRO_FORMAT_A8) {
+        ret = mask;
+    } else {
+        ret = new_image(key->format, layout->width, layout->height, 1);
+
+        cairo_surface_flush(ret);
+        dl_blit_mask(cairo_image_surface_get_data(ret), cairo_image_surface_get_stride(ret),
+                     cairo_image_surface_get_data(mask), cairo_image_surface_get_stride(mask),
+                     color_pixel(key->color), layout->width, layout->height);
+        cairo_surface_mark_dirty(ret);
+
+        cairo_surface_destroy(mask);
+    }
+#endif
+
+    release_layout(layout);
+
+    /* Most of a line of text is the space around the glyphs */
+    find_bounds(ret);
+
+    if (key->format == CAIRO_FORMAT_A8) {
+        set_mask(ret, key->color);
+    }
+
+    STATS_END(STAT_TEXT_DRAW);
+
+    return ret;
+}
+
+/* Hands out the text for key from the text cache, laying it out and drawing
+ * it the first time it is asked for */
+static surface *get_text(const text_key_t *key) {
+    surface *ret;
+    unsigned long hash;
+
+    hash = hash_text(key);
+
+    pthread_mutex_lock(&textLock);
+
+    ret = find_text(hash, key);
+
+    if (ret != NULL) {
+        textStats.hits++;
+        pthread_mutex_unlock(&textLock);
+
+        return ret;
+    }
+
+    textStats.misses++;
+
+    pthread_mutex_unlock(&textLock);
+
+    ret = key->vector ? new_text(key) : draw_text(key);
+
+    pthread_mutex_lock(&textLock);
+    add_text(hash, key, ret);
+    pthread_mutex_unlock(&textLock);
+
+    return ret;
+}
+
+/* Creates a new surface with the given text drawn on it with the given font 
+ * and font size and color used. Surfaces for text that was drawn before are
+ * shared out of the text cache. */
+surface *DL_text(const char* text, int size, color_t color, const char* font, unsigned char bold, unsigned char italics) {
+    text_key_t key = { text, font, size, color, bold, italics, -1, vectorMode, textFormat };
+    surface *ret;
+
+    STATS_BEGIN(STAT_TEXT);
+    ret = get_text(&key);
+    STATS_END(STAT_TEXT);
+
+    return arena_add(ret);
+}
+
+/* Creates a new surface with the given text drawn on it as a paragraph,
+ * breaking lines at its line breaks and, if maxWidth is above 0, between
+ * words so no line is wider than maxWidth. A word wider than maxWidth gets a
+ * line of its own. Paragraphs are shared out of the text cache too. */
+surface *DL_paragraph(const char* text, int size, color_t color, const char* font, unsigned char bold, unsigned char italics, int maxWidth) {
+    text_key_t key = { text, font, size, color, bold, italics, maxWidth > 0 ? maxWidth : 0, vectorMode, textFormat };
+    surface *ret;
+
+    STATS_BEGIN(STAT_PARAGRAPH);
+    ret = get_text(&key);
+    STATS_END(STAT_PARAGRAPH);
+
+    return arena_add(ret);
+}
+
+/* Fills in metrics[i] with the size of the surface DL_text would draw
+ * texts[i] on, and the ascent and descent of the font, for count texts in
+ * the same font. The font is looked up once for all of them and nothing is
+ * drawn. */
+void DL_text_measure_batch(const char* const* texts, int count, int size, const char* font, unsigned char bold, unsigned char italics, text_metrics_t *metrics) {
+#ifdef CDRAW_PANGO
+    PangoFontDescription *desc;
+    PangoLayout *layout;
+    PangoRectangle logical;
+#else
+    font_entry_t *fnt;
+    cairo_scaled_font_t *scaled;
+    cairo_text_extents_t te;
+    cairo_font_extents_t fe;
+#endif
+    int i;
+
+    STATS_BEGIN(STAT_TEXT_MEASURE);
+
+#ifdef CDRAW_PANGO
+    desc = copy_font(font, size, bold, italics);
+
+    /* One layout shapes every text in turn */
+    pthread_mutex_lock(&pangoLock);
+
+    layout = create_layout(desc, -1);
+
+    for (i = 0; i < count; i++) {
+        pango_layout_set_text(layout, texts[i], -1);
+        pango_layout_get_pixel_extents(layout, NULL, &logical);
+
+        metrics[i].width = logical.width;
+        metrics[i].height = logical.height;
+        metrics[i].ascent = PANGO_PIXELS(pango_layout_get_baseline(layout)) - logical.y;
+        metrics[i].descent = metrics[i].height - metrics[i].ascent;
+    }
+
+    g_object_unref(layout);
+
+    pthread_mutex_unlock(&pangoLock);
+
+    pango_font_description_free(desc);
+#else
+    pthread_mutex_lock(&textLock);
+
+    STATS_BEGIN(STAT_FONT_LOOKUP);
+    fnt = get_font(font, size, bold, italics);
+    scaled = cairo_scaled_font_reference(fnt->scaled);
+    fe = fnt->extents;
+    STATS_END(STAT_FONT_LOOKUP);
+
+    pthread_mutex_unlock(&textLock);
+
+    for (i = 0; i < count; i++) {
+        cairo_scaled_font_text_extents(scaled, texts[i], &te);
+
+        metrics[i].width = te.x_advance;
+        metrics[i].height = fe.ascent + fe.descent;
+        metrics[i].ascent = fe.ascent;
+        metrics[i].descent = metrics[i].height - metrics[i].ascent;
+    }
+
+    cairo_scaled_font_destroy(scaled);
+#endif
+
+    STATS_END(STAT_TEXT_MEASURE);
+}
+
+/* Fills in metrics with the size of the surface DL_text would draw text on,
+ * and the ascent and descent of the font, without drawing anything */
+void DL_text_measure(const char* text, int size, const char* font, unsigned char bold, unsigned char italics, text_metrics_t *metrics) {
+    DL_text_measure_batch(&text, 1, size, font, bold, italics, metrics);
+}
+
+/* Sets how many bytes of finished text surfaces and cached glyph coverage
+ * the text cache may hold. Setting it to 0 turns the cache off. The default
+ * is 16MB. */
+void DL_text_cache_set_budget(size_t bytes) {
+    pthread_mutex_lock(&textLock);
+
+    textStats.budget = bytes;
+    fit_text(bytes);
+
+    if (bytes == 0) {
+        clear_layouts();
+    }
+
+    pthread_mutex_unlock(&textLock);
+}
+
+/* Fills in stats with the text cache's hit and miss counters and how many
+ * bytes it currently holds. */
+void DL_text_cache_get_stats(text_cache_stats_t *stats) {
+    pthread_mutex_lock(&textLock);
+    *stats = textStats;
+    pthread_mutex_unlock(&textLock);
+}
+
+/* Empties the text, layout and font caches and resets the counters.
+ * Surfaces handed out from the cache stay valid. */
+void DL_text_cache_clear(void) {
+    font_entry_t *fnt;
+
+    pthread_mutex_lock(&textLock);
+
+    trim_text(0);
+    clear_layouts();
+
+    while (fonts != NULL) {
+        fnt = fonts;
+        fonts = fnt->next;
+
+#ifdef CDRAW_PANGO
+        pango_font_description_free(fnt->desc);
+#else
+        clear_glyphs(fnt);
+        cairo_scaled_font_destroy(fnt->scaled);
+#endif
+        free(fnt->family);
+        free(fnt);
+    }
+
+    textStats.hits = 0;
+    textStats.misses = 0;
+    textStats.evictions = 0;
+
+    pthread_mutex_unlock(&textLock);
+}
+
+/* TODO: Add DL_overlay_align */
+
+/* Overlays the front surface over the back surface, aligned at the middle */
+surface *DL_overlay (surface *back, surface *front) {
+    child_t children[2];
+    int backW, backH, frontW, frontH;
+    int newWidth, newHeight;
+    int x, y;
+    surface *ret;
+    int params[] = { MEMO_OVERLAY, lazyMode || vectorMode, opaqueFormat };
+    surface *inputs[] = { back, front };
+
+    STATS_BEGIN(STAT_OVERLAY);
+
+    ret = memo_get(params, 3, inputs, 2);
+
+    if (ret != NULL) {
+        STATS_END(STAT_OVERLAY);
+        return arena_add(ret);
+    }
+
+    /* Get the width and height of the back, then make sure the new height and 
+     * width of the new image is the larger height and the larger width */
+    backW = get_width(back);
+    backH = get_height(back);
+    frontW = get_width(front);
+    frontH = get_height(front);
+
+    if(frontW > backW) {
+        newWidth = frontW;
+    }
+    else{
+        newWidth = backW;
+    }
+
+    if(frontH > backH) {
+        newHeight = frontH;
+    }
+    else{
+        newHeight = backH;
+    }
+
+    x = (newWidth / 2.0) - (backW / 2.0);
+    y = (newHeight / 2.0) - (backH / 2.0);
+
+    children[0].surf = back;
+    children[0].x = x;
+    children[0].y = y;
+
+    x = (newWidth / 2.0) - (frontW / 2.0);
+    y = (newHeight / 2.0) - (frontH / 2.0);
+
+    children[1].surf = front;
+    children[1].x = x;
+    children[1].y = y;
+
+    ret = compose(newWidth, newHeight, children, 2);
+
+    memo_put(params, 3, inputs, 2, ret);
+
+    STATS_END(STAT_OVERLAY);
+
+    return arena_add(ret);
+}
+
+/* Creates a new surface with all count surfaces drawn beside each other from
+ * left to right, aligned as per align. The result is drawn in one go, so
+ * this is much cheaper than chaining DL_beside_align. Centered surfaces are
+ * centered against the whole result, which can put them a pixel away from
+ * where chained calls would.
+ *
+ * Alignments are either TOP, BOTTOM, or CENTER */
+surface *DL_beside_n (surface **surfs, int count, align_t align) {
+    surface *ret;
+    int params[] = { MEMO_BESIDE_N, lazyMode || vectorMode, opaqueFormat, align };
+    child_t *children;
+    int newWidth, newHeight;
+    int x, i, h;
+
+    STATS_BEGIN(STAT_BESIDE_N);
+
+    ret = memo_get(params, 4, surfs, count);
+
+    if (ret != NULL) {
+        STATS_END(STAT_BESIDE_N);
+        return arena_add(ret);
+    }
+
+    /* The new width is the sum of all the widths, and the height is the
+     * height of the tallest surface */
+    newWidth = 0;
+    newHeight = 0;
+
+    for (i = 0; i < count; i++) {
+        newWidth += get_width(surfs[i]);
+
+        if (get_height(surfs[i]) > newHeight) {
+            newHeight = get_height(surfs[i]);
+        }
+    }
+
+    children = malloc(sizeof(child_t) * (count ? count : 1));
+
+    x = 0;
+
+    for (i = 0; i < count; i++) {
+        h = get_height(surfs[i]);
+
+        children[i].surf = surfs[i];
+        children[i].x = x;
+
+        if (align == TOP)           children[i].y = 0;
+        else if(align == BOTTOM)    children[i].y = newHeight - h;
+        else                        children[i].y = (newHeight / 2.0) - (h / 2.0);
+
+        x += get_width(surfs[i]);
+    }
+
+    ret = compose(newWidth, newHeight, children, count);
+    free(children);
+
+    memo_put(params, 4, surfs, count, ret);
+
+    STATS_END(STAT_BESIDE_N);
+
+    return arena_add(ret);
+}
+
+/* Creates a new surface with all count surfaces drawn above each other from
+ * top to bottom, aligned as per align. The result is drawn in one go, so
+ * this is much cheaper than chaining DL_above_align. Centered surfaces are
+ * centered against the whole result, which can put them a pixel away from
+ * where chained calls would.
+ *
+ * Alignments are either LEFT, RIGHT, or CENTER */
+surface *DL_above_n (surface **surfs, int count, align_t align) {
+    surface *ret;
+    int params[] = { MEMO_ABOVE_N, lazyMode || vectorMode, opaqueFormat, align };
+    child_t *children;
+    int newWidth, newHeight;
+    int y, i, w;
+
+    STATS_BEGIN(STAT_ABOVE_N);
+
+    ret = memo_get(params, 4, surfs, count);
+
+    if (ret != NULL) {
+        STATS_END(STAT_ABOVE_N);
+        return arena_add(ret);
+    }
+
+    newWidth = 0;
+    newHeight = 0;
+
+    for (i = 0; i < count; i++) {
+        newHeight += get_height(surfs[i]);
+
+        if (get_width(surfs[i]) > newWidth) {
+            newWidth = get_width(surfs[i]);
+        }
+    }
+
+    children = malloc(sizeof(child_t) * (count ? count : 1));
+
+    y = 0;
+
+    for (i = 0; i < count; i++) {
+        w = get_width(surfs[i]);
+
+        children[i].surf = surfs[i];
+        children[i].y = y;
+
+        if (align == LEFT)          children[i].x = 0;
+        else if(align == RIGHT)     children[i].x = newWidth - w;
+        else                        children[i].x = (newWidth / 2.0) - (w / 2.0);
+
+        y += get_height(surfs[i]);
+    }
+
+    ret = compose(newWidth, newHeight, children, count);
+    free(children);
+
+    memo_put(params, 4, surfs, count, ret);
+
+    STATS_END(STAT_ABOVE_N);
+
+    return arena_add(ret);
+}
+
+/* Overlays all count surfaces on top of each other, aligned at the middle.
+ * The first surface is at the back and the last one is at the front. Like
+ * DL_overlay, but drawn in one go. */
+surface *DL_overlay_n (surface **surfs, int count) {
+    surface *ret;
+    int params[] = { MEMO_OVERLAY_N, lazyMode || vectorMode, opaqueFormat };
+    child_t *children;
+    int newWidth, newHeight;
+    int i;
+
+    STATS_BEGIN(STAT_OVERLAY_N);
+
+    ret = memo_get(params, 3, surfs, count);
+
+    if (ret != NULL) {
+        STATS_END(STAT_OVERLAY_N);
+        return arena_add(ret);
+    }
+
+    newWidth = 0;
+    newHeight = 0;
+
+    for (i = 0; i < count; i++) {
+        if (get_width(surfs[i]) > newWidth) {
+            newWidth = get_width(surfs[i]);
+        }
+
+        if (get_height(surfs[i]) > newHeight) {
+            newHeight = get_height(surfs[i]);
+        }
+    }
+
+    children = malloc(sizeof(child_t) * (count ? count : 1));
+
+    for (i = 0; i < count; i++) {
+        children[i].surf = surfs[i];
+        children[i].x = (newWidth / 2.0) - (get_width(surfs[i]) / 2.0);
+        children[i].y = (newHeight / 2.0) - (get_height(surfs[i]) / 2.0);
+    }
+
+    ret = compose(newWidth, newHeight, children, count);
+    free(children);
+
+    memo_put(params, 3, surfs, count, ret);
+
+    STATS_END(STAT_OVERLAY_N);
+
+    return arena_add(ret);
+}
+
+/* Creates a new surface with rows * cols cells laid out in a grid. cells is
+ * row major, so the cell at row r and column c is cells[r * cols + c], and a
+ * cell may be NULL to leave it blank. Every column is as wide as its widest
+ * cell and every row as tall as its tallest cell. Within its row a cell is
+ * aligned by rowAlign[r], TOP, BOTTOM, or CENTER, and within its column by
+ * colAlign[c], LEFT, RIGHT, or CENTER. Either array may be NULL to center
+ * everything that way. The whole grid is drawn into the result in one go. */
+surface *DL_grid (surface **cells, int rows, int cols, align_t *rowAlign, align_t *colAlign) {
+    surface *ret;
+    int *params, paramCount;
+    surface *cell;
+    child_t *children;
+    int *colX, *rowY;
+    int r, c, w, h, count;
+    align_t align;
+
+    STATS_BEGIN(STAT_GRID);
+
+    /* The alignments are part of the call, when there are any */
+    params = malloc((7 + rows + cols) * sizeof(int));
+    paramCount = 0;
+
+    params[paramCount++] = MEMO_GRID;
+    params[paramCount++] = lazyMode || vectorMode;
+    params[paramCount++] = opaqueFormat;
+    params[paramCount++] = rows;
+    params[paramCount++] = cols;
+    params[paramCount++] = rowAlign != NULL;
+    params[paramCount++] = colAlign != NULL;
+
+    for (r = 0; rowAlign != NULL && r < rows; r++)  params[paramCount++] = rowAlign[r];
+    for (c = 0; colAlign != NULL && c < cols; c++)  params[paramCount++] = colAlign[c];
+
+    ret = memo_get(params, paramCount, cells, rows * cols);
+
+    if (ret != NULL) {
+        free(params);
+        STATS_END(STAT_GRID);
+        return arena_add(ret);
+    }
+
+    /* colX and rowY hold where each column and row starts, with one extra
+     * entry at the end for where the grid ends. Start by finding the size of
+     * each column and row, then add them up. */
+    colX = calloc(cols + 1, sizeof(int));
+    rowY = calloc(rows + 1, sizeof(int));
+
+    for (r = 0; r < rows; r++) {
+        for (c = 0; c < cols; c++) {
+            cell = cells[r * cols + c];
+
+            if (cell == NULL) {
+                continue;
+            }
+
+            if (get_width(cell) > colX[c + 1])     colX[c + 1] = get_width(cell);
+            if (get_height(cell) > rowY[r + 1])    rowY[r + 1] = get_height(cell);
+        }
+    }
+
+    for (c = 0; c < cols; c++)  colX[c + 1] += colX[c];
+    for (r = 0; r < rows; r++)  rowY[r + 1] += rowY[r];
+
+    children = malloc(sizeof(child_t) * (rows * cols > 0 ? rows * cols : 1));
+    count = 0;
+
+    for (r = 0; r < rows; r++) {
+        for (c = 0; c < cols; c++) {
+            cell = cells[r * cols + c];
+
+            if (cell == NULL) {
+                continue;
+            }
+
+            w = colX[c + 1] - colX[c];
+            h = rowY[r + 1] - rowY[r];
+
+            children[count].surf = cell;
+
+            align = colAlign ? colAlign[c] : CENTER;
+
+            if (align == LEFT)          children[count].x = colX[c];
+            else if(align == RIGHT)     children[count].x = colX[c] + w - get_width(cell);
+            else                        children[count].x = colX[c] + (int)((w / 2.0) - (get_width(cell) / 2.0));
+
+            align = rowAlign ? rowAlign[r] : CENTER;
+
+            if (align == TOP)           children[count].y = rowY[r];
+            else if(align == BOTTOM)    children[count].y = rowY[r] + h - get_height(cell);
+            else                        children[count].y = rowY[r] + (int)((h / 2.0) - (get_height(cell) / 2.0));
+
+            count++;
+        }
+    }
+
+    ret = compose(colX[cols], rowY[rows], children, count);
+
+    free(children);
+    free(colX);
+    free(rowY);
+
+    memo_put(params, paramCount, cells, rows * cols, ret);
+    free(params);
+
+    STATS_END(STAT_GRID);
+
+    return arena_add(ret);
+}
+
+static void release_view(void *data) {
+    cairo_surface_destroy(data);
+}
+
+/* Creates an image surface showing the width by height part of the image
+ * surface surf at x, y, reading the pixels of surf in place. Returns NULL
+ * when the part does not start on a 4 byte boundary of its rows, which
+ * cairo needs of the pixels of an image. */
+static surface *view_image(surface *surf, int x, int y, int width, int height) {
+    surface *ret;
+    image_info_t *info;
+    unsigned char *data;
+    int stride, offset;
+    cairo_format_t format;
+
+    cairo_surface_flush(surf);
+
+    format = cairo_image_surface_get_format(surf);
+    data = cairo_image_surface_get_data(surf);
+    stride = cairo_image_surface_get_stride(surf);
+
+    switch (format) {
+    case CAIRO_FORMAT_ARGB32:
+    case CAIRO_FORMAT_RGB24:
+        offset = x * 4;
+        break;
+
+    case CAIRO_FORMAT_RGB16_565:
+        offset = x * 2;
+        break;
+
+    case CAIRO_FORMAT_A8:
+        offset = x;
+        break;
+
+    default:
+        return NULL;
+    }
+
+    if (data == NULL || offset % 4 != 0) {
+        return NULL;
+    }
+
+    ret = cairo_image_surface_create_for_data(data + (size_t)y * stride + offset, format, width, height, stride);
+
+    if (cairo_surface_set_user_data(ret, &viewKey, cairo_surface_reference(surf), release_view) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surf);
+        cairo_surface_destroy(ret);
+        return NULL;
+    }
+
+    set_info(ret, is_opaque(surf), crop_rect(get_bounds(surf), x, y, width, height));
+
+    info = cairo_surface_get_user_data(surf, &infoKey);
+
+    if (info != NULL && info->mask) {
+        set_mask(ret, info->color);
+    }
+
+    return ret;
+}
+
+/* Creates a node showing the width by height part of surf at x, y, which
+ * paints surf clipped to that part */
+static surface *view_node(surface *surf, int x, int y, int width, int height) {
+    surface *ret;
+    node_t *node;
+
+    ret = new_node(NODE_VIEW, width, height);
+    node = get_node(ret);
+
+    node->opaque = is_opaque(surf);
+    node->bounds = crop_rect(get_bounds(surf), x, y, width, height);
+    node->count = 1;
+    node->children = malloc(sizeof(child_t));
+    STATS_ALLOC(sizeof(child_t));
+
+    node->children[0].surf = cairo_surface_reference(surf);
+    node->children[0].x = -x;
+    node->children[0].y = -y;
+    node->children[0].hidden = 0;
+
+    return ret;
+}
+
+/* Creates a new surface showing the width by height part of surf whose top
+ * left corner is at x, y, clipped to surf. No pixels are copied, the result
+ * reads them out of surf, which it keeps alive. */
+surface *DL_crop (surface *surf, int x, int y, int width, int height) {
+    surface *ret;
+    node_t *node;
+    int params[] = { MEMO_CROP, x, y, width, height };
+
+    STATS_BEGIN(STAT_CROP);
+
+    ret = memo_get(params, 5, &surf, 1);
+
+    if (ret != NULL) {
+        STATS_END(STAT_CROP);
+        return arena_add(ret);
+    }
+
+    if (x < 0) {
+        width += x;
+        x = 0;
+    }
+
+    if (y < 0) {
+        height += y;
+        y = 0;
+    }
+
+    if (width > get_width(surf) - x)      width = get_width(surf) - x;
+    if (height > get_height(surf) - y)    height = get_height(surf) - y;
+    if (width < 0)                        width = 0;
+    if (height < 0)                       height = 0;
+
+    node = get_node(surf);
+    ret = NULL;
+
+    if (x == 0 && y == 0 && width == get_width(surf) && height == get_height(surf)) {
+        ret = cairo_surface_reference(surf);
+    }
+    else if (width == 0 || height == 0 || (node != NULL && node->kind == NODE_EMPTY)) {
+        ret = new_node(NODE_EMPTY, width, height);
+    }
+    else if (node != NULL && node->kind == NODE_SOLID) {
+        ret = new_solid(width, height, node->color);
+    }
+    else if (node == NULL && cairo_surface_get_type(surf) == CAIRO_SURFACE_TYPE_IMAGE) {
+        ret = view_image(surf, x, y, width, height);
+    }
+
+    if (ret == NULL) {
+        ret = view_node(surf, x, y, width, height);
+    }
+
+    memo_put(params, 5, &surf, 1, ret);
+
+    STATS_END(STAT_CROP);
+
+    return arena_add(ret);
+}
+
+/* Creates a new surface with surf in it and left, top, right and bottom
+ * pixels of transparent space around it. Negative amounts are taken as 0.
+ * No pixels are copied or allocated. */
+surface *DL_pad (surface *surf, int left, int top, int right, int bottom) {
+    surface *ret;
+    child_t child;
+    int params[5];
+
+    if (left < 0)      left = 0;
+    if (top < 0)       top = 0;
+    if (right < 0)     right = 0;
+    if (bottom < 0)    bottom = 0;
+
+    params[0] = MEMO_PAD;
+    params[1] = left;
+    params[2] = top;
+    params[3] = right;
+    params[4] = bottom;
+
+    STATS_BEGIN(STAT_PAD);
+
+    ret = memo_get(params, 5, &surf, 1);
+
+    if (ret != NULL) {
+        STATS_END(STAT_PAD);
+        return arena_add(ret);
+    }
+
+    /* The space around is transparent, so surf is kept as it is in a group
+     * rather than drawn into a bigger image */
+    if (left == 0 && top == 0 && right == 0 && bottom == 0) {
+        ret = cairo_surface_reference(surf);
+    }
+    else {
+        child.surf = surf;
+        child.x = left;
+        child.y = top;
+        child.hidden = 0;
+
+        ret = new_group(get_width(surf) + left + right, get_height(surf) + top + bottom, &child, 1);
+    }
+
+    memo_put(params, 5, &surf, 1, ret);
+
+    STATS_END(STAT_PAD);
+
+    return arena_add(ret);
+}
+
+/* Get the width of the surface */
+int DL_get_width(surface *surf) {
+    return get_width(surf);
+}
+
+/* Get the height of the surface */
+int DL_get_height(surface *surf) {
+    return get_height(surf);
+}
+
+/* Free the surface. Surfaces are reference counted, this drops one
+ * reference and the surface goes away once the last one is dropped. */
+void DL_free_surface(surface *surf) {
+    STATS_BEGIN(STAT_FREE_SURFACE);
+    cairo_surface_destroy(surf);
+    STATS_END(STAT_FREE_SURFACE);
+}
+
+/* Takes another reference to the surface and returns it. Each reference is
+ * dropped with its own call to DL_free_surface. */
+surface *DL_retain_surface(surface *surf) {
+    return cairo_surface_reference(surf);
+}
+
+/* Turns lazy composition on or off. While lazy mode is on, DL_beside_align,
+ * DL_above_align and DL_overlay do not draw anything, they return a small
+ * node which remembers its children and where they go. The pixels are only
+ * produced once, when the final surface is passed to DL_render. Lazy mode is
+ * off by default. */
+void DL_set_lazy(unsigned char lazy) {
+    lazyMode = lazy;
+}
+
+/* Turns vector mode on or off. While it is on, DL_text keeps the text and
+ * its font rather than drawing it, and the combinators build groups as they
+ * do in lazy mode, so nothing is drawn at a fixed size. The finished surface
+ * can then be drawn at any scale with DL_render_scaled, or written out as a
+ * PDF or SVG, with rectangles and text kept as shapes and glyphs. Vector mode
+ * is off by default. */
+void DL_set_vector(unsigned char vector) {
+    vectorMode = vector;
+}
+
+/* Sets what DL_text draws text into, ARGB32 or an A8 mask which its color
+ * is filled through wherever it is drawn. Text already in the text cache
+ * keeps the format it was drawn in. */
+void DL_set_text_format(format_t format) {
+    textFormat = format == FORMAT_A8 ? CAIRO_FORMAT_A8 : CAIRO_FORMAT_ARGB32;
+}
+
+/* Sets what opaque images are kept in once drawn, ARGB32, RGB24 or
+ * RGB16_565 */
+void DL_set_opaque_format(format_t format) {
+    switch (format) {
+    case FORMAT_RGB24:
+        opaqueFormat = CAIRO_FORMAT_RGB24;
+        break;
+
+    case FORMAT_RGB16_565:
+        opaqueFormat = CAIRO_FORMAT_RGB16_565;
+        break;
+
+    default:
+        opaqueFormat = CAIRO_FORMAT_ARGB32;
+        break;
+    }
+}
+
+/* Returns the format the pixels of the surface are kept in */
+format_t DL_get_format(surface *surf) {
+    if (get_node(surf) != NULL || cairo_surface_get_type(surf) != CAIRO_SURFACE_TYPE_IMAGE) {
+        return FORMAT_ARGB32;
+    }
+
+    switch (cairo_image_surface_get_format(surf)) {
+    case CAIRO_FORMAT_RGB24:
+        return FORMAT_RGB24;
+
+    case CAIRO_FORMAT_A8:
+        return FORMAT_A8;
+
+    case CAIRO_FORMAT_RGB16_565:
+        return FORMAT_RGB16_565;
+
+    default:
+        return FORMAT_ARGB32;
+    }
+}
+
+/* Draws surf into a new image surface of its own. With keep set the image
+ * is handed back to be kept, so it is left in format, the format opaque
+ * images are kept in, otherwise it is always ARGB32. */
+static surface *render(surface *surf, int keep, cairo_format_t format) {
+    surface *ret;
+    child_t child;
+
+    child.surf = surf;
+    child.x = 0;
+    child.y = 0;
+    child.hidden = 0;
+
+    ret = new_image(keep ? draw_format(is_opaque(surf), format) : CAIRO_FORMAT_ARGB32,
+                    get_width(surf), get_height(surf), !is_opaque(surf));
+    paint_children(ret, &child, 1);
+    set_info(ret, is_opaque(surf), get_bounds(surf));
+
+    return keep ? pack_image(ret, format) : ret;
+}
+
+/* Draws the given surface, and everything it was composed from, into a new
+ * image surface. This is where a surface built in lazy mode actually gets
+ * its pixels. */
+surface *DL_render(surface *surf) {
+    surface *ret;
+
+    STATS_BEGIN(STAT_RENDER);
+    ret = render(surf, 1, opaqueFormat);
+    STATS_END(STAT_RENDER);
+
+    return arena_add(ret);
+}
+
+/* Draws the given surface, and everything it was composed from, into a new
+ * image surface scale times its size. Rectangles, and text made in vector
+ * mode, are drawn at the new size and stay sharp. Images are scaled. */
+surface *DL_render_scaled(surface *surf, double scale) {
+    surface *ret;
+    cairo_t *cr;
+    int width, height;
+
+    STATS_BEGIN(STAT_RENDER);
+
+    width = (int)(get_width(surf) * scale + 0.5);
+    height = (int)(get_height(surf) * scale + 0.5);
+
+    ret = new_image(CAIRO_FORMAT_ARGB32, width, height, 1);
+
+    if (width > 0 && height > 0) {
+        cr = cairo_create(ret);
+        cairo_scale(cr, scale, scale);
+        paint_surface(cr, surf, 0, 0, atomic_load(&renderStarted));
+        cairo_destroy(cr);
+    }
+
+    STATS_END(STAT_RENDER);
+
+    return arena_add(ret);
+}
+
+/* Guards recording nodes into their surfaces, see DL_get_cairo_surface */
+static pthread_mutex_t recordLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns surf ready to be used as a source in plain cairo calls. Nodes are
+ * recorded into their recording surface the first time they are asked for,
+ * with their children walked rather than recorded themselves. Image surfaces
+ * are returned as they are. */
+cairo_surface_t *DL_get_cairo_surface(surface *surf) {
+    node_t *node = get_node(surf);
+    cairo_t *cr;
+
+    if (node == NULL) {
+        return surf;
+    }
+
+    STATS_BEGIN(STAT_GET_CAIRO_SURFACE);
+
+    pthread_mutex_lock(&recordLock);
+
+    if (!node->recorded) {
+        cr = cairo_create(surf);
+        paint_surface(cr, surf, 0, 0, atomic_load(&renderStarted));
+        cairo_destroy(cr);
+
+        node->recorded = 1;
+    }
+
+    pthread_mutex_unlock(&recordLock);
+
+    STATS_END(STAT_GET_CAIRO_SURFACE);
+
+    return surf;
+}
+
+/* Sets how many threads are used to draw large images, counting the calling
+ * thread. 1, the default, draws everything on the calling thread. 0 uses
+ * one thread per core. The output is the same either way. */
+void DL_set_threads(int count) {
+    if (count <= 0) {
+        count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    atomic_store(&threadCount, count > 0 ? count : 1);
+}
+
+/* Renders asked for with DL_render_async wait in a queue and are taken off
+ * it in order by the render threads. A pending surface can only be made
+ * from a future which already exists, so a render only ever waits on
+ * renders queued before it, which have already been taken off the queue,
+ * and the threads cannot end up all waiting on each other. */
+static pthread_cond_t renderWake = PTHREAD_COND_INITIALIZER;
+static future_t *renderHead = NULL;
+static future_t *renderTail = NULL;
+static int renderThreads = 0;
+
+static void *render_worker(void *arg) {
+    future_t *future;
+    surface *result, *source;
+
+    (void)arg;
+
+    pthread_mutex_lock(&renderLock);
+
+    for (;;) {
+        while (renderHead == NULL) {
+            pthread_cond_wait(&renderWake, &renderLock);
+        }
+
+        future = renderHead;
+        renderHead = future->next;
+
+        if (renderHead == NULL) {
+            renderTail = NULL;
+        }
+
+        pthread_mutex_unlock(&renderLock);
+
+        STATS_BEGIN(STAT_RENDER);
+        result = render(future->source, 1, future->opaqueFormat);
+        STATS_END(STAT_RENDER);
+
+        pthread_mutex_lock(&renderLock);
+
+        source = future->source;
+        future->source = NULL;
+        future->result = result;
+        pthread_cond_broadcast(&renderDone);
+
+        pthread_mutex_unlock(&renderLock);
+
+        /* The tree may be large, and nothing needs it any more */
+        cairo_surface_destroy(source);
+        release_future(future);
+
+        pthread_mutex_lock(&renderLock);
+    }
+
+    return NULL;
+}
+
+/* Starts drawing the given surface, and everything it was composed from,
+ * on a render thread, and returns straight away. The future holds its own
+ * reference on the surface. */
+future_t *DL_render_async(surface *surf) {
+    future_t *future;
+    pthread_t thread;
+
+    STATS_BEGIN(STAT_RENDER_ASYNC);
+
+    future = malloc(sizeof(future_t));
+    STATS_ALLOC(sizeof(future_t));
+
+    /* One reference for the caller and one for the queue */
+    atomic_init(&future->refs, 2);
+    future->source = cairo_surface_reference(surf);
+    future->result = NULL;
+    future->opaqueFormat = opaqueFormat;
+    future->next = NULL;
+
+    pthread_mutex_lock(&renderLock);
+
+    while (renderThreads < atomic_load(&threadCount)) {
+        atomic_store(&renderStarted, 1);
+
+        if (pthread_create(&thread, NULL, render_worker, NULL) != 0) {
+            break;
+        }
+
+        pthread_detach(thread);
+        renderThreads++;
+    }
+
+    /* Without a thread to do it, draw it here */
+    if (renderThreads == 0) {
+        pthread_mutex_unlock(&renderLock);
+
+        future->result = render(future->source, 1, future->opaqueFormat);
+        cairo_surface_destroy(future->source);
+        future->source = NULL;
+        atomic_store(&future->refs, 1);
+
+        STATS_END(STAT_RENDER_ASYNC);
+
+        return future;
+    }
+
+    if (renderTail != NULL) {
+        renderTail->next = future;
+    }
+    else {
+        renderHead = future;
+    }
+
+    renderTail = future;
+    pthread_cond_signal(&renderWake);
+
+    pthread_mutex_unlock(&renderLock);
+
+    STATS_END(STAT_RENDER_ASYNC);
+
+    return future;
+}
+
+/* Whether the render is done, so DL_future_wait will not block */
+int DL_future_ready(future_t *future) {
+    int ret;
+
+    pthread_mutex_lock(&renderLock);
+    ret = future->result != NULL;
+    pthread_mutex_unlock(&renderLock);
+
+    return ret;
+}
+
+/* Waits for the render to be done and returns the image it drew */
+surface *DL_future_wait(future_t *future) {
+    surface *ret;
+
+    STATS_BEGIN(STAT_FUTURE_WAIT);
+    ret = cairo_surface_reference(wait_future(future));
+    STATS_END(STAT_FUTURE_WAIT);
+
+    return arena_add(ret);
+}
+
+/* Returns a surface the size of the image the render will draw, which can be
+ * composed like any other while the render is still running. Only drawing
+ * it waits for the render. Once the render is done it is simply the image. */
+surface *DL_future_get_surface(future_t *future) {
+    surface *ret, *source;
+    node_t *node;
+
+    STATS_BEGIN(STAT_FUTURE_GET_SURFACE);
+
+    pthread_mutex_lock(&renderLock);
+
+    if (future->result != NULL) {
+        ret = cairo_surface_reference(future->result);
+        pthread_mutex_unlock(&renderLock);
+
+        STATS_END(STAT_FUTURE_GET_SURFACE);
+        return arena_add(ret);
+    }
+
+    source = cairo_surface_reference(future->source);
+
+    pthread_mutex_unlock(&renderLock);
+
+    ret = new_node(NODE_PENDING, get_width(source), get_height(source));
+    node = get_node(ret);
+
+    node->opaque = is_opaque(source);
+    node->bounds = get_bounds(source);
+
+    atomic_fetch_add(&future->refs, 1);
+    node->future = future;
+
+    cairo_surface_destroy(source);
+
+    STATS_END(STAT_FUTURE_GET_SURFACE);
+
+    return arena_add(ret);
+}
+
+/* Drops the caller's reference to the future. A render still running is
+ * finished regardless, and what it drew goes once nothing refers to it. */
+void DL_future_free(future_t *future) {
+    release_future(future);
+}
+
+/* Surfaces may be shared, by other references, by the text cache, or by the
+ * surfaces composed from them, so they must not be drawn on directly. This
+ * takes over the caller's reference to surf and returns an ARGB32 image
+ * surface which the caller is the only owner of and may draw on. If surf
+ * already is such a surface it is returned as is, otherwise it is copied. A
+ * surface owned by an arena must be retained before it is passed in, and
+ * what comes back is never owned by an arena. */
+surface *DL_make_writable(surface *surf) {
+    surface *ret;
+
+    STATS_BEGIN(STAT_MAKE_WRITABLE);
+
+    /* Whatever the caller draws may not be opaque. Mapped pixels can not be
+     * drawn on at all, pixels shared with a crop's parent or the caller's
+     * buffer not without changing those as well, and images kept in other formats are handed back as
+     * ARGB32. */
+    if (get_node(surf) == NULL && cairo_surface_get_reference_count(surf) == 1 &&
+        cairo_surface_get_user_data(surf, &mappingKey) == NULL &&
+        cairo_surface_get_user_data(surf, &viewKey) == NULL && !is_borrowed(surf) &&
+        cairo_image_surface_get_format(surf) == CAIRO_FORMAT_ARGB32) {
+        clear_info(surf);
+        STATS_END(STAT_MAKE_WRITABLE);
+        return surf;
+    }
+
+    ret = render(surf, 0, opaqueFormat);
+    clear_info(ret);
+    cairo_surface_destroy(surf);
+
+    STATS_END(STAT_MAKE_WRITABLE);
+
+    return ret;
+}
+
+/* How many rows DL_write_png and DL_write_raw draw at a time */
+#define BAND_HEIGHT 64
+
+/* Draws surf a band of rows at a time, handing each finished band to
+ * write_band. Returns -1 as soon as write_band fails. */
+static int write_bands(surface *surf, int (*write_band)(void *closure, const unsigned char *data, int stride, int rows), void *closure) {
+    surface *band;
+    child_t child;
+    int width, height, stride, rows, y, ret;
+
+    width = get_width(surf);
+    height = get_height(surf);
+
+    band = new_image(CAIRO_FORMAT_ARGB32, width, height < BAND_HEIGHT ? height : BAND_HEIGHT, 0);
+    stride = cairo_image_surface_get_stride(band);
+
+    if (cairo_surface_status(band) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(band);
+        return -1;
+    }
+
+    child.surf = surf;
+    child.x = 0;
+    child.hidden = 0;
+    ret = 0;
+
+    for (y = 0; y < height && ret == 0; y += BAND_HEIGHT) {
+        rows = height - y < BAND_HEIGHT ? height - y : BAND_HEIGHT;
+
+        /* The band is reused, so clear out the last one first, unless surf
+         * is opaque and covers it anyway */
+        if (!is_opaque(surf)) {
+            cairo_surface_flush(band);
+            memset(cairo_image_surface_get_data(band), 0, (size_t)stride * rows);
+            cairo_surface_mark_dirty(band);
+        }
+
+        child.y = -y;
+        paint_children(band, &child, 1);
+
+        cairo_surface_flush(band);
+        ret = write_band(closure, cairo_image_surface_get_data(band), stride, rows);
+    }
+
+    cairo_surface_destroy(band);
+
+    return ret;
+}
+
+static int write_fd(void *closure, const unsigned char *data, size_t length) {
+    int fd = *(int*)closure;
+    ssize_t written;
+
+    while (length > 0) {
+        written = write(fd, data, length);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        data += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+static int write_png_band(void *closure, const unsigned char *data, int stride, int rows) {
+    int ret;
+
+    STATS_BEGIN(STAT_PNG_ENCODE);
+    ret = dl_png_write_rows(closure, data, stride, rows);
+    STATS_END(STAT_PNG_ENCODE);
+
+    return ret;
+}
+
+/* The raw writer needs the callback and the row width to go with it */
+typedef struct raw_writer_t {
+    write_func_t write;
+    void *closure;
+    size_t rowBytes;
+} raw_writer_t;
+
+static int write_raw_band(void *closure, const unsigned char *data, int stride, int rows) {
+    raw_writer_t *raw = closure;
+    int y;
+
+    /* Rows are packed in the output, so padding at the end of each row in
+     * the band is skipped */
+    if ((size_t)stride == raw->rowBytes) {
+        return raw->write(raw->closure, data, raw->rowBytes * rows) != 0 ? -1 : 0;
+    }
+
+    for (y = 0; y < rows; y++) {
+        if (raw->write(raw->closure, data + (size_t)y * stride, raw->rowBytes) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Like DL_write_png, but the PNG is handed to write, along with closure,
+ * instead of being written to a file descriptor. */
+int DL_write_png_stream(surface *surf, write_func_t write, void *closure) {
+    dl_png_t *png;
+    int ret;
+
+    STATS_BEGIN(STAT_WRITE_PNG);
+
+    png = dl_png_begin(get_width(surf), get_height(surf), write, closure);
+
+    if (png == NULL) {
+        ret = -1;
+        STATS_END(STAT_WRITE_PNG);
+        return ret;
+    }
+
+    ret = write_bands(surf, write_png_band, png);
+
+    /* Always finish, so the encoder is freed even if a band failed */
+    if (dl_png_end(png) != 0) {
+        ret = -1;
+    }
+
+    STATS_END(STAT_WRITE_PNG);
+
+    return ret;
+}
+
+/* Draws the given surface and writes it to fd as a PNG. The image is drawn
+ * and encoded a band of rows at a time, so only a band is ever held in
+ * memory, however tall the surface is. Returns 0 on success and -1 if
+ * anything could not be written. */
+int DL_write_png(surface *surf, int fd) {
+    return DL_write_png_stream(surf, write_fd, &fd);
+}
+
+/* Like DL_write_raw, but the pixels are handed to write, along with closure,
+ * instead of being written to a file descriptor. */
+int DL_write_raw_stream(surface *surf, write_func_t write, void *closure) {
+    raw_writer_t raw;
+    int ret;
+
+    STATS_BEGIN(STAT_WRITE_RAW);
+
+    raw.write = write;
+    raw.closure = closure;
+    raw.rowBytes = (size_t)get_width(surf) * 4;
+
+    ret = write_bands(surf, write_raw_band, &raw);
+    STATS_END(STAT_WRITE_RAW);
+
+    return ret;
+}
+
+/* Draws the given surface and writes its raw pixels to fd, a band of rows at
+ * a time. There is no header, the rows are written top to bottom, each
+ * width * 4 bytes long, with every pixel a native endian premultiplied ARGB32
+ * value. Returns 0 on success and -1 if anything could not be written. */
+int DL_write_raw(surface *surf, int fd) {
+    return DL_write_raw_stream(surf, write_fd, &fd);
+}
+
+/* The directory DL_disk_cache_store and DL_disk_cache_load use, if any */
+static pthread_mutex_t diskLock = PTHREAD_MUTEX_INITIALIZER;
+static char *diskDir = NULL;
+
+/* Sets the directory surfaces are stored in by DL_disk_cache_store and
+ * loaded from by DL_disk_cache_load. It must already exist. Several
+ * processes may share one, each file is written whole under a temporary
+ * name and then renamed into place. NULL, the default, turns the cache off. */
+void DL_disk_cache_set_dir(const char *dir) {
+    char *copy = dir != NULL ? strdup(dir) : NULL;
+
+    pthread_mutex_lock(&diskLock);
+    free(diskDir);
+    diskDir = copy;
+    pthread_mutex_unlock(&diskLock);
+}
+
+/* The path of the file key is stored in, to be freed by the caller, or NULL
+ * if there is no cache directory */
+static char *disk_path(const char *key) {
+    char name[DL_DISK_NAME_SIZE];
+    char *ret = NULL;
+    size_t length;
+
+    dl_disk_name(name, key);
+    pthread_mutex_lock(&diskLock);
+
+    if (diskDir != NULL) {
+        length = strlen(diskDir) + 1 + strlen(name) + 1;
+        ret = malloc(length);
+
+        if (ret != NULL) {
+            snprintf(ret, length, "%s/%s", diskDir, name);
+        }
+    }
+
+    pthread_mutex_unlock(&diskLock);
+
+    return ret;
+}
+
+static void unmap(void *data) {
+    mapping_t *mapping = data;
+
+    munmap(mapping->data, mapping->length);
+    free(mapping);
+}
+
+/* Draws the given surface and stores it in the disk cache under key, in place
+ * of anything stored under it before. The key should name everything the
+ * surface was made from, a later DL_disk_cache_load with the same key gets
+ * these pixels back without drawing anything. Returns 0 on success and -1 if
+ * there is no cache directory or the file could not be written. */
+int DL_disk_cache_store(surface *surf, const char *key) {
+    dl_disk_header_t header;
+    rect_t bounds;
+    char *path, *temp;
+    int box[4];
+    int fd, ret;
+
+    STATS_BEGIN(STAT_DISK_CACHE_STORE);
+
+    path = disk_path(key);
+
+    if (path == NULL) {
+        STATS_END(STAT_DISK_CACHE_STORE);
+        return -1;
+    }
+
+    temp = malloc(strlen(path) + 8);
+
+    if (temp == NULL) {
+        free(path);
+        STATS_END(STAT_DISK_CACHE_STORE);
+        return -1;
+    }
+
+    sprintf(temp, "%s.XXXXXX", path);
+    fd = mkstemp(temp);
+
+    if (fd < 0) {
+        free(temp);
+        free(path);
+        STATS_END(STAT_DISK_CACHE_STORE);
+        return -1;
+    }
+
+    bounds = get_bounds(surf);
+    box[0] = bounds.x;
+    box[1] = bounds.y;
+    box[2] = bounds.width;
+    box[3] = bounds.height;
+
+    dl_disk_header_init(&header, key, get_width(surf), get_height(surf), is_opaque(surf), box);
+
+    ret = dl_disk_write_header(&header, key, write_fd, &fd);
+
+    if (ret == 0) {
+        ret = DL_write_raw_stream(surf, write_fd, &fd);
+    }
+
+    /* mkstemp makes the file readable by its owner only */
+    if (ret == 0 && fchmod(fd, 0644) != 0) {
+        ret = -1;
+    }
+
+    if (close(fd) != 0) {
+        ret = -1;
+    }
+
+    /* Readers only ever see a whole file, the old one or the new one */
+    if (ret == 0 && rename(temp, path) != 0) {
+        ret = -1;
+    }
+
+    if (ret != 0) {
+        unlink(temp);
+    }
+
+    free(temp);
+    free(path);
+
+    STATS_END(STAT_DISK_CACHE_STORE);
+
+    return ret;
+}
+
+/* Returns the surface stored in the disk cache under key, or NULL if there
+ * is none. Nothing is decoded or copied, the surface's pixels are the pages
+ * of the file, mapped read only and shared with every other process that
+ * loaded it. It must not be drawn on, DL_make_writable copies it. */
+surface *DL_disk_cache_load(const char *key) {
+    dl_disk_header_t header;
+    mapping_t *mapping;
+    struct stat info;
+    surface *ret;
+    rect_t bounds;
+    char *path;
+    void *data;
+    int fd;
+
+    STATS_BEGIN(STAT_DISK_CACHE_LOAD);
+
+    path = disk_path(key);
+
+    if (path == NULL) {
+        STATS_END(STAT_DISK_CACHE_LOAD);
+        return NULL;
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+
+    if (fd < 0) {
+        STATS_END(STAT_DISK_CACHE_LOAD);
+        return NULL;
+    }
+
+    if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+        close(fd);
+        STATS_END(STAT_DISK_CACHE_LOAD);
+        return NULL;
+    }
+
+    /* The mapping outlives the descriptor */
+    data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        STATS_END(STAT_DISK_CACHE_LOAD);
+        return NULL;
+    }
+
+    mapping = malloc(sizeof(mapping_t));
+
+    if (mapping == NULL || dl_disk_check(data, (size_t)info.st_size, key, &header) != 0) {
+        free(mapping);
+        munmap(data, (size_t)info.st_size);
+        STATS_END(STAT_DISK_CACHE_LOAD);
+        return NULL;
+    }
+
+    mapping->data = data;
+    mapping->length = (size_t)info.st_size;
+
+    ret = cairo_image_surface_create_for_data((unsigned char*)data + header.dataOffset,
+                                              CAIRO_FORMAT_ARGB32, (int)header.width,
+                                              (int)header.height, (int)header.stride);
+
+    if (cairo_surface_set_user_data(ret, &mappingKey, mapping, unmap) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(ret);
+        unmap(mapping);
+        STATS_END(STAT_DISK_CACHE_LOAD);
+        return NULL;
+    }
+
+    bounds.x = header.bounds[0];
+    bounds.y = header.bounds[1];
+    bounds.width = header.bounds[2];
+    bounds.height = header.bounds[3];
+    set_info(ret, header.opaque, bounds);
+
+    STATS_END(STAT_DISK_CACHE_LOAD);
+
+    return arena_add(ret);
+}
+
+#if defined(CAIRO_HAS_PDF_SURFACE) || defined(CAIRO_HAS_SVG_SURFACE)
+/* Cairo hands its output to a callback of its own kind */
+typedef struct stream_writer_t {
+    write_func_t write;
+    void *closure;
+} stream_writer_t;
+
+static cairo_status_t write_stream(void *closure, const unsigned char *data, unsigned int length) {
+    stream_writer_t *writer = closure;
+
+    return writer->write(writer->closure, data, length) == 0 ? CAIRO_STATUS_SUCCESS : CAIRO_STATUS_WRITE_ERROR;
+}
+
+/* Draws surf onto a one page document made by create, a pixel to a point,
+ * walking the tree so rectangles and text go in as shapes and glyphs */
+static int write_document(surface *surf, cairo_surface_t *(*create)(cairo_write_func_t, void*, double, double), write_func_t write, void *closure) {
+    stream_writer_t writer;
+    surface *document;
+    cairo_t *cr;
+    int ret;
+
+    writer.write = write;
+    writer.closure = closure;
+
+    document = create(write_stream, &writer, get_width(surf), get_height(surf));
+
+    cr = cairo_create(document);
+    paint_surface(cr, surf, 0, 0, atomic_load(&renderStarted));
+    cairo_destroy(cr);
+
+    cairo_surface_finish(document);
+    ret = cairo_surface_status(document) == CAIRO_STATUS_SUCCESS ? 0 : -1;
+    cairo_surface_destroy(document);
+
+    return ret;
+}
+#endif
+
+/* Like DL_write_pdf, but the PDF is handed to write, along with closure,
+ * instead of being written to a file descriptor. */
+int DL_write_pdf_stream(surface *surf, write_func_t write, void *closure) {
+#ifdef CAIRO_HAS_PDF_SURFACE
+    int ret;
+
+    STATS_BEGIN(STAT_WRITE_PDF);
+    ret = write_document(surf, cairo_pdf_surface_create_for_stream, write, closure);
+    STATS_END(STAT_WRITE_PDF);
+
+    return ret;
+#else
+    (void)surf;
+    (void)write;
+    (void)closure;
+
+    return -1;
+#endif
+}
+
+/* Writes the given surface to fd as a one page PDF, a pixel to a point.
+ * Surfaces made in vector mode keep their rectangles and text as shapes and
+ * glyphs. Returns 0 on success and -1 if anything could not be written, or
+ * if cairo was built without PDF support. */
+int DL_write_pdf(surface *surf, int fd) {
+    return DL_write_pdf_stream(surf, write_fd, &fd);
+}
+
+/* Like DL_write_svg, but the SVG is handed to write, along with closure,
+ * instead of being written to a file descriptor. */
+int DL_write_svg_stream(surface *surf, write_func_t write, void *closure) {
+#ifdef CAIRO_HAS_SVG_SURFACE
+    int ret;
+
+    STATS_BEGIN(STAT_WRITE_SVG);
+    ret = write_document(surf, cairo_svg_surface_create_for_stream, write, closure);
+    STATS_END(STAT_WRITE_SVG);
+
+    return ret;
+#else
+    (void)surf;
+    (void)write;
+    (void)closure;
+
+    return -1;
+#endif
+}
+
+/* Writes the given surface to fd as an SVG, a pixel to a point, the same
+ * way DL_write_pdf does. Returns -1 if cairo was built without SVG support. */
+int DL_write_svg(surface *surf, int fd) {
+    return DL_write_svg_stream(surf, write_fd, &fd);
+}
+
+/* Sets how many bytes of free pixel buffers the pool may hold on to for
+ * reuse. Images of about the same size as one freed earlier reuse its buffer
+ * rather than allocating a new one. Setting it to 0 turns the pool off. The
+ * default is 32MB. */
+void DL_pool_set_budget(size_t bytes) {
+    dl_pool_set_budget(bytes);
+}
+
+/* Fills in stats with the pool's counters */
+void DL_pool_get_stats(pool_stats_t *stats) {
+    dl_pool_stats_t pool;
+
+    dl_pool_get_stats(&pool);
+
+    stats->requests = pool.requests;
+    stats->reuses = pool.reuses;
+    stats->bytes = pool.bytes;
+    stats->pooled = pool.pooled;
+    stats->peak = pool.peak;
+    stats->budget = pool.budget;
+}
+
+/* Frees every buffer the pool holds and resets the counters. Buffers of live
+ * surfaces are not affected. */
+void DL_pool_clear(void) {
+    dl_pool_clear();
+}
+
+/* Opens an arena on the calling thread. Until the matching DL_arena_end, all
+ * surfaces created on that thread belong to the arena and must not be passed
+ * to DL_free_surface. Arenas nest, a surface belongs to the innermost one.
+ * This suits building a frame out of many throwaway surfaces. */
+void DL_arena_begin(void) {
+    arena_t *next = calloc(1, sizeof(arena_t));
+
+    next->prev = arena;
+    arena = next;
+}
+
+/* Closes the arena last opened on the calling thread and frees every surface
+ * created while it was open. Surfaces needed afterwards must be kept with
+ * DL_retain_surface first. */
+void DL_arena_end(void) {
+    arena_t *done = arena;
+    int i;
+
+    if (done == NULL) {
+        return;
+    }
+
+    arena = done->prev;
+
+    for (i = 0; i < done->count; i++) {
+        cairo_surface_destroy(done->surfs[i]);
+    }
+
+    free(done->surfs);
+    free(done);
+}
+
+/* A composition keeps the tree it was made from next to the image it was
+ * rendered into. Swapping a leaf builds a new tree sharing everything off
+ * the path to that leaf, and notes where the leaf was as damage, so the
+ * next update only repaints those parts of the image. Past
+ * COMPOSITION_DAMAGE rectangles the damage is merged into one. */
+#define COMPOSITION_DAMAGE 16
+
+struct composition_t {
+    surface *root;
+    surface *image;
+
+    int damageCount;
+    rect_t damage[COMPOSITION_DAMAGE];
+};
+
+typedef struct composition_t composition_t;
+
+static void add_damage(composition_t *comp, int x, int y, int width, int height) {
+    rect_t r;
+    int x2, y2, i;
+
+    /* Only what is inside the image can be repainted */
+    x2 = x + width < get_width(comp->root) ? x + width : get_width(comp->root);
+    y2 = y + height < get_height(comp->root) ? y + height : get_height(comp->root);
+
+    r.x = x > 0 ? x : 0;
+    r.y = y > 0 ? y : 0;
+    r.width = x2 - r.x;
+    r.height = y2 - r.y;
+
+    if (r.width <= 0 || r.height <= 0) {
+        return;
+    }
+
+    if (comp->damageCount < COMPOSITION_DAMAGE) {
+        comp->damage[comp->damageCount++] = r;
+        return;
+    }
+
+    /* Too many pieces, repaint everything they cover in one go */
+    for (i = 1; i < comp->damageCount; i++) {
+        union_rect(&comp->damage[0], &comp->damage[i]);
+    }
+
+    union_rect(&comp->damage[0], &r);
+    comp->damageCount = 1;
+}
+
+/* Adds the width by height damage at x, y, as far as it is inside clip */
+static void add_clipped_damage(composition_t *comp, const rect_t *clip, int x, int y, int width, int height) {
+    rect_t r = { x, y, width, height };
+
+    r = crop_rect(r, clip->x, clip->y, clip->width, clip->height);
+    add_damage(comp, clip->x + r.x, clip->y + r.y, r.width, r.height);
+}
+
+/* Returns a copy of the group or view surf, drawn at x, y, with every use of
+ * old swapped for replacement, or NULL if old is nowhere under it. Groups and
+ * views which do not lead to old are shared with the original tree. Only
+ * damage inside clip shows, which views narrow to the part they show. Crops
+ * of images read the pixels in place and are leaves of their own. */
+static surface *replace_leaf(composition_t *comp, surface *surf, surface *old, surface *replacement, int x, int y,
+                             const rect_t *clip, int *count) {
+    node_t *node = get_node(surf);
+    child_t *children;
+    surface *ret, *child;
+    rect_t inner;
+    int i, changed;
+
+    if (node == NULL || (node->kind != NODE_GROUP && node->kind != NODE_VIEW)) {
+        return NULL;
+    }
+
+    inner = *clip;
+
+    if (node->kind == NODE_VIEW) {
+        inner = crop_rect(inner, x, y, node->width, node->height);
+        inner.x += x;
+        inner.y += y;
+    }
+
+    children = malloc(sizeof(child_t) * node->count);
+    changed = 0;
+
+    for (i = 0; i < node->count; i++) {
+        children[i] = node->children[i];
+
+        if (children[i].surf == old) {
+            children[i].surf = cairo_surface_reference(replacement);
+            add_clipped_damage(comp, &inner, x + children[i].x, y + children[i].y, get_width(old), get_height(old));
+            (*count)++;
+            changed = 1;
+            continue;
+        }
+
+        child = replace_leaf(comp, children[i].surf, old, replacement, x + children[i].x, y + children[i].y,
+                             &inner, count);
+
+        if (child != NULL) {
+            children[i].surf = child;
+            changed = 1;
+        }
+        else {
+            cairo_surface_reference(children[i].surf);
+        }
+    }
+
+    if (!changed) {
+        ret = NULL;
+    }
+    else if (node->kind == NODE_VIEW) {
+        /* The same part of the new child */
+        ret = view_node(children[0].surf, -children[0].x, -children[0].y, node->width, node->height);
+    }
+    else {
+        mark_hidden(children, node->count);
+        ret = new_group(node->width, node->height, children, node->count);
+    }
+
+    /* new_group and view_node took their own references */
+    for (i = 0; i < node->count; i++) {
+        cairo_surface_destroy(children[i].surf);
+    }
+
+    free(children);
+
+    return ret;
+}
+
+/* Renders root into an image and keeps both, so that leaves of root can be
+ * swapped later on and only the parts of the image they cover repainted.
+ * This suits panels redrawn many times a second where little changes from
+ * one frame to the next. root should be built in lazy mode, since a surface
+ * drawn eagerly no longer knows what it was made of. The composition takes
+ * its own reference on root. */
+composition_t *DL_composition_new(surface *root) {
+    composition_t *comp;
+
+    STATS_BEGIN(STAT_COMPOSITION_NEW);
+
+    comp = calloc(1, sizeof(composition_t));
+    comp->root = cairo_surface_reference(root);
+    comp->image = render(root, 0, opaqueFormat);
+
+    STATS_END(STAT_COMPOSITION_NEW);
+
+    return comp;
+}
+
+/* Returns the image the composition was last rendered into. It belongs to
+ * the composition and is only valid until the next DL_composition_update.
+ * Retain it to keep it, the composition then leaves it alone and repaints
+ * a copy instead. */
+surface *DL_composition_get_image(composition_t *comp) {
+    return comp->image;
+}
+
+/* Swaps every use of the leaf old in the composition's tree for replacement,
+ * which must be the same size, and marks where it was as damaged. Nothing is
+ * drawn until DL_composition_update. Returns how many uses were swapped, or
+ * -1 if the sizes differ. To swap in a label of a different width, give the
+ * label a fixed size to begin with, say by overlaying it on a DL_empty. */
+int DL_composition_replace(composition_t *comp, surface *old, surface *replacement) {
+    surface *root;
+    rect_t clip;
+    int count;
+
+    if (get_width(old) != get_width(replacement) || get_height(old) != get_height(replacement)) {
+        return -1;
+    }
+
+    count = 0;
+
+    if (comp->root == old) {
+        root = cairo_surface_reference(replacement);
+        add_damage(comp, 0, 0, get_width(old), get_height(old));
+        count = 1;
+    }
+    else {
+        clip.x = 0;
+        clip.y = 0;
+        clip.width = get_width(comp->root);
+        clip.height = get_height(comp->root);
+
+        root = replace_leaf(comp, comp->root, old, replacement, 0, 0, &clip, &count);
+    }
+
+    if (root != NULL) {
+        cairo_surface_destroy(comp->root);
+        comp->root = root;
+    }
+
+    return count;
+}
+
+/* Repaints the damaged parts of the composition's image. Up to max of the
+ * repainted rectangles are stored in damage, so just those parts can be
+ * uploaded, and the number stored is returned. If there were more than max
+ * of them, damage[0] is set to a rectangle covering all of them. Returns 0
+ * if nothing had changed. */
+int DL_composition_update(composition_t *comp, rect_t *damage, int max) {
+    blit_target_t t;
+    surface *copy;
+    rect_t *r;
+    int i, count;
+
+    STATS_BEGIN(STAT_COMPOSITION_UPDATE);
+
+    if (comp->damageCount == 0) {
+        STATS_END(STAT_COMPOSITION_UPDATE);
+        return 0;
+    }
+
+    /* Someone kept the last image, so it must not change under them */
+    if (cairo_surface_get_reference_count(comp->image) > 1) {
+        copy = new_image(CAIRO_FORMAT_ARGB32, get_width(comp->image), get_height(comp->image), 0);
+
+        cairo_surface_flush(comp->image);
+        memcpy(cairo_image_surface_get_data(copy), cairo_image_surface_get_data(comp->image),
+               (size_t)cairo_image_surface_get_stride(comp->image) * get_height(comp->image));
+        cairo_surface_mark_dirty(copy);
+
+        cairo_surface_destroy(comp->image);
+        comp->image = copy;
+    }
+
+    blit_begin(&t, comp->image, 0, 0, atomic_load(&renderStarted));
+
+    for (i = 0; i < comp->damageCount; i++) {
+        r = &comp->damage[i];
+
+        t.x1 = r->x;
+        t.y1 = r->y;
+        t.x2 = r->x + r->width;
+        t.y2 = r->y + r->height;
+
+        /* Clear the old pixels, then paint whatever is there now */
+        dl_blit_fill(t.data + (size_t)r->y * t.stride + (size_t)r->x * 4, t.stride, 0, r->width, r->height);
+        blit_surface(&t, comp->root, 0, 0);
+    }
+
+    blit_end(&t);
+    set_info(comp->image, is_opaque(comp->root), get_bounds(comp->root));
+
+    STATS_END(STAT_COMPOSITION_UPDATE);
+
+    count = comp->damageCount;
+    comp->damageCount = 0;
+
+    if (count <= max) {
+        memcpy(damage, comp->damage, sizeof(rect_t) * count);
+        return count;
+    }
+
+    if (max < 1) {
+        return 0;
+    }
+
+    /* Merge everything into the first one */
+    damage[0] = comp->damage[0];
+
+    for (i = 1; i < count; i++) {
+        union_rect(&damage[0], &comp->damage[i]);
+    }
+
+    return 1;
+}
+
+/* Frees the composition, its tree, and its image unless it was retained */
+void DL_composition_free(composition_t *comp) {
+    cairo_surface_destroy(comp->root);
+    cairo_surface_destroy(comp->image);
+    free(comp);
 }
@@ -0,0 +1,112 @@
+/* On-disk surface cache format shared by the CDraw ports */
+
+#include "cdraw-disk.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define DISK_MAGIC "CDRAWIMG"
+#define DISK_VERSION 1
+#define DISK_BYTE_ORDER 0x01020304
+
+/* Keys longer than this are turned down, they are names, not data */
+#define MAX_KEY_LENGTH 4096
+
+/* Where the pixels start for a key of the given length */
+static size_t data_offset(size_t keyLength) {
+    size_t offset = sizeof(dl_disk_header_t) + keyLength;
+
+    return (offset + DL_DISK_ALIGN - 1) / DL_DISK_ALIGN * DL_DISK_ALIGN;
+}
+
+void dl_disk_header_init(dl_disk_header_t *header, const char *key, int width, int height,
+                         int opaque, const int bounds[4]) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, DISK_MAGIC, sizeof(header->magic));
+
+    header->version = DISK_VERSION;
+    header->byteOrder = DISK_BYTE_ORDER;
+    header->keyLength = (uint32_t)strlen(key);
+    header->dataOffset = (uint32_t)data_offset(header->keyLength);
+    header->width = (uint32_t)width;
+    header->height = (uint32_t)height;
+    header->stride = (uint32_t)width * 4;
+    header->opaque = opaque ? 1 : 0;
+    memcpy(header->bounds, bounds, sizeof(header->bounds));
+}
+
+int dl_disk_write_header(const dl_disk_header_t *header, const char *key,
+                         int (*write)(void *closure, const unsigned char *data, size_t length),
+                         void *closure) {
+    static const unsigned char zeroes[DL_DISK_ALIGN];
+    size_t padding;
+
+    if (header->keyLength > MAX_KEY_LENGTH) {
+        return -1;
+    }
+
+    padding = header->dataOffset - sizeof(*header) - header->keyLength;
+
+    if (write(closure, (const unsigned char*)header, sizeof(*header)) != 0 ||
+        write(closure, (const unsigned char*)key, header->keyLength) != 0 ||
+        write(closure, zeroes, padding) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int dl_disk_check(const unsigned char *data, size_t length, const char *key,
+                  dl_disk_header_t *header) {
+    size_t keyLength;
+
+    if (length < sizeof(*header)) {
+        return -1;
+    }
+
+    memcpy(header, data, sizeof(*header));
+    keyLength = strlen(key);
+
+    if (memcmp(header->magic, DISK_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != DISK_VERSION ||
+        header->byteOrder != DISK_BYTE_ORDER ||
+        header->keyLength != keyLength || keyLength > MAX_KEY_LENGTH ||
+        header->dataOffset != data_offset(keyLength) ||
+        header->stride != header->width * 4 ||
+        header->width > 0x7fff || header->height > 0x7fff) {
+        return -1;
+    }
+
+    /* Drawing indexes the pixels by the bounds, so they must lie inside */
+    if (header->bounds[0] < 0 || header->bounds[1] < 0 ||
+        header->bounds[2] < 0 || header->bounds[3] < 0 ||
+        (int64_t)header->bounds[0] + header->bounds[2] > (int64_t)header->width ||
+        (int64_t)header->bounds[1] + header->bounds[3] > (int64_t)header->height) {
+        return -1;
+    }
+
+    if (length < header->dataOffset ||
+        length - header->dataOffset < (size_t)header->stride * header->height) {
+        return -1;
+    }
+
+    /* A file written under a key whose hash collides with this one */
+    if (memcmp(data + sizeof(*header), key, keyLength) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void dl_disk_name(char name[DL_DISK_NAME_SIZE], const char *key) {
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    const unsigned char *p;
+
+    /* 64 bit FNV-1a */
+    for (p = (const unsigned char*)key; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+
+    snprintf(name, DL_DISK_NAME_SIZE, "%016llx.cdimg", hash);
+}
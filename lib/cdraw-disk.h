@@ -0,0 +1,63 @@
+/* On-disk surface cache format shared by the CDraw ports */
+/* A cached surface is a single file: a header, the key it was stored under,
+ * padding, then the pixels exactly as an image surface holds them, native
+ * endian premultiplied ARGB32 rows of width * 4 bytes. The pixels start on
+ * a DL_DISK_ALIGN boundary, so a port can map the file and hand the pixels
+ * straight to an image without decoding or copying them. */
+
+#ifndef CDRAW_DISK_H
+#define CDRAW_DISK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Where the pixels may start, a multiple of the cache line size */
+#define DL_DISK_ALIGN 64
+
+/* Room for the name of a cache file, see dl_disk_name */
+#define DL_DISK_NAME_SIZE 24
+
+typedef struct dl_disk_header_t {
+    char magic[8];
+    uint32_t version;
+    /* Written as 0x01020304, so files from a machine of the other byte order
+     * are turned down rather than read with the channels swapped */
+    uint32_t byteOrder;
+    uint32_t dataOffset;
+    uint32_t keyLength;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t opaque;
+    int32_t bounds[4];
+} dl_disk_header_t;
+
+/* Fills in header for a width by height image stored under key. bounds is
+ * x, y, width and height of the part that is not transparent. */
+void dl_disk_header_init(dl_disk_header_t *header, const char *key, int width, int height,
+                         int opaque, const int bounds[4]);
+
+/* Writes header, the key and the padding before the pixels through write.
+ * write returns 0 on success, and so does this. */
+int dl_disk_write_header(const dl_disk_header_t *header, const char *key,
+                         int (*write)(void *closure, const unsigned char *data, size_t length),
+                         void *closure);
+
+/* Checks that the length bytes at data hold a whole image stored under key,
+ * with its bounds inside it, and fills in header from them. Returns 0 if they do and -1 otherwise. */
+int dl_disk_check(const unsigned char *data, size_t length, const char *key,
+                  dl_disk_header_t *header);
+
+/* Writes the name of the file key is stored in to name. Names are a hash of
+ * the key, the key itself is checked when the file is read. */
+void dl_disk_name(char name[DL_DISK_NAME_SIZE], const char *key);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CDRAW_DISK_H */
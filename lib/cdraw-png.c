@@ -0,0 +1,204 @@
+/* Streaming PNG encoder shared by the CDraw ports */
+
+#include "cdraw-png.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+/* Compressed data is sent out as an IDAT chunk whenever this much of it has
+ * piled up */
+#define CHUNK_SIZE 65536
+
+struct dl_png_t {
+    int width;
+    int height;
+
+    int (*write)(void *closure, const unsigned char *data, size_t length);
+    void *closure;
+
+    z_stream zs;
+    unsigned char *row;
+    unsigned char *out;
+
+    /* Set once anything has gone wrong, everything after that is a no-op */
+    int failed;
+};
+
+static void put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* Writes one chunk, its length, type, data and CRC */
+static int write_chunk(dl_png_t *png, const char *type, const unsigned char *data, size_t length) {
+    unsigned char head[8], tail[4];
+    uLong crc;
+
+    put_u32(head, length);
+    memcpy(head + 4, type, 4);
+
+    /* crc32 treats a NULL buffer as a request for the initial value, so it
+     * is only handed data if there is some */
+    crc = crc32(0, head + 4, 4);
+
+    if (length > 0) {
+        crc = crc32(crc, data, length);
+    }
+
+    put_u32(tail, crc);
+
+    if (png->write(png->closure, head, 8) != 0 ||
+        (length > 0 && png->write(png->closure, data, length) != 0) ||
+        png->write(png->closure, tail, 4) != 0) {
+        png->failed = 1;
+    }
+
+    return png->failed ? -1 : 0;
+}
+
+/* Runs deflate over whatever is in zs, sending out full chunks as they fill
+ * up. With flush set to Z_FINISH everything left is sent. */
+static int deflate_out(dl_png_t *png, int flush) {
+    int status;
+
+    do {
+        status = deflate(&png->zs, flush);
+
+        if (status == Z_STREAM_ERROR) {
+            png->failed = 1;
+            return -1;
+        }
+
+        if (png->zs.avail_out == 0 || (flush == Z_FINISH && png->zs.avail_out < CHUNK_SIZE)) {
+            if (write_chunk(png, "IDAT", png->out, CHUNK_SIZE - png->zs.avail_out) != 0) {
+                return -1;
+            }
+
+            png->zs.next_out = png->out;
+            png->zs.avail_out = CHUNK_SIZE;
+        }
+    } while (png->zs.avail_in > 0 || (flush == Z_FINISH && status != Z_STREAM_END));
+
+    return 0;
+}
+
+dl_png_t *dl_png_begin(int width, int height,
+                       int (*write)(void *closure, const unsigned char *data, size_t length),
+                       void *closure) {
+    static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    unsigned char ihdr[13];
+    dl_png_t *png;
+
+    png = calloc(1, sizeof(dl_png_t));
+
+    if (png == NULL) {
+        return NULL;
+    }
+
+    png->width = width;
+    png->height = height;
+    png->write = write;
+    png->closure = closure;
+
+    /* Each row starts with its filter type byte */
+    png->row = malloc((size_t)width * 4 + 1);
+    png->out = malloc(CHUNK_SIZE);
+
+    if (png->row == NULL || png->out == NULL ||
+        deflateInit(&png->zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        free(png->row);
+        free(png->out);
+        free(png);
+        return NULL;
+    }
+
+    png->zs.next_out = png->out;
+    png->zs.avail_out = CHUNK_SIZE;
+
+    /* 8 bits per channel RGBA, no interlacing */
+    put_u32(ihdr, width);
+    put_u32(ihdr + 4, height);
+    ihdr[8] = 8;
+    ihdr[9] = 6;
+    ihdr[10] = 0;
+    ihdr[11] = 0;
+    ihdr[12] = 0;
+
+    if (write(closure, signature, sizeof(signature)) != 0 ||
+        write_chunk(png, "IHDR", ihdr, sizeof(ihdr)) != 0) {
+        deflateEnd(&png->zs);
+        free(png->row);
+        free(png->out);
+        free(png);
+        return NULL;
+    }
+
+    return png;
+}
+
+int dl_png_write_rows(dl_png_t *png, const unsigned char *data, int stride, int count) {
+    const uint32_t *src;
+    unsigned char *dst;
+    uint32_t pixel, alpha;
+    int x, y;
+
+    if (png->failed) {
+        return -1;
+    }
+
+    for (y = 0; y < count; y++) {
+        src = (const uint32_t*)(data + (size_t)y * stride);
+        dst = png->row;
+
+        /* No filtering */
+        *dst++ = 0;
+
+        /* PNG wants straight alpha, so undo the premultiplication */
+        for (x = 0; x < png->width; x++) {
+            pixel = src[x];
+            alpha = pixel >> 24;
+
+            if (alpha == 0) {
+                dst[0] = dst[1] = dst[2] = dst[3] = 0;
+            }
+            else {
+                dst[0] = (((pixel >> 16) & 0xff) * 255 + alpha / 2) / alpha;
+                dst[1] = (((pixel >> 8) & 0xff) * 255 + alpha / 2) / alpha;
+                dst[2] = ((pixel & 0xff) * 255 + alpha / 2) / alpha;
+                dst[3] = alpha;
+            }
+
+            dst += 4;
+        }
+
+        png->zs.next_in = png->row;
+        png->zs.avail_in = (uInt)png->width * 4 + 1;
+
+        if (deflate_out(png, Z_NO_FLUSH) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int dl_png_end(dl_png_t *png) {
+    int ret;
+
+    if (!png->failed && deflate_out(png, Z_FINISH) == 0) {
+        write_chunk(png, "IEND", NULL, 0);
+    }
+
+    ret = png->failed ? -1 : 0;
+
+    deflateEnd(&png->zs);
+    free(png->row);
+    free(png->out);
+    free(png);
+
+    return ret;
+}
@@ -0,0 +1,35 @@
+/* Streaming PNG encoder shared by the CDraw ports */
+/* Rows are handed over a few at a time and compressed as they come, so the
+ * whole image never has to be in memory at once. */
+
+#ifndef CDRAW_PNG_H
+#define CDRAW_PNG_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct dl_png_t dl_png_t;
+
+/* Starts a PNG of the given size, written out through write. write returns 0
+ * on success, anything else stops the encoder. Returns NULL if the encoder
+ * could not be set up or the header could not be written. */
+dl_png_t *dl_png_begin(int width, int height,
+                       int (*write)(void *closure, const unsigned char *data, size_t length),
+                       void *closure);
+
+/* Encodes the next count rows. Rows are premultiplied ARGB32, one native
+ * endian 32 bit value per pixel, stride bytes apart. Returns 0 on success. */
+int dl_png_write_rows(dl_png_t *png, const unsigned char *data, int stride, int count);
+
+/* Finishes the PNG and frees the encoder. Returns 0 if the whole PNG was
+ * written. */
+int dl_png_end(dl_png_t *png);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CDRAW_PNG_H */
@@ -0,0 +1,164 @@
+/* Pixel buffer pool shared by the CDraw ports */
+
+#include "cdraw-pool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define POOL_MIN_SHIFT 8
+#define POOL_MAX_SHIFT 30
+#define POOL_CLASSES ((POOL_MAX_SHIFT - POOL_MIN_SHIFT) * 4 + 1)
+#define POOL_DEFAULT_BUDGET (32 * 1024 * 1024)
+
+static pthread_mutex_t bufferLock = PTHREAD_MUTEX_INITIALIZER;
+static dl_pool_block_t *bufferFree[POOL_CLASSES];
+static dl_pool_stats_t bufferStats = { 0, 0, 0, 0, 0, POOL_DEFAULT_BUDGET };
+
+/* Finds the smallest class holding bytes, or -1 if it is too big to pool */
+static int size_class(size_t bytes) {
+    size_t step;
+    int shift;
+
+    if (bytes > (size_t)1 << POOL_MAX_SHIFT) {
+        return -1;
+    }
+
+    shift = POOL_MIN_SHIFT;
+
+    while (((size_t)2 << shift) < bytes) {
+        shift++;
+    }
+
+    if (bytes <= (size_t)1 << shift) {
+        return 0;
+    }
+
+    step = ((size_t)1 << shift) / 4;
+
+    return (shift - POOL_MIN_SHIFT) * 4 + (bytes - ((size_t)1 << shift) + step - 1) / step;
+}
+
+static size_t class_size(int sizeClass) {
+    size_t base = (size_t)1 << (sizeClass / 4 + POOL_MIN_SHIFT);
+
+    return base + base / 4 * (sizeClass % 4);
+}
+
+dl_pool_block_t *dl_pool_get(size_t bytes) {
+    dl_pool_block_t *block;
+    int sizeClass;
+
+    sizeClass = size_class(bytes);
+
+    pthread_mutex_lock(&bufferLock);
+
+    bufferStats.requests++;
+    block = sizeClass != -1 ? bufferFree[sizeClass] : NULL;
+
+    if (block != NULL) {
+        bufferFree[sizeClass] = block->next;
+        bufferStats.reuses++;
+        bufferStats.pooled -= block->size;
+    }
+
+    pthread_mutex_unlock(&bufferLock);
+
+    if (block == NULL) {
+        block = malloc(sizeof(dl_pool_block_t));
+
+        if (block == NULL) {
+            return NULL;
+        }
+
+        block->sizeClass = sizeClass;
+        block->size = sizeClass != -1 ? class_size(sizeClass) : bytes;
+        block->data = malloc(block->size);
+
+        if (block->data == NULL) {
+            free(block);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_lock(&bufferLock);
+
+    bufferStats.bytes += block->size;
+
+    if (bufferStats.bytes + bufferStats.pooled > bufferStats.peak) {
+        bufferStats.peak = bufferStats.bytes + bufferStats.pooled;
+    }
+
+    pthread_mutex_unlock(&bufferLock);
+
+    return block;
+}
+
+static void free_block(dl_pool_block_t *block) {
+    free(block->data);
+    free(block);
+}
+
+void dl_pool_put(void *data) {
+    dl_pool_block_t *block = data;
+
+    pthread_mutex_lock(&bufferLock);
+
+    bufferStats.bytes -= block->size;
+
+    if (block->sizeClass != -1 && bufferStats.pooled + block->size <= bufferStats.budget) {
+        block->next = bufferFree[block->sizeClass];
+        bufferFree[block->sizeClass] = block;
+        bufferStats.pooled += block->size;
+        block = NULL;
+    }
+
+    pthread_mutex_unlock(&bufferLock);
+
+    if (block != NULL) {
+        free_block(block);
+    }
+}
+
+/* Frees pooled buffers until the pool holds no more than budget bytes. Must
+ * be called with bufferLock held. */
+static void trim_buffers(size_t budget) {
+    dl_pool_block_t *block;
+    int i;
+
+    /* Largest classes first, they free the most for the least work */
+    for (i = POOL_CLASSES - 1; i >= 0 && bufferStats.pooled > budget; i--) {
+        while (bufferFree[i] != NULL && bufferStats.pooled > budget) {
+            block = bufferFree[i];
+            bufferFree[i] = block->next;
+            bufferStats.pooled -= block->size;
+            free_block(block);
+        }
+    }
+}
+
+void dl_pool_set_budget(size_t bytes) {
+    pthread_mutex_lock(&bufferLock);
+
+    bufferStats.budget = bytes;
+    trim_buffers(bytes);
+
+    pthread_mutex_unlock(&bufferLock);
+}
+
+void dl_pool_get_stats(dl_pool_stats_t *stats) {
+    pthread_mutex_lock(&bufferLock);
+    *stats = bufferStats;
+    pthread_mutex_unlock(&bufferLock);
+}
+
+void dl_pool_clear(void) {
+    pthread_mutex_lock(&bufferLock);
+
+    trim_buffers(0);
+
+    bufferStats.requests = 0;
+    bufferStats.reuses = 0;
+    bufferStats.peak = bufferStats.bytes;
+
+    pthread_mutex_unlock(&bufferLock);
+}
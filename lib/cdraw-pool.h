@@ -0,0 +1,55 @@
+/* Pixel buffer pool shared by the CDraw ports */
+/* The pixels of the images a port creates come out of a pool of buffers
+ * sorted into size classes. When an image goes away its buffer goes back on
+ * the free list of its class, so the next image of about the same size
+ * reuses it rather than going back to malloc. Every power of two is split
+ * into four classes, so a buffer is never more than a quarter bigger than
+ * asked for. Buffers above the largest class are not pooled. */
+
+#ifndef CDRAW_POOL_H
+#define CDRAW_POOL_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct dl_pool_block_t {
+    unsigned char *data;
+    size_t size;
+    int sizeClass;
+    struct dl_pool_block_t *next;
+} dl_pool_block_t;
+
+/* Counters for the pool, the same as the ports' pool_stats_t */
+typedef struct dl_pool_stats_t {
+    unsigned long requests;
+    unsigned long reuses;
+    size_t bytes;
+    size_t pooled;
+    size_t peak;
+    size_t budget;
+} dl_pool_stats_t;
+
+/* Hands out a buffer of at least bytes, reusing a pooled one if there is
+ * one. Returns NULL if there is no memory for it. */
+dl_pool_block_t *dl_pool_get(size_t bytes);
+
+/* Gives the dl_pool_block_t block back to the pool, or frees it if the pool
+ * is full. Takes a void pointer so it can be an image's destroy function. */
+void dl_pool_put(void *block);
+
+/* Sets how many bytes of unused buffers the pool keeps, freeing any above */
+void dl_pool_set_budget(size_t bytes);
+
+void dl_pool_get_stats(dl_pool_stats_t *stats);
+
+/* Frees every pooled buffer and starts the counters over */
+void dl_pool_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CDRAW_POOL_H */
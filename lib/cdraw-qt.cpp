@@ -1,8 +1,46 @@
 #include <QPixmap>
 #include <QPainter>
+#include <QRawFont>
+#include <QFile>
 #include <QFont>
 #include <QFontMetrics>
+#include <QGlyphRun>
+#include <QAtomicInt>
+#include <QVector>
+#include <QHash>
+#include <QCache>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QImage>
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QWaitCondition>
+#include <QSaveFile>
+#include <QTextLayout>
+#include <QtMath>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <utility>
+
+#include "cdraw-blit.h"
+#include "cdraw-disk.h"
+#include "cdraw-pool.h"
+#include "cdraw-png.h"
+#include "cdraw-stats.h"
+
+/* Built with CDRAW_QT_IMAGE, surfaces hold a QImage rather than a QPixmap.
+ * A QImage needs no display server and can be used from any thread, so
+ * this is the mode to use on render servers and from worker threads. */
+#ifdef CDRAW_QT_IMAGE
+typedef QImage pixels_t;
+#else
+typedef QPixmap pixels_t;
+#endif
 
 typedef struct color_t {
     unsigned char r;
@@ -19,34 +57,1116 @@ typedef enum align_t {
     RIGHT
 } align_t;
 
+/* Pixel formats images may be kept in, see DL_set_text_format */
+typedef enum format_t {
+    FORMAT_ARGB32,
+    FORMAT_RGB24,
+    FORMAT_A8,
+    FORMAT_RGB16_565
+} format_t;
+
 /* We typedef surface to 'void' here because this is a c library and qt is a 
  * C++ library, while there is nothing truly stoping us from using and 
  * returning a C++ class, which we are doing, C will not recognize it as such. 
- * Therefore we just say our surface, which is a QPixmap class, is actually 
- * just a void pointer. */
+ * Therefore we just say our surface, which is a node_t holding a QPixmap (or
+ * a QImage when built with CDRAW_QT_IMAGE), is actually just a void
+ * pointer. */
 typedef void surface;
 
+/* Counters for the text cache, see DL_text_cache_get_stats */
+typedef struct text_cache_stats_t {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t bytes;
+    size_t budget;
+} text_cache_stats_t;
+
+/* The size of a line of text, see DL_text_measure */
+typedef struct text_metrics_t {
+    int width;
+    int height;
+    int ascent;
+    int descent;
+} text_metrics_t;
+
+/* Counters for the combinator memo table, see DL_memo_get_stats */
+typedef struct memo_stats_t {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t bytes;
+    size_t budget;
+} memo_stats_t;
+
+/* Counters for the pixel buffer pool, see DL_pool_get_stats */
+typedef struct pool_stats_t {
+    unsigned long requests;
+    unsigned long reuses;
+    size_t bytes;
+    size_t pooled;
+    size_t peak;
+    size_t budget;
+} pool_stats_t;
+
+typedef int (*write_func_t)(void *closure, const unsigned char *data, size_t length);
+
+typedef void (*release_func_t)(void *closure);
+
+/* A rectangle in pixels, see DL_composition_update */
+typedef struct rect_t {
+    int x;
+    int y;
+    int width;
+    int height;
+} rect_t;
+
+/* What a surface holds. Rectangles and empty surfaces are only a size and a
+ * color, and in lazy mode the combinators make groups, which only remember
+ * their children. Pending surfaces stand in for a render which is still
+ * running. Views show part of another surface, for crops which can not share
+ * its pixels. Everything else is an image. */
+typedef enum node_kind_t {
+    NODE_IMAGE,
+    NODE_EMPTY,
+    NODE_SOLID,
+    NODE_GROUP,
+    NODE_PENDING,
+    NODE_VIEW
+} node_kind_t;
+
+struct node_t;
+struct future_t;
+
+/* A child of a group, drawn at x, y relative to the top left of the group */
+typedef struct child_t {
+    node_t *surf;
+    int x;
+    int y;
+
+    /* Set by mark_hidden on children which draw nothing, or which are
+     * entirely under an opaque child drawn after them. Painting skips them. */
+    unsigned char hidden;
+} child_t;
+
+/* Every surface we hand back is one of these. Surfaces are reference counted
+ * so a group can keep its children alive after the caller frees them. */
+struct node_t {
+    node_kind_t kind;
+    int width;
+    int height;
+
+    QAtomicInt refs;
+
+    /* The pixels of an image */
+    pixels_t pixels;
+
+    /* The color of a solid, or of a mask */
+    QColor color;
+
+    /* Set on Alpha8 images of text, which are drawn by filling color through
+     * them rather than as they are */
+    unsigned char mask;
+
+    /* Set when every pixel is fully opaque, so drawing it is a plain copy */
+    unsigned char opaque;
+
+    /* Every pixel outside of bounds is fully transparent */
+    QRect bounds;
+
+    /* Children of a group, in the order they are painted. The group holds a
+     * reference on each of them. A view has one child, the surface it shows
+     * part of. */
+    QVector<child_t> children;
+
+    /* The render a pending surface stands in for. The node holds a
+     * reference on it. */
+    future_t *future;
+};
+
+/* Whether the combinators build groups instead of drawing right away */
+static unsigned char lazyMode = 0;
+
+/* What DL_text keeps text in, and what opaque images are kept in once drawn.
+ * Only images are converted, pixmaps are kept in whatever format the
+ * platform wants. */
+static QImage::Format textFormat = QImage::Format_ARGB32_Premultiplied;
+static QImage::Format opaqueFormat = QImage::Format_ARGB32_Premultiplied;
+
+static node_t *new_node(node_kind_t kind, int width, int height) {
+    node_t *node = new node_t;
+
+    node->kind = kind;
+    node->width = width;
+    node->height = height;
+    node->refs = 1;
+    node->opaque = 0;
+    node->mask = 0;
+    node->future = NULL;
+
+    /* Empties draw nothing, anything else may draw anywhere until we know
+     * better */
+    if (kind != NODE_EMPTY) {
+        node->bounds = QRect(0, 0, width, height);
+    }
+
+    STATS_ALLOC(sizeof(node_t));
+
+    return node;
+}
+
+static node_t *new_image(const pixels_t &pixels) {
+    node_t *node = new_node(NODE_IMAGE, pixels.width(), pixels.height());
+
+    node->pixels = pixels;
+
+    return node;
+}
+
+/* The pixels of the QImages we create come out of the shared buffer pool,
+ * see cdraw-pool.h, and go back to it once the last copy of an image is
+ * gone. A QPixmap keeps its pixels wherever the platform wants them, so
+ * unless built with CDRAW_QT_IMAGE only the images used while drawing come
+ * from the pool. */
+/* Creates an ARGB32 image with its pixels from the pool. With clear set it
+ * starts out transparent, otherwise its pixels are left as they are, for
+ * images which are about to be drawn over completely. */
+static QImage new_image_pixels(int width, int height, int clear) {
+    dl_pool_block_t *block;
+    int stride;
+
+    if (width <= 0 || height <= 0) {
+        return QImage(width, height, QImage::Format_ARGB32_Premultiplied);
+    }
+
+    STATS_BEGIN(STAT_NEW_IMAGE);
+
+    stride = width * 4;
+    block = dl_pool_get((size_t)stride * height);
+
+    /* Without a buffer of our own Qt gets to try */
+    if (block == NULL) {
+        STATS_END(STAT_NEW_IMAGE);
+
+        QImage ret(width, height, QImage::Format_ARGB32_Premultiplied);
+
+        if (clear) {
+            ret.fill(Qt::transparent);
+        }
+
+        return ret;
+    }
+
+    if (clear) {
+        memset(block->data, 0, (size_t)stride * height);
+    }
+
+    QImage ret(block->data, width, height, stride, QImage::Format_ARGB32_Premultiplied,
+               dl_pool_put, block);
+
+    STATS_ALLOC((size_t)stride * height);
+    STATS_END(STAT_NEW_IMAGE);
+
+    return ret;
+}
+
+/* Creates new pixels of the given size, transparent if clear is set */
+static pixels_t new_pixels(int width, int height, int clear) {
+#ifdef CDRAW_QT_IMAGE
+    return new_image_pixels(width, height, clear);
+#else
+    STATS_BEGIN(STAT_NEW_IMAGE);
+
+    QPixmap ret(width, height);
+
+    /* Fill the pixels so we arent writing to uninitialized data */
+    if (clear) {
+        ret.fill(QColor("transparent"));
+    }
+
+    STATS_ALLOC((size_t)width * height * 4);
+    STATS_END(STAT_NEW_IMAGE);
+
+    return ret;
+#endif
+}
+
+static void draw_pixels(QPainter &p, int x, int y, const pixels_t &pixels) {
+#ifdef CDRAW_QT_IMAGE
+    p.drawImage(x, y, pixels);
+#else
+    p.drawPixmap(x, y, pixels);
+#endif
+}
+
+static node_t *retain_node(node_t *node) {
+    node->refs.ref();
+    return node;
+}
+
+/* A render running on the render threads. The caller of DL_render_async,
+ * the render thread until it is done, and every pending surface made from
+ * it each hold a reference. result is set under renderLock once the render
+ * is done, and source let go of then. */
+struct future_t {
+    QAtomicInt refs;
+    node_t *source;
+    node_t *result;
+
+    /* What opaque images were kept in when the render was asked for, which
+     * it keeps to whatever DL_set_opaque_format is called with meanwhile */
+    QImage::Format opaqueFormat;
+};
+
+static QMutex renderLock;
+static QWaitCondition renderDone;
+
+/* Pending surfaces hold futures and futures hold surfaces */
+static void release_node(node_t *node);
+
+static void release_future(future_t *future) {
+    if (future->refs.deref()) {
+        return;
+    }
+
+    if (future->source != NULL) {
+        release_node(future->source);
+    }
+
+    if (future->result != NULL) {
+        release_node(future->result);
+    }
+
+    delete future;
+}
+
+static void release_node(node_t *node) {
+    int i;
+
+    if (node->refs.deref()) {
+        return;
+    }
+
+    for (i = 0; i < node->children.size(); i++) {
+        release_node(node->children[i].surf);
+    }
+
+    if (node->future != NULL) {
+        release_future(node->future);
+    }
+
+    delete node;
+}
+
+/* Waits for the render to be done and returns the image it drew, which
+ * stays the future's */
+static node_t *wait_future(future_t *future) {
+    node_t *ret;
+
+    renderLock.lock();
+
+    while (future->result == NULL) {
+        renderDone.wait(&renderLock);
+    }
+
+    ret = future->result;
+
+    renderLock.unlock();
+
+    return ret;
+}
+
+#ifdef CDRAW_QT_IMAGE
+/* The Alpha8 mask with color filled through it, for painting with QPainter,
+ * which would draw the mask in black */
+static QImage tint_mask(const QImage &mask, const QColor &color) {
+    QImage ret(mask.width(), mask.height(), QImage::Format_ARGB32_Premultiplied);
+
+    ret.fill(color);
+
+    QPainter p(&ret);
+    p.setCompositionMode(QPainter::CompositionMode_DestinationIn);
+    p.drawImage(0, 0, mask);
+    p.end();
+
+    return ret;
+}
+#endif
+
+/* Draws node onto p with its top left corner at x, y. Solids are filled in
+ * place and groups are walked directly so their children land on p without
+ * any intermediate image. Anything outside the current clip is skipped. */
+static void paint_surface(QPainter &p, node_t *node, int x, int y) {
+    int i;
+
+    if (p.hasClipping() &&
+        !p.clipBoundingRect().intersects(QRectF(node->bounds.translated(x, y)))) {
+        return;
+    }
+
+    switch (node->kind) {
+    case NODE_IMAGE:
+#ifdef CDRAW_QT_IMAGE
+        if (node->mask) {
+            draw_pixels(p, x, y, tint_mask(node->pixels, node->color));
+            break;
+        }
+#endif
+        /* Nothing shows through an opaque image, so it can be copied over
+         * whatever is there rather than blended with it */
+        if (node->opaque) {
+            p.setCompositionMode(QPainter::CompositionMode_Source);
+            draw_pixels(p, x, y, node->pixels);
+            p.setCompositionMode(QPainter::CompositionMode_SourceOver);
+        }
+        else {
+            draw_pixels(p, x, y, node->pixels);
+        }
+        break;
+
+    case NODE_EMPTY:
+        break;
+
+    case NODE_SOLID:
+        p.fillRect(x, y, node->width, node->height, node->color);
+        break;
+
+    case NODE_GROUP:
+        for (i = 0; i < node->children.size(); i++) {
+            if (!node->children[i].hidden) {
+                paint_surface(p, node->children[i].surf,
+                              x + node->children[i].x, y + node->children[i].y);
+            }
+        }
+        break;
+
+    case NODE_PENDING:
+        paint_surface(p, wait_future(node->future), x, y);
+        break;
+
+    case NODE_VIEW:
+        p.save();
+        p.setClipRect(QRect(x, y, node->width, node->height), Qt::IntersectClip);
+        paint_surface(p, node->children[0].surf,
+                      x + node->children[0].x, y + node->children[0].y);
+        p.restore();
+        break;
+    }
+}
+
+/* Where blit_surface draws: an ARGB32 image whose top left corner is at
+ * originX, originY, of which only the part between x1, y1 and x2, y2 is
+ * touched. Surfaces which cannot be copied directly, such as pixmaps, are
+ * painted through painter instead, made when first needed. */
+typedef struct blit_target_t {
+    QImage *target;
+    uchar *data;
+    int stride;
+    int originX;
+    int originY;
+
+    int x1;
+    int y1;
+    int x2;
+    int y2;
+
+    QPainter *painter;
+} blit_target_t;
+
+/* Sets t up to draw anywhere on target */
+static void blit_begin(blit_target_t *t, QImage *target, int originX, int originY) {
+    t->target = target;
+    t->data = target->bits();
+    t->stride = target->bytesPerLine();
+    t->originX = originX;
+    t->originY = originY;
+
+    t->x1 = originX;
+    t->y1 = originY;
+    t->x2 = originX + target->width();
+    t->y2 = originY + target->height();
+
+    t->painter = NULL;
+}
+
+static void blit_end(blit_target_t *t) {
+    delete t->painter;
+}
+
+/* Paints node, which blit_surface cannot copy itself, through QPainter */
+static void blit_painter(blit_target_t *t, node_t *node, int x, int y) {
+    if (t->painter == NULL) {
+        t->painter = new QPainter(t->target);
+        t->painter->translate(-t->originX, -t->originY);
+    }
+
+    t->painter->setClipRect(t->x1, t->y1, t->x2 - t->x1, t->y2 - t->y1);
+    paint_surface(*t->painter, node, x, y);
+}
+
+/* Draws node onto t with its top left corner at x, y, working on the pixels
+ * directly. Everything is placed at a whole pixel offset, so opaque images
+ * are copied row by row, other images composited, solids filled, and groups
+ * walked. Anything outside the clip is skipped. */
+static void blit_surface(blit_target_t *t, node_t *node, int x, int y) {
+    uchar *dst;
+    int x1, y1, x2, y2, i;
+    int clip[4];
+
+    /* Only the part of node which is not transparent and lies inside the
+     * clip needs drawing */
+    QRect bounds = node->bounds.translated(x, y);
+
+    x1 = bounds.x() > t->x1 ? bounds.x() : t->x1;
+    y1 = bounds.y() > t->y1 ? bounds.y() : t->y1;
+    x2 = bounds.x() + bounds.width() < t->x2 ? bounds.x() + bounds.width() : t->x2;
+    y2 = bounds.y() + bounds.height() < t->y2 ? bounds.y() + bounds.height() : t->y2;
+
+    if (x1 >= x2 || y1 >= y2) {
+        return;
+    }
+
+    dst = t->data + (size_t)(y1 - t->originY) * t->stride + (size_t)(x1 - t->originX) * 4;
+
+    switch (node->kind) {
+    case NODE_IMAGE:
+#ifdef CDRAW_QT_IMAGE
+        {
+            const uchar *src = node->pixels.constBits() + (size_t)(y1 - y) * node->pixels.bytesPerLine();
+            int stride = node->pixels.bytesPerLine();
+
+            switch (node->pixels.format()) {
+            case QImage::Format_ARGB32_Premultiplied:
+                if (node->opaque) {
+                    dl_blit_copy(dst, t->stride, src + (size_t)(x1 - x) * 4, stride, x2 - x1, y2 - y1);
+                }
+                else {
+                    dl_blit_over(dst, t->stride, src + (size_t)(x1 - x) * 4, stride, x2 - x1, y2 - y1);
+                }
+                return;
+
+            /* Images wrapped around the caller's pixels may hold anything in
+             * the alpha byte */
+            case QImage::Format_RGB32:
+                dl_blit_copy_opaque(dst, t->stride, src + (size_t)(x1 - x) * 4, stride, x2 - x1, y2 - y1);
+                return;
+
+            case QImage::Format_RGB16:
+                dl_blit_from_565(dst, t->stride, src + (size_t)(x1 - x) * 2, stride, x2 - x1, y2 - y1);
+                return;
+
+            case QImage::Format_Alpha8:
+                if (node->mask) {
+                    dl_blit_mask(dst, t->stride, src + (x1 - x), stride, node->color.rgba(), x2 - x1, y2 - y1);
+                    return;
+                }
+                break;
+
+            default:
+                break;
+            }
+        }
+#endif
+        blit_painter(t, node, x, y);
+        break;
+
+    case NODE_EMPTY:
+        break;
+
+    case NODE_SOLID:
+        dl_blit_fill(dst, t->stride, node->color.rgba(), x2 - x1, y2 - y1);
+        break;
+
+    case NODE_GROUP:
+        for (i = 0; i < node->children.size(); i++) {
+            if (!node->children[i].hidden) {
+                blit_surface(t, node->children[i].surf,
+                             x + node->children[i].x, y + node->children[i].y);
+            }
+        }
+        break;
+
+    case NODE_PENDING:
+        blit_surface(t, wait_future(node->future), x, y);
+        break;
+
+    /* Narrow the clip to the part shown for as long as the child draws */
+    case NODE_VIEW:
+        clip[0] = t->x1;
+        clip[1] = t->y1;
+        clip[2] = t->x2;
+        clip[3] = t->y2;
+
+        t->x1 = x1;
+        t->y1 = y1;
+        t->x2 = x2;
+        t->y2 = y2;
+
+        blit_surface(t, node->children[0].surf,
+                     x + node->children[0].x, y + node->children[0].y);
+
+        t->x1 = clip[0];
+        t->y1 = clip[1];
+        t->x2 = clip[2];
+        t->y2 = clip[3];
+        break;
+    }
+}
+
+/* How many threads draw a large image, counting the calling thread */
+static QAtomicInt threadCount(1);
+
+/* Large images are drawn in tiles, spread over a pool of worker threads.
+ * Each tile gets its own QImage pointing into the output's pixels and only
+ * draws the children that reach into it. Tiles are handed out one at a time
+ * from a shared counter, so a thread which finishes early simply takes the
+ * next one and no thread sits idle while tiles are left. The calling thread
+ * works on tiles as well. Only builds with CDRAW_QT_IMAGE draw in tiles. A
+ * tile may paint a child through QPainter, and pixmaps are only safe to
+ * paint on the GUI thread. */
+#ifdef CDRAW_QT_IMAGE
+#define TILE_SIZE 256
+
+typedef struct tile_job_t {
+    uchar *data;
+    int stride;
+    int width;
+    int height;
+
+    child_t *children;
+    int count;
+
+    int columns;
+    int tiles;
+    QAtomicInt next;
+} tile_job_t;
+
+static QThreadPool tilePool;
+static QMutex tileLock;
+
+static void run_tiles(tile_job_t *job) {
+    blit_target_t target;
+    int t, tx, ty, tw, th, i;
+
+    while ((t = job->next.fetchAndAddRelaxed(1)) < job->tiles) {
+        tx = (t % job->columns) * TILE_SIZE;
+        ty = (t / job->columns) * TILE_SIZE;
+
+        tw = job->width - tx < TILE_SIZE ? job->width - tx : TILE_SIZE;
+        th = job->height - ty < TILE_SIZE ? job->height - ty : TILE_SIZE;
+
+        QImage tile(job->data + (size_t)ty * job->stride + (size_t)tx * 4, tw, th,
+                    job->stride, QImage::Format_ARGB32_Premultiplied);
+
+        blit_begin(&target, &tile, tx, ty);
+
+        for (i = 0; i < job->count; i++) {
+            if (!job->children[i].hidden) {
+                blit_surface(&target, job->children[i].surf, job->children[i].x, job->children[i].y);
+            }
+        }
+
+        blit_end(&target);
+    }
+}
+
+class tile_worker_t : public QRunnable {
+public:
+    tile_worker_t(tile_job_t *job) : job(job) {}
+
+    void run() override {
+        run_tiles(job);
+    }
+
+private:
+    tile_job_t *job;
+};
+
+/* Draws children into image in tiles on the worker pool. Returns false
+ * without drawing anything if the pool is already busy with another image. */
+static bool paint_tiled(QImage &image, child_t *children, int count) {
+    tile_job_t job;
+    int helpers, i;
+
+    if (!tileLock.tryLock()) {
+        return false;
+    }
+
+    job.data = image.bits();
+    job.stride = image.bytesPerLine();
+    job.width = image.width();
+    job.height = image.height();
+    job.children = children;
+    job.count = count;
+    job.columns = (job.width + TILE_SIZE - 1) / TILE_SIZE;
+    job.tiles = job.columns * ((job.height + TILE_SIZE - 1) / TILE_SIZE);
+    job.next = 0;
+
+    helpers = threadCount.loadAcquire() - 1;
+    tilePool.setMaxThreadCount(helpers);
+
+    for (i = 0; i < helpers; i++) {
+        tilePool.start(new tile_worker_t(&job));
+    }
+
+    run_tiles(&job);
+
+    tilePool.waitForDone();
+    tileLock.unlock();
+
+    return true;
+}
+#endif
+
+/* Draws children into image, a cleared ARGB32 image, splitting the work over
+ * threads if it is worth it */
+static void paint_image(QImage &image, child_t *children, int count) {
+    blit_target_t t;
+    int i;
+
+    STATS_BEGIN(STAT_PAINT);
+    STATS_PIXELS((unsigned long long)image.width() * image.height());
+
+#ifdef CDRAW_QT_IMAGE
+    if (threadCount.loadAcquire() > 1 && image.width() * image.height() > TILE_SIZE * TILE_SIZE &&
+        paint_tiled(image, children, count)) {
+        STATS_END(STAT_PAINT);
+        return;
+    }
+#endif
+
+    blit_begin(&t, &image, 0, 0);
+
+    for (i = 0; i < count; i++) {
+        if (!children[i].hidden) {
+            blit_surface(&t, children[i].surf, children[i].x, children[i].y);
+        }
+    }
+
+    blit_end(&t);
+
+    STATS_END(STAT_PAINT);
+}
+
+/* Draws children into new pixels of the given size, splitting the work over
+ * threads if it is worth it and the pixels are an image. Unless clear is set
+ * the children must cover every pixel. */
+static pixels_t paint_children(int width, int height, child_t *children, int count, int clear) {
+#ifdef CDRAW_QT_IMAGE
+    /* The pixels are an image already, so they are drawn into directly */
+    QImage image = new_image_pixels(width, height, clear);
+
+    paint_image(image, children, count);
+
+    return image;
+#else
+    int i;
+
+    pixels_t ret = new_pixels(width, height, clear);
+
+    STATS_BEGIN(STAT_PAINT);
+    STATS_PIXELS((unsigned long long)width * height);
+
+    QPainter p(&ret);
+
+    for (i = 0; i < count; i++) {
+        if (!children[i].hidden) {
+            paint_surface(p, children[i].surf, children[i].x, children[i].y);
+        }
+    }
+
+    p.end();
+
+    STATS_END(STAT_PAINT);
+
+    return ret;
+#endif
+}
+
+/* Takes over freshly drawn pixels and returns them in format, the format
+ * opaque images are kept in, if they are opaque. The format is passed in
+ * rather than read from opaqueFormat, since render threads must not see it
+ * change under them. */
+static pixels_t pack_pixels(pixels_t pixels, int opaque, QImage::Format format) {
+#ifdef CDRAW_QT_IMAGE
+    if (opaque && format != QImage::Format_ARGB32_Premultiplied && !pixels.isNull()) {
+        return std::move(pixels).convertToFormat(format);
+    }
+#else
+    (void)opaque;
+    (void)format;
+#endif
+
+    return pixels;
+}
+
+/* Whether children leave no pixel of a width by height surface uncovered or
+ * see through. Only the cases the combinators make are caught, one opaque
+ * child covering everything, or opaque children laid out side by side or
+ * one above the other that fill it exactly. */
+static int covers(int width, int height, const child_t *children, int count) {
+    node_t *node;
+    int i, x, y, row, column;
+
+    x = 0;
+    y = 0;
+    row = 1;
+    column = 1;
+
+    for (i = 0; i < count; i++) {
+        node = children[i].surf;
+
+        if (node->width == 0 || node->height == 0) {
+            continue;
+        }
+
+        if (!node->opaque) {
+            row = 0;
+            column = 0;
+            continue;
+        }
+
+        if (children[i].x <= 0 && children[i].y <= 0 &&
+            children[i].x + node->width >= width && children[i].y + node->height >= height) {
+            return 1;
+        }
+
+        row = row && children[i].x == x && children[i].y == 0 && node->height == height;
+        column = column && children[i].y == y && children[i].x == 0 && node->width == width;
+
+        x += node->width;
+        y += node->height;
+    }
+
+    return width > 0 && height > 0 && ((row && x == width) || (column && y == height));
+}
+
+/* Sets the hidden flag of each of children. Only the HIDING_CHILDREN
+ * opaque children nearest the top are tried as covers, which catches an
+ * opaque front in an overlay while keeping long rows and grids cheap. */
+#define HIDING_CHILDREN 4
+
+static void mark_hidden(child_t *children, int count) {
+    QRect covering[HIDING_CHILDREN];
+    int found, i, j;
+
+    found = 0;
+
+    for (i = count - 1; i >= 0; i--) {
+        QRect bounds = children[i].surf->bounds.translated(children[i].x, children[i].y);
+
+        children[i].hidden = bounds.isEmpty();
+
+        for (j = 0; j < found && !children[i].hidden; j++) {
+            children[i].hidden = covering[j].contains(bounds);
+        }
+
+        if (!children[i].hidden && found < HIDING_CHILDREN && children[i].surf->opaque) {
+            covering[found++] = QRect(children[i].x, children[i].y,
+                                      children[i].surf->width, children[i].surf->height);
+        }
+    }
+}
+
+/* The part of the parent that children, once marked, may draw on */
+static QRect children_bounds(const child_t *children, int count) {
+    QRect ret;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (!children[i].hidden) {
+            ret = ret.united(children[i].surf->bounds.translated(children[i].x, children[i].y));
+        }
+    }
+
+    return ret;
+}
+
+/* Puts children together into a new surface of the given size, either by
+ * drawing them into a new image or, in lazy mode, by making a group. */
+static node_t *compose(int width, int height, child_t *children, int count) {
+    node_t *ret;
+    int i, shown, opaque;
+
+    mark_hidden(children, count);
+
+    /* If only one child shows and it fills the whole surface, the result
+     * looks exactly like that child. Surfaces are never drawn on once
+     * handed out, so we can share it rather than copy it. */
+    shown = -1;
+
+    for (i = 0; i < count; i++) {
+        if (children[i].hidden) {
+            continue;
+        }
+
+        if (shown != -1) {
+            shown = -1;
+            break;
+        }
+
+        shown = i;
+    }
+
+    if (shown != -1 && children[shown].x == 0 && children[shown].y == 0 &&
+        children[shown].surf->width == width && children[shown].surf->height == height) {
+        return retain_node(children[shown].surf);
+    }
+
+    if (lazyMode) {
+        ret = new_node(NODE_GROUP, width, height);
+        ret->opaque = covers(width, height, children, count);
+        ret->bounds = children_bounds(children, count);
+
+        for (i = 0; i < count; i++) {
+            retain_node(children[i].surf);
+            ret->children.append(children[i]);
+        }
+
+        return ret;
+    }
+
+    /* Opaque children will write every pixel, so there is no need to clear
+     * them first */
+    opaque = covers(width, height, children, count);
+
+    ret = new_image(pack_pixels(paint_children(width, height, children, count, !opaque), opaque, opaqueFormat));
+    ret->opaque = opaque;
+    ret->bounds = children_bounds(children, count);
+
+    return ret;
+}
+
+/* Surfaces created while an arena is open belong to it, and are freed all
+ * at once when it is closed. Arenas are per thread and nest. */
+typedef struct arena_t {
+    QVector<node_t*> nodes;
+    struct arena_t *prev;
+} arena_t;
+
+static thread_local arena_t *arena = NULL;
+
+/* Hands node over to the open arena, if there is one, and returns it */
+static node_t *arena_add(node_t *node) {
+    if (arena != NULL) {
+        arena->nodes.append(node);
+    }
+
+    return node;
+}
+
+/* The budget is a size_t but QCache counts cost in an int */
+static int cache_cost(size_t bytes) {
+    return bytes > INT_MAX ? INT_MAX : (int)bytes;
+}
+
+/* The combinators can be memoized, see DL_memo_set_budget. Every call is
+ * looked up by what it was asked for, its sizes, colors and alignments, and
+ * which surfaces it was given, and a surface made by an identical call
+ * earlier is shared rather than made again. Calls which draw into an image
+ * are also looked up by the opaque format, see DL_set_opaque_format, since
+ * it decides the format of that image. Surfaces are compared by
+ * identity, so this works from the leaves up: identical rectangles come back
+ * as the same surface, so combinations of them match as well. Each entry
+ * holds references to its inputs, so their addresses can not be reused by
+ * other surfaces while it is cached. QCache drops the least recently used
+ * entries to stay under the budget. */
+typedef enum memo_op_t {
+    MEMO_RECTANGLE,
+    MEMO_EMPTY,
+    MEMO_BESIDE,
+    MEMO_ABOVE,
+    MEMO_OVERLAY,
+    MEMO_BESIDE_N,
+    MEMO_ABOVE_N,
+    MEMO_OVERLAY_N,
+    MEMO_GRID,
+    MEMO_CROP,
+    MEMO_PAD
+} memo_op_t;
+
+/* What a call made, and the surfaces it was made from */
+typedef struct memo_entry_t {
+    node_t *node;
+    QVector<node_t*> inputs;
+
+    ~memo_entry_t() {
+        int i;
+
+        for (i = 0; i < inputs.size(); i++) {
+            if (inputs[i] != NULL) {
+                release_node(inputs[i]);
+            }
+        }
+
+        release_node(node);
+    }
+} memo_entry_t;
+
+static QMutex memoLock;
+static QCache<QByteArray, memo_entry_t> memoCache(0);
+static memo_stats_t memoStats = { 0, 0, 0, 0, 0 };
+
+/* Checked without the lock, so calls cost nothing extra while it is off */
+static QAtomicInt memoOn(0);
+
+/* Roughly how much memory node holds on to by itself */
+static size_t node_bytes(node_t *node) {
+    if (node->kind == NODE_IMAGE) {
+#ifdef CDRAW_QT_IMAGE
+        return (size_t)node->pixels.bytesPerLine() * node->height;
+#else
+        return (size_t)node->width * node->height * 4;
+#endif
+    }
+
+    return sizeof(node_t) + (size_t)node->children.size() * sizeof(child_t);
+}
+
+static QByteArray memo_key(const int *params, int paramCount, surface **inputs, int inputCount) {
+    QByteArray key((const char*)params, paramCount * sizeof(int));
+
+    key.append((const char*)inputs, inputCount * sizeof(surface*));
+
+    return key;
+}
+
+/* Returns a new reference to the surface an identical call made earlier, or
+ * NULL. params starts with the memo_op_t of the call. Inputs may be NULL. */
+static node_t *memo_get(const int *params, int paramCount, surface **inputs, int inputCount) {
+    memo_entry_t *entry;
+
+    if (!memoOn.loadRelaxed()) {
+        return NULL;
+    }
+
+    QByteArray key = memo_key(params, paramCount, inputs, inputCount);
+    QMutexLocker locker(&memoLock);
+
+    entry = memoCache.object(key);
+
+    if (entry == NULL) {
+        memoStats.misses++;
+        return NULL;
+    }
+
+    memoStats.hits++;
+
+    return retain_node(entry->node);
+}
+
+/* Remembers node as what the call made, if it fits in the budget */
+static void memo_put(const int *params, int paramCount, surface **inputs, int inputCount, node_t *node) {
+    memo_entry_t *entry;
+    int i, count;
+
+    if (!memoOn.loadRelaxed()) {
+        return;
+    }
+
+    QByteArray key = memo_key(params, paramCount, inputs, inputCount);
+
+    entry = new memo_entry_t;
+    entry->node = retain_node(node);
+
+    for (i = 0; i < inputCount; i++) {
+        entry->inputs.append(inputs[i] != NULL ? retain_node((node_t*)inputs[i]) : NULL);
+    }
+
+    QMutexLocker locker(&memoLock);
+
+    /* Another thread may have made the same call in the meantime */
+    if (memoCache.contains(key)) {
+        locker.unlock();
+        delete entry;
+        return;
+    }
+
+    /* QCache evicts on its own, so count how many entries went away */
+    count = memoCache.size();
+
+    if (memoCache.insert(key, entry, cache_cost(node_bytes(node)))) {
+        memoStats.evictions += count + 1 - memoCache.size();
+    }
+}
+
+/* Sets how many bytes of surfaces the combinators may keep to share between
+ * identical calls. While set, DL_rectangle, DL_empty, DL_beside_align,
+ * DL_above_align, DL_overlay, their _n forms and DL_grid hand back the
+ * surface an earlier call with the same arguments made, rather than making it
+ * again. Surfaces passed in are matched by identity, so leaves should come
+ * from here or the text cache for their combinations to match. Setting it to
+ * 0, the default, turns memoization off and frees what it held. */
+extern "C" void DL_memo_set_budget(size_t bytes) {
+    QMutexLocker locker(&memoLock);
+    int count = memoCache.size();
+
+    memoStats.budget = bytes;
+    memoCache.setMaxCost(cache_cost(bytes));
+    memoOn.storeRelaxed(bytes > 0);
+
+    if (bytes == 0) {
+        memoCache.clear();
+    }
+
+    memoStats.evictions += count - memoCache.size();
+}
+
+/* Fills in stats with the memo table's hit and miss counters and how many
+ * bytes of surfaces it currently holds. */
+extern "C" void DL_memo_get_stats(memo_stats_t *stats) {
+    QMutexLocker locker(&memoLock);
+
+    memoStats.bytes = memoCache.totalCost();
+    *stats = memoStats;
+}
+
+/* Empties the memo table and resets the counters. Surfaces handed out from
+ * it stay valid. */
+extern "C" void DL_memo_clear(void) {
+    QMutexLocker locker(&memoLock);
+
+    memoCache.clear();
+
+    memoStats.hits = 0;
+    memoStats.misses = 0;
+    memoStats.evictions = 0;
+}
+
 /* Creates a new surface with the given left and right surfaces drawn beside
  * each other, aligned as per align.
  *
  * Alignments are either TOP, BOTTOM, or CENTER */
 extern "C" surface *DL_beside_align (surface *l, surface *r, align_t align) {
-    QPixmap *left, *right;
+    node_t *left, *right;
+    child_t children[2];
+    node_t *ret;
+    int params[] = { MEMO_BESIDE, lazyMode, opaqueFormat, align };
+    surface *inputs[] = { l, r };
 
-    /* Set our pixmaps to their proper pixmap type */
-    left = (QPixmap*)l;
-    right = (QPixmap*)r;
+    STATS_BEGIN(STAT_BESIDE_ALIGN);
+
+    ret = memo_get(params, 4, inputs, 2);
+
+    if (ret != NULL) {
+        STATS_END(STAT_BESIDE_ALIGN);
+        return (void*)arena_add(ret);
+    }
+
+    /* Set our surfaces to their proper node type */
+    left = (node_t*)l;
+    right = (node_t*)r;
 
     int newWidth, newHeight;
     int x, y;
     int leftW, leftH, rightW, rightH;
 
     /* Get the width of our left and right surfaces */
-    leftW = left->width();
-    leftH = left->height();
+    leftW = left->width;
+    leftH = left->height;
 
-    rightW = right->width();
-    rightH = right->height();
+    rightW = right->width;
+    rightH = right->height;
 
     /* Since we are placing the images beside one another, the new width will
      * be the sum of the left and right width. And the height will be the
@@ -59,25 +1179,18 @@ extern "C" surface *DL_beside_align (surface *l, surface *r, align_t align) {
     else{
         newHeight = rightH;
     }
-    
-    /* Create our new surface, and get a QPainter for it */
-    QPixmap *ret = new QPixmap(newWidth, newHeight);
-
-    /* Fill the pixmap so we arent writing to uninitialized data */
-    ret->fill(QColor("transparent"));
-
-    QPainter p(ret);
 
     /* The x to draw our left side image will always be 0, our y will change
-     * based on our align, so perform those calculations here then draw it to
-     * our new surface */
+     * based on our align, so perform those calculations here */
     x = 0;
 
     if (align == TOP)           y = 0;
     else if(align == BOTTOM)    y = newHeight - leftH;
     else                        y = (newHeight / 2.0) - (leftH / 2.0);
 
-    p.drawPixmap(x, y, *left);
+    children[0].surf = left;
+    children[0].x = x;
+    children[0].y = y;
 
     /* Now do the same for the right side. The y is the same process as the
      * left, but this time the x is the width of left image. */
@@ -87,16 +1200,30 @@ extern "C" surface *DL_beside_align (surface *l, surface *r, align_t align) {
     else if(align == BOTTOM)    y = newHeight - rightH;
     else                        y = (newHeight / 2.0) - (rightH / 2.0);
 
-    p.drawPixmap(x, y, *right);
+    children[1].surf = right;
+    children[1].x = x;
+    children[1].y = y;
 
     /* Cast our return to void so we can return it to a C context */
-    return (void*)ret;
+    ret = compose(newWidth, newHeight, children, 2);
+
+    memo_put(params, 4, inputs, 2, ret);
+
+    STATS_END(STAT_BESIDE_ALIGN);
+
+    return (void*)arena_add(ret);
 }
 
 /* Creates a new surface with the given left and right surfaces drawn beside
  * each other, aligned at the center of each surface. */
 extern "C" surface *DL_beside (surface *left, surface *right) {
-    return DL_beside_align(left, right, CENTER);
+    surface *ret;
+
+    STATS_BEGIN(STAT_BESIDE);
+    ret = DL_beside_align(left, right, CENTER);
+    STATS_END(STAT_BESIDE);
+
+    return ret;
 }
 
 /* Creates a new surface with the given top and bottom surfaces on positioned
@@ -104,21 +1231,33 @@ extern "C" surface *DL_beside (surface *left, surface *right) {
  *
  * Alignments are either LEFT, RIGHT, or CENTER */
 extern "C" surface *DL_above_align(surface *t, surface *b, align_t align) {
-    QPixmap *top, *bottom;
-    QPixmap *ret;
+    node_t *top, *bottom;
+    child_t children[2];
+    node_t *ret;
+    int params[] = { MEMO_ABOVE, lazyMode, opaqueFormat, align };
+    surface *inputs[] = { t, b };
+
+    STATS_BEGIN(STAT_ABOVE_ALIGN);
+
+    ret = memo_get(params, 4, inputs, 2);
+
+    if (ret != NULL) {
+        STATS_END(STAT_ABOVE_ALIGN);
+        return (void*)arena_add(ret);
+    }
 
-    top = (QPixmap*)t;
-    bottom = (QPixmap*)b;
+    top = (node_t*)t;
+    bottom = (node_t*)b;
 
     int newWidth, newHeight;
     int topW, topH, botW, botH;
     int x, y;
 
-    topW = top->width();
-    topH = top->height();
+    topW = top->width;
+    topH = top->height;
 
-    botW = bottom->width();
-    botH = bottom->height();
+    botW = bottom->width;
+    botH = bottom->height;
 
     if (botW > topW) {
         newWidth = botW;
@@ -129,72 +1268,356 @@ extern "C" surface *DL_above_align(surface *t, surface *b, align_t align) {
 
     newHeight = topH + botH;
 
-    ret = new QPixmap(newWidth, newHeight);
-    ret->fill(QColor("transparent"));
-
-    QPainter p(ret);
-
     y = 0;
 
     if (align == LEFT)          x = 0;
     else if(align == RIGHT)     x = newWidth - topW;
     else                        x = (newWidth / 2.0) - (topW / 2.0);
 
-        p.drawPixmap(x, y, *top);
+    children[0].surf = top;
+    children[0].x = x;
+    children[0].y = y;
 
     y = topH;
     if (align == LEFT)          x = 0;
     else if(align == RIGHT)     x = newWidth - botW;
     else                        x = (newWidth / 2.0) - (botW / 2.0);
 
-        p.drawPixmap(x, y, *bottom);
+    children[1].surf = bottom;
+    children[1].x = x;
+    children[1].y = y;
 
-    return (void*)ret;
+    ret = compose(newWidth, newHeight, children, 2);
+
+    memo_put(params, 4, inputs, 2, ret);
+
+    STATS_END(STAT_ABOVE_ALIGN);
+
+    return (void*)arena_add(ret);
 }
 
 /* Creates a new surface with the given top and bottom surfaces on positioned
  * vertically relative to each other, algined at the center. */
 extern "C" surface *DL_above(surface *top, surface *bot) {
-    return DL_above_align(top, bot, CENTER);
-}
+    surface *ret;
+
+    STATS_BEGIN(STAT_ABOVE);
+    ret = DL_above_align(top, bot, CENTER);
+    STATS_END(STAT_ABOVE);
+
+    return ret;
+}
 
 /* Creates a new surface with a rectangle drawn based on the given width,
- * height, and color. */
+ * height, and color. No pixels are allocated for it, the rectangle is filled
+ * in wherever it gets drawn. */
 extern "C" surface *DL_rectangle (int w, int h, color_t color) {
-    QPixmap *ret;
+    node_t *ret;
+    int params[] = { MEMO_RECTANGLE, w, h, color.r, color.g, color.b };
 
-    ret = new QPixmap(w, h);
-    ret->fill(QColor("transparent"));
-    QPainter p(ret);
+    STATS_BEGIN(STAT_RECTANGLE);
 
-    p.fillRect(0, 0, w, h, QColor(color.r, color.g, color.b));
+    ret = memo_get(params, 6, NULL, 0);
 
-    return (void*)ret;
+    if (ret != NULL) {
+        STATS_END(STAT_RECTANGLE);
+        return (void*)arena_add(ret);
+    }
+
+    /* A rectangle is one flat color, so rather than filling a whole image we
+     * only remember its size and color, and fill it in when it is painted */
+    ret = new_node(NODE_SOLID, w, h);
+    ret->color = QColor(color.r, color.g, color.b);
+    ret->opaque = 1;
+
+    memo_put(params, 6, NULL, 0, ret);
+
+    STATS_END(STAT_RECTANGLE);
+
+    return (void*)arena_add(ret);
 }
 
 /* Creates a new surface with a square drawn based on the given side length and
  * color */
 extern "C" surface *DL_square (int s, color_t color) {
-    return DL_rectangle(s, s, color);
+    surface *ret;
+
+    STATS_BEGIN(STAT_SQUARE);
+    ret = DL_rectangle(s, s, color);
+    STATS_END(STAT_SQUARE);
+
+    return ret;
 }
 
-/* Create a new empty surface based on the given width and height */
+/* Create a new empty surface based on the given width and height. No pixels
+ * are allocated for it. */
 extern "C" surface *DL_empty (int w, int h) {
-    QPixmap *ret;
+    node_t *ret;
+    int params[] = { MEMO_EMPTY, w, h };
 
-    ret = new QPixmap(w, h);
-    ret->fill(QColor("transparent"));
+    STATS_BEGIN(STAT_EMPTY);
 
-    return (void*)ret;
+    ret = memo_get(params, 3, NULL, 0);
+
+    if (ret != NULL) {
+        STATS_END(STAT_EMPTY);
+        return (void*)arena_add(ret);
+    }
+
+    /* There is nothing to draw, so this is only a size */
+    ret = new_node(NODE_EMPTY, w, h);
+
+    memo_put(params, 3, NULL, 0, ret);
+
+    STATS_END(STAT_EMPTY);
+
+    return (void*)arena_add(ret);
 }
 
-/* Creates a new surface with the given text drawn on it with the given font 
- * and font size and color used. */
-extern "C" surface *DL_text(const char* text, int size, color_t color, const char* font, unsigned char bold, unsigned char italics) {
-    QFont fn(font, size);
+/* A buffer handed over to DL_from_buffer, given back through release once
+ * the last image reading it is gone */
+typedef struct import_t {
+    release_func_t release;
+    void *closure;
+} import_t;
+
+static void release_import(void *data) {
+    import_t *import = (import_t*)data;
+
+    if (import->release != NULL) {
+        import->release(import->closure);
+    }
+
+    delete import;
+}
+
+static QImage::Format buffer_format(format_t format) {
+    switch (format) {
+    case FORMAT_RGB24:
+        return QImage::Format_RGB32;
+
+    case FORMAT_A8:
+        return QImage::Format_Alpha8;
+
+    case FORMAT_RGB16_565:
+        return QImage::Format_RGB16;
+
+    default:
+        return QImage::Format_ARGB32_Premultiplied;
+    }
+}
+
+/* Whether QImage can read the caller's pixels in place. It wants the rows a
+ * 32 bit word at a time. */
+static int can_wrap(const uchar *data, int width, int height, int stride, QImage::Format format) {
+    int depth;
+
+    switch (format) {
+    case QImage::Format_Alpha8:
+        depth = 1;
+        break;
+
+    case QImage::Format_RGB16:
+        depth = 2;
+        break;
+
+    default:
+        depth = 4;
+        break;
+    }
+
+    return data != NULL && width > 0 && height > 0 && (uintptr_t)data % 4 == 0 &&
+           stride % 4 == 0 && stride / depth >= width;
+}
+
+/* Makes an image surface out of image, which reads the caller's pixels */
+static node_t *wrap_image(const QImage &image) {
+    node_t *ret;
+
+#ifdef CDRAW_QT_IMAGE
+    ret = new_image(image);
+#else
+    ret = new_image(QPixmap::fromImage(image));
+#endif
+
+    ret->opaque = image.format() == QImage::Format_RGB32 || image.format() == QImage::Format_RGB16;
+
+    return ret;
+}
+
+/* Creates a new image surface out of the caller's width by height pixels,
+ * with rows stride bytes apart. Nothing is copied, the surface takes the
+ * buffer over and calls release, which may be NULL, with closure once it is
+ * done with it. Returns NULL if the pixels can not be read in place, and the
+ * buffer then stays the caller's. */
+extern "C" surface *DL_from_buffer(unsigned char *data, int width, int height, int stride, format_t format, release_func_t release, void *closure) {
+    QImage::Format qformat = buffer_format(format);
+    import_t *import;
+    node_t *node;
+
+    STATS_BEGIN(STAT_FROM_BUFFER);
+
+    if (!can_wrap(data, width, height, stride, qformat)) {
+        STATS_END(STAT_FROM_BUFFER);
+        return NULL;
+    }
+
+    import = new import_t;
+    import->release = release;
+    import->closure = closure;
+
+    node = wrap_image(QImage(data, width, height, stride, qformat, release_import, import));
+
+    STATS_END(STAT_FROM_BUFFER);
+
+    return (void*)arena_add(node);
+}
+
+/* Like DL_from_buffer, but the buffer stays the caller's, who must keep it
+ * alive and unchanged for as long as the surface or anything composed from
+ * it is around. The QImage is made on const data, so drawing on it makes a
+ * copy first. */
+extern "C" surface *DL_from_buffer_borrowed(const unsigned char *data, int width, int height, int stride, format_t format) {
+    QImage::Format qformat = buffer_format(format);
+    node_t *node;
+
+    STATS_BEGIN(STAT_FROM_BUFFER_BORROWED);
+
+    if (!can_wrap(data, width, height, stride, qformat)) {
+        STATS_END(STAT_FROM_BUFFER_BORROWED);
+        return NULL;
+    }
+
+    node = wrap_image(QImage(data, width, height, stride, qformat));
+
+    STATS_END(STAT_FROM_BUFFER_BORROWED);
+
+    return (void*)arena_add(node);
+}
+
+/* DL_text keeps two caches. Fonts and their metrics are built once per
+ * family, size, and style. Finished text images are kept in a QCache keyed
+ * by everything a text is drawn from, so drawing the same label or paragraph
+ * again shares the image we already have. Qt shapes the text itself. The
+ * image cache is bounded by a byte budget and QCache drops the least
+ * recently used entries to stay under it.
+ *
+ * In image builds each font also keeps every glyph it has drawn as 8 bit
+ * coverage, and single lines of text are built up out of those rather than
+ * drawn glyph by glyph again. Tables of numbers use a dozen or so glyphs
+ * over and over. Each glyph is kept at GLYPH_PHASES offsets across and down
+ * a pixel, and pens are put at the nearest of them, so the spacing follows
+ * the font's fractional advances. This matches drawText to within a quarter
+ * pixel of position, not bit for bit. */
+#ifdef CDRAW_QT_IMAGE
+#define GLYPH_PHASES 4
+
+/* A glyph drawn once at one phase. Its coverage goes left, top from the
+ * whole pixel the pen is put at, and glyphs without ink, like spaces, have
+ * none. */
+typedef struct glyph_entry_t {
+    QImage coverage;
+    int left;
+    int top;
+} glyph_entry_t;
+#endif
+
+typedef struct font_entry_t {
+    QFont font;
+    QFontMetrics metrics;
+#ifdef CDRAW_QT_IMAGE
+    QRawFont raw;
+    QHash<quint64, glyph_entry_t> glyphs;
+
+    /* What the glyphs take up, and when text was last built out of them */
+    size_t glyphBytes;
+    quint64 glyphUse;
+
+    font_entry_t(const QFont &fn) : font(fn), metrics(fn), raw(QRawFont::fromFont(fn)), glyphBytes(0), glyphUse(0) {}
+#else
+    font_entry_t(const QFont &fn) : font(fn), metrics(fn) {}
+#endif
+} font_entry_t;
+
+/* A finished text image, the part of it the glyphs cover, and whether it is
+ * a mask */
+typedef struct text_entry_t {
+    pixels_t pixels;
+    QRect bounds;
+    unsigned char mask;
+} text_entry_t;
+
+#define TEXT_CACHE_DEFAULT_BUDGET (16 * 1024 * 1024)
+
+static QMutex textLock;
+static QHash<QByteArray, font_entry_t*> fonts;
+static QCache<QByteArray, text_entry_t> textCache(TEXT_CACHE_DEFAULT_BUDGET);
+static text_cache_stats_t textStats = { 0, 0, 0, 0, TEXT_CACHE_DEFAULT_BUDGET };
+
+#ifdef CDRAW_QT_IMAGE
+/* What the glyphs of every font take up, and a clock the fonts' glyphUse is
+ * set from */
+static size_t glyphBytes = 0;
+static quint64 glyphClock = 0;
+#endif
+
+/* Keeps the text images, and in image builds the glyphs, within the budget
+ * together. Texts are built out of the glyphs, so those only go once they
+ * alone are over budget, all of a font's at once, the font text was least
+ * recently built from first. The text images get what is left. Must be
+ * called with textLock held. */
+static void fit_text(void) {
+    size_t glyphs = 0;
+    int count;
+
+#ifdef CDRAW_QT_IMAGE
+    font_entry_t *oldest;
+
+    while (glyphBytes > textStats.budget) {
+        oldest = NULL;
+
+        for (font_entry_t *fnt : fonts) {
+            if (fnt->glyphBytes > 0 && (oldest == NULL || fnt->glyphUse < oldest->glyphUse)) {
+                oldest = fnt;
+            }
+        }
+
+        glyphBytes -= oldest->glyphBytes;
+        oldest->glyphs.clear();
+        oldest->glyphBytes = 0;
+        textStats.evictions++;
+    }
+
+    glyphs = glyphBytes;
+#endif
+
+    /* QCache evicts on its own, so count how many entries went away */
+    count = textCache.size();
+    textCache.setMaxCost(cache_cost(textStats.budget - glyphs));
+    textStats.evictions += count - textCache.size();
+}
+
+static QByteArray font_key(const char *font, int size, unsigned char bold, unsigned char italics) {
+    QByteArray key(font);
+
+    key.append('\0');
+    key.append((const char*)&size, sizeof(size));
+    key.append((char)bold);
+    key.append((char)italics);
+
+    return key;
+}
+
+/* Finds the font for the given family, size and style, creating it the first
+ * time it is asked for. Must be called with textLock held. */
+static font_entry_t *get_font(const QByteArray &key, const char *font, int size, unsigned char bold, unsigned char italics) {
+    font_entry_t *entry = fonts.value(key, NULL);
+
+    if (entry != NULL) {
+        return entry;
+    }
 
-    int w, h;
-    int fontSlant, fontWeight;
+    QFont fn(font, size);
 
     if (bold) {
         fn.setWeight(QFont::Bold);
@@ -204,40 +1627,445 @@ extern "C" surface *DL_text(const char* text, int size, color_t color, const cha
         fn.setItalic(true);
     }
 
-    QFontMetrics fm(fn);
+    entry = new font_entry_t(fn);
+    fonts.insert(key, entry);
+
+    return entry;
+}
+
+#ifdef CDRAW_QT_IMAGE
+/* A position in steps of 1 / GLYPH_PHASES of a pixel, the whole pixel it
+ * falls in, and how many steps into it */
+static int steps_of(qreal v) {
+    return qFloor(v * GLYPH_PHASES + 0.5);
+}
+
+static int pixel_of(int steps) {
+    return qFloor((qreal)steps / GLYPH_PHASES);
+}
+
+static int phase_of(int steps) {
+    return steps - pixel_of(steps) * GLYPH_PHASES;
+}
+
+/* Finds glyph index of fnt at the given phases, drawing it the first time
+ * it is asked for. Must be called with textLock held. */
+static glyph_entry_t find_glyph(font_entry_t *fnt, quint32 index, int phaseX, int phaseY) {
+    glyph_entry_t entry;
+    QGlyphRun run;
+    QRectF ink;
+    qreal offsetX, offsetY;
+    quint64 key;
+    size_t bytes;
+    int right, bottom;
+
+    key = ((quint64)index * GLYPH_PHASES + phaseY) * GLYPH_PHASES + phaseX;
+
+    if (fnt->glyphs.contains(key)) {
+        return fnt->glyphs.value(key);
+    }
+
+    offsetX = (qreal)phaseX / GLYPH_PHASES;
+    offsetY = (qreal)phaseY / GLYPH_PHASES;
+
+    ink = fnt->raw.boundingRect(index);
+    entry.left = 0;
+    entry.top = 0;
+
+    if (!ink.isEmpty()) {
+        /* Leave room around the ink for antialiasing */
+        entry.left = qFloor(ink.left() + offsetX) - 2;
+        entry.top = qFloor(ink.top() + offsetY) - 2;
+        right = qCeil(ink.right() + offsetX) + 2;
+        bottom = qCeil(ink.bottom() + offsetY) + 2;
+
+        QImage image(right - entry.left, bottom - entry.top, QImage::Format_ARGB32_Premultiplied);
+        image.fill(Qt::transparent);
+
+        run.setRawFont(fnt->raw);
+        run.setGlyphIndexes(QVector<quint32>(1, index));
+        run.setPositions(QVector<QPointF>(1, QPointF(offsetX - entry.left, offsetY - entry.top)));
+
+        QPainter p(&image);
+        p.setPen(QColor(Qt::black));
+        p.drawGlyphRun(QPointF(0, 0), run);
+        p.end();
+
+        entry.coverage = std::move(image).convertToFormat(QImage::Format_Alpha8);
+    }
+
+    fnt->glyphs.insert(key, entry);
+
+    bytes = sizeof(glyph_entry_t) + (size_t)entry.coverage.bytesPerLine() * entry.coverage.height();
+    fnt->glyphBytes += bytes;
+    glyphBytes += bytes;
+
+    return entry;
+}
+
+/* Builds a single line of text up out of the glyphs its font has drawn
+ * before, adding their coverage into a w by h Alpha8 mask. Each pen goes to
+ * the nearest phase. Returns a null image if Qt picked another font for some
+ * of the text, which is then left to QPainter. */
+static QImage draw_glyphs(const QByteArray &fontKey, const QFont &fn, const char *text, const char *font,
+                          int size, unsigned char bold, unsigned char italics, int w, int h) {
+    QVector<glyph_entry_t> placed;
+    QVector<QPoint> pixels;
+    font_entry_t *fnt;
+    int i, x, y, x1, y1, x2, y2, stepsX, stepsY;
+
+    /* Shaped the way drawText would, newlines are spaces on a single line */
+    QString str(text);
+    str.replace(QLatin1Char('\n'), QLatin1Char(' '));
+
+    QTextLayout layout(str, fn);
+    layout.beginLayout();
+    layout.createLine();
+    layout.endLayout();
+
+    const QList<QGlyphRun> runs = layout.glyphRuns();
+
+    QMutexLocker locker(&textLock);
+
+    fnt = get_font(fontKey, font, size, bold, italics);
+    fnt->glyphUse = ++glyphClock;
+
+    for (const QGlyphRun &run : runs) {
+        if (run.rawFont() != fnt->raw) {
+            fit_text();
+            return QImage();
+        }
+
+        const QVector<quint32> indexes = run.glyphIndexes();
+        const QVector<QPointF> points = run.positions();
+
+        for (i = 0; i < indexes.size(); i++) {
+            stepsX = steps_of(points[i].x());
+            stepsY = steps_of(points[i].y());
+
+            placed.append(find_glyph(fnt, indexes[i], phase_of(stepsX), phase_of(stepsY)));
+            pixels.append(QPoint(pixel_of(stepsX), pixel_of(stepsY)));
+        }
+    }
+
+    /* New glyphs may have taken the cache over budget. The coverage placed
+     * here is shared, so it stays even if its font's glyphs go. */
+    fit_text();
+
+    locker.unlock();
+
+    QImage ret(w, h, QImage::Format_Alpha8);
+    ret.fill(0);
+
+    for (i = 0; i < placed.size(); i++) {
+        const QImage &coverage = placed[i].coverage;
+
+        if (coverage.isNull()) {
+            continue;
+        }
+
+        x = pixels[i].x() + placed[i].left;
+        y = pixels[i].y() + placed[i].top;
+
+        x1 = x < 0 ? 0 : x;
+        y1 = y < 0 ? 0 : y;
+        x2 = x + coverage.width() < w ? x + coverage.width() : w;
+        y2 = y + coverage.height() < h ? y + coverage.height() : h;
+
+        if (x1 < x2 && y1 < y2) {
+            dl_blit_add_mask(ret.bits() + (size_t)y1 * ret.bytesPerLine() + x1, ret.bytesPerLine(),
+                             coverage.constBits() + (size_t)(y1 - y) * coverage.bytesPerLine() + (x1 - x),
+                             coverage.bytesPerLine(), x2 - x1, y2 - y1);
+        }
+    }
+
+    return ret;
+}
+#endif
+
+/* The part of freshly drawn pixels which is not transparent, for pixels
+ * whose drawing leaves a lot of them empty, like text. A pixmap cannot be
+ * looked at without copying it, so all of it is taken. */
+static QRect find_bounds(const pixels_t &pixels) {
+#ifdef CDRAW_QT_IMAGE
+    int x1, y1, x2, y2;
+
+    if (pixels.isNull()) {
+        return QRect();
+    }
+
+    if (pixels.format() == QImage::Format_Alpha8) {
+        dl_blit_mask_bounds(pixels.constBits(), pixels.bytesPerLine(), pixels.width(), pixels.height(),
+                            &x1, &y1, &x2, &y2);
+    }
+    else {
+        dl_blit_bounds(pixels.constBits(), pixels.bytesPerLine(), pixels.width(), pixels.height(),
+                       &x1, &y1, &x2, &y2);
+    }
+
+    return QRect(x1, y1, x2 - x1, y2 - y1);
+#else
+    return QRect(0, 0, pixels.width(), pixels.height());
+#endif
+}
+
+/* Hands out the text from the text cache, drawing it the first time it is
+ * asked for. width is -1 for a single line, 0 to break lines only at line
+ * breaks, or the width to wrap lines at. */
+static node_t *get_text(const char* text, int size, color_t color, const char* font, unsigned char bold, unsigned char italics, int width) {
+    QByteArray fontKey, key;
+    QImage::Format format;
+    text_entry_t *cached, *entry;
+    font_entry_t *fnt;
+    node_t *node;
+    QRect rect;
+    int w, h, count, flags;
+
+    fontKey = font_key(font, size, bold, italics);
+
+    /* Text drawn in one text format is not handed out in another */
+    format = textFormat;
+
+    key = fontKey;
+    key.append((const char*)&color, sizeof(color));
+    key.append((const char*)&width, sizeof(width));
+    key.append((const char*)&format, sizeof(format));
+    key.append(text);
+
+    QMutexLocker locker(&textLock);
+
+    cached = textCache.object(key);
+
+    if (cached != NULL) {
+        textStats.hits++;
+        node = new_image(cached->pixels);
+        node->bounds = cached->bounds;
+        node->mask = cached->mask;
+        node->color = QColor(color.r, color.g, color.b);
+
+        return node;
+    }
+
+    textStats.misses++;
+
+    STATS_BEGIN(STAT_FONT_LOOKUP);
+    fnt = get_font(fontKey, font, size, bold, italics);
+    QFont fn = fnt->font;
 
     /* Get our font size so we know how big to make our surface */
-    w = fm.horizontalAdvance(QString(text));
-    h = fm.height();
+    if (width < 0) {
+        flags = Qt::TextSingleLine;
+        w = fnt->metrics.horizontalAdvance(QString(text));
+        h = fnt->metrics.height();
+    }
+    else {
+        flags = width > 0 ? Qt::TextWordWrap : 0;
+        rect = fnt->metrics.boundingRect(0, 0, width, 0, flags, QString(text));
+        w = rect.width();
+        h = rect.height();
+    }
+    STATS_END(STAT_FONT_LOOKUP);
 
-    QPixmap *ret;
+    locker.unlock();
 
-    ret = new QPixmap(w, h);
-    ret->fill(QColor("transparent"));
+    STATS_BEGIN(STAT_TEXT_DRAW);
+    STATS_PIXELS((unsigned long long)w * h);
 
-    QPainter p(ret);
-    p.setFont(fn);
-    p.setPen(QColor(color.r, color.g, color.b));
-    p.drawText(0, 0, w, h, Qt::TextSingleLine, QString(text));
+    pixels_t ret;
 
-    return (void*)ret;
+#ifdef CDRAW_QT_IMAGE
+    if (width < 0 && w > 0 && h > 0) {
+        ret = draw_glyphs(fontKey, fn, text, font, size, bold, italics, w, h);
+    }
+
+    /* The coverage is all a mask needs, anything else is tinted with it */
+    if (!ret.isNull() && format != QImage::Format_Alpha8) {
+        pixels_t tinted = new_pixels(w, h, 1);
+
+        dl_blit_mask(tinted.bits(), tinted.bytesPerLine(), ret.constBits(), ret.bytesPerLine(),
+                     QColor(color.r, color.g, color.b).rgba(), w, h);
+        ret = tinted;
+    }
+#endif
+
+    if (ret.isNull()) {
+        ret = new_pixels(w, h, 1);
+
+        QPainter p(&ret);
+        p.setFont(fn);
+        p.setPen(QColor(color.r, color.g, color.b));
+        p.drawText(0, 0, w, h, flags, QString(text));
+        p.end();
+
+#ifdef CDRAW_QT_IMAGE
+        /* Only the coverage is kept, the alpha of what was just drawn */
+        if (format == QImage::Format_Alpha8 && !ret.isNull()) {
+            ret = std::move(ret).convertToFormat(QImage::Format_Alpha8);
+        }
+#endif
+    }
+
+    /* Most of a line of text is the space around the glyphs */
+    node = new_image(ret);
+    node->bounds = find_bounds(ret);
+    node->color = QColor(color.r, color.g, color.b);
+#ifdef CDRAW_QT_IMAGE
+    node->mask = ret.format() == QImage::Format_Alpha8;
+#endif
+
+    STATS_END(STAT_TEXT_DRAW);
+
+    entry = new text_entry_t;
+    entry->pixels = ret;
+    entry->bounds = node->bounds;
+    entry->mask = node->mask;
+
+    locker.relock();
+
+    /* QCache evicts on its own, so count how many entries went away */
+    count = textCache.size();
+
+    if (textCache.insert(key, entry, cache_cost(node_bytes(node)))) {
+        textStats.evictions += count + 1 - textCache.size();
+    }
+
+    locker.unlock();
+
+    return node;
+}
+
+/* Creates a new surface with the given text drawn on it with the given font 
+ * and font size and color used. Surfaces for text that was drawn before are
+ * shared out of the text cache. */
+extern "C" surface *DL_text(const char* text, int size, color_t color, const char* font, unsigned char bold, unsigned char italics) {
+    node_t *node;
+
+    STATS_BEGIN(STAT_TEXT);
+    node = get_text(text, size, color, font, bold, italics, -1);
+    STATS_END(STAT_TEXT);
+
+    return (void*)arena_add(node);
+}
+
+/* Creates a new surface with the given text drawn on it as a paragraph,
+ * breaking lines at its line breaks and, if maxWidth is above 0, between
+ * words so no line is wider than maxWidth. A word wider than maxWidth gets a
+ * line of its own. Paragraphs are shared out of the text cache too. */
+extern "C" surface *DL_paragraph(const char* text, int size, color_t color, const char* font, unsigned char bold, unsigned char italics, int maxWidth) {
+    node_t *node;
+
+    STATS_BEGIN(STAT_PARAGRAPH);
+    node = get_text(text, size, color, font, bold, italics, maxWidth > 0 ? maxWidth : 0);
+    STATS_END(STAT_PARAGRAPH);
+
+    return (void*)arena_add(node);
+}
+
+/* Fills in metrics[i] with the size of the surface DL_text would draw
+ * texts[i] on, and the ascent and descent of the font, for count texts in
+ * the same font. The font is looked up once for all of them and nothing is
+ * drawn. */
+extern "C" void DL_text_measure_batch(const char* const* texts, int count, int size, const char* font, unsigned char bold, unsigned char italics, text_metrics_t *metrics) {
+    font_entry_t *fnt;
+    int i;
+
+    STATS_BEGIN(STAT_TEXT_MEASURE);
+
+    QByteArray fontKey = font_key(font, size, bold, italics);
+
+    QMutexLocker locker(&textLock);
+
+    STATS_BEGIN(STAT_FONT_LOOKUP);
+    fnt = get_font(fontKey, font, size, bold, italics);
+    STATS_END(STAT_FONT_LOOKUP);
+
+    for (i = 0; i < count; i++) {
+        metrics[i].width = fnt->metrics.horizontalAdvance(QString(texts[i]));
+        metrics[i].height = fnt->metrics.height();
+        metrics[i].ascent = fnt->metrics.ascent();
+        metrics[i].descent = metrics[i].height - metrics[i].ascent;
+    }
+
+    locker.unlock();
+
+    STATS_END(STAT_TEXT_MEASURE);
+}
+
+/* Fills in metrics with the size of the surface DL_text would draw text on,
+ * and the ascent and descent of the font, without drawing anything */
+extern "C" void DL_text_measure(const char* text, int size, const char* font, unsigned char bold, unsigned char italics, text_metrics_t *metrics) {
+    DL_text_measure_batch(&text, 1, size, font, bold, italics, metrics);
+}
+
+/* Sets how many bytes of finished text surfaces and cached glyph coverage
+ * the text cache may hold. Setting it to 0 turns the cache off. The default
+ * is 16MB. */
+extern "C" void DL_text_cache_set_budget(size_t bytes) {
+    QMutexLocker locker(&textLock);
+
+    textStats.budget = bytes;
+    fit_text();
+}
+
+/* Fills in stats with the text cache's hit and miss counters and how many
+ * bytes it currently holds. */
+extern "C" void DL_text_cache_get_stats(text_cache_stats_t *stats) {
+    QMutexLocker locker(&textLock);
+
+    textStats.bytes = textCache.totalCost();
+#ifdef CDRAW_QT_IMAGE
+    textStats.bytes += glyphBytes;
+#endif
+    *stats = textStats;
+}
+
+/* Empties the text and font caches and resets the counters. Surfaces handed
+ * out from the cache stay valid. */
+extern "C" void DL_text_cache_clear(void) {
+    QMutexLocker locker(&textLock);
+
+    textCache.clear();
+
+    qDeleteAll(fonts);
+    fonts.clear();
+
+#ifdef CDRAW_QT_IMAGE
+    glyphBytes = 0;
+    fit_text();
+#endif
+
+    textStats.hits = 0;
+    textStats.misses = 0;
+    textStats.evictions = 0;
 }
 
 /* Overlays the front surface over the back surface, aligned at the middle */
 extern "C" surface *DL_overlay (surface *b, surface *f) {
-    QPixmap *ret;
+    child_t children[2];
     int backW, backH, frontW, frontH;
     int newWidth, newHeight;
     int x, y;
-    QPixmap *back = (QPixmap*)b;
-    QPixmap *front = (QPixmap*)f;
+    node_t *back = (node_t*)b;
+    node_t *front = (node_t*)f;
+    node_t *ret;
+    int params[] = { MEMO_OVERLAY, lazyMode, opaqueFormat };
+    surface *inputs[] = { b, f };
+
+    STATS_BEGIN(STAT_OVERLAY);
+
+    ret = memo_get(params, 3, inputs, 2);
+
+    if (ret != NULL) {
+        STATS_END(STAT_OVERLAY);
+        return (void*)arena_add(ret);
+    }
 
     /* Get the width and height of the back, then make sure the new height and 
      * width of the new image is the larger height and the larger width */
-    backW = back->width();
-    backH = back->height();
-    frontW = front->width();
-    frontH = front->height();
+    backW = back->width;
+    backH = back->height;
+    frontW = front->width;
+    frontH = front->height;
 
     if(frontW > backW) {
         newWidth = frontW;
@@ -253,35 +2081,1439 @@ extern "C" surface *DL_overlay (surface *b, surface *f) {
         newHeight = backH;
     }
 
-    ret = new QPixmap(newWidth, newHeight);
-    ret->fill(QColor("transparent"));
-
-    QPainter p(ret);
-
     x = (newWidth / 2.0) - (backW / 2.0);
     y = (newHeight / 2.0) - (backH / 2.0);
 
-    p.drawPixmap(x, y, *back);
+    children[0].surf = back;
+    children[0].x = x;
+    children[0].y = y;
 
     x = (newWidth / 2.0) - (frontW / 2.0);
     y = (newHeight / 2.0) - (frontH / 2.0);
 
-    p.drawPixmap(x, y, *front);
+    children[1].surf = front;
+    children[1].x = x;
+    children[1].y = y;
 
-    return (void*)ret;
+    ret = compose(newWidth, newHeight, children, 2);
+
+    memo_put(params, 3, inputs, 2, ret);
+
+    STATS_END(STAT_OVERLAY);
+
+    return (void*)arena_add(ret);
 }
 
-/* Get the width of the surface */
-extern "C" int DL_get_width(surface *surf) {
-    return ((QPixmap*)surf)->width();
+/* Creates a new surface with all count surfaces drawn beside each other from
+ * left to right, aligned as per align. The result is drawn in one go, so
+ * this is much cheaper than chaining DL_beside_align. Centered surfaces are
+ * centered against the whole result, which can put them a pixel away from
+ * where chained calls would.
+ *
+ * Alignments are either TOP, BOTTOM, or CENTER */
+extern "C" surface *DL_beside_n (surface **surfs, int count, align_t align) {
+    node_t **nodes = (node_t**)surfs;
+    node_t *ret;
+    int params[] = { MEMO_BESIDE_N, lazyMode, opaqueFormat, align };
+    QVector<child_t> children(count);
+    int newWidth, newHeight;
+    int x, i, h;
+
+    STATS_BEGIN(STAT_BESIDE_N);
+
+    ret = memo_get(params, 4, surfs, count);
+
+    if (ret != NULL) {
+        STATS_END(STAT_BESIDE_N);
+        return (void*)arena_add(ret);
+    }
+
+    /* The new width is the sum of all the widths, and the height is the
+     * height of the tallest surface */
+    newWidth = 0;
+    newHeight = 0;
+
+    for (i = 0; i < count; i++) {
+        newWidth += nodes[i]->width;
+
+        if (nodes[i]->height > newHeight) {
+            newHeight = nodes[i]->height;
+        }
+    }
+
+    x = 0;
+
+    for (i = 0; i < count; i++) {
+        h = nodes[i]->height;
+
+        children[i].surf = nodes[i];
+        children[i].x = x;
+
+        if (align == TOP)           children[i].y = 0;
+        else if(align == BOTTOM)    children[i].y = newHeight - h;
+        else                        children[i].y = (newHeight / 2.0) - (h / 2.0);
+
+        x += nodes[i]->width;
+    }
+
+    ret = compose(newWidth, newHeight, children.data(), count);
+
+    memo_put(params, 4, surfs, count, ret);
+
+    STATS_END(STAT_BESIDE_N);
+
+    return (void*)arena_add(ret);
 }
 
-/* Get the height of the surface */
-extern "C" int DL_get_height(surface *surf) {
-    return ((QPixmap*)surf)->height();
+/* Creates a new surface with all count surfaces drawn above each other from
+ * top to bottom, aligned as per align. The result is drawn in one go, so
+ * this is much cheaper than chaining DL_above_align. Centered surfaces are
+ * centered against the whole result, which can put them a pixel away from
+ * where chained calls would.
+ *
+ * Alignments are either LEFT, RIGHT, or CENTER */
+extern "C" surface *DL_above_n (surface **surfs, int count, align_t align) {
+    node_t **nodes = (node_t**)surfs;
+    node_t *ret;
+    int params[] = { MEMO_ABOVE_N, lazyMode, opaqueFormat, align };
+    QVector<child_t> children(count);
+    int newWidth, newHeight;
+    int y, i, w;
+
+    STATS_BEGIN(STAT_ABOVE_N);
+
+    ret = memo_get(params, 4, surfs, count);
+
+    if (ret != NULL) {
+        STATS_END(STAT_ABOVE_N);
+        return (void*)arena_add(ret);
+    }
+
+    newWidth = 0;
+    newHeight = 0;
+
+    for (i = 0; i < count; i++) {
+        newHeight += nodes[i]->height;
+
+        if (nodes[i]->width > newWidth) {
+            newWidth = nodes[i]->width;
+        }
+    }
+
+    y = 0;
+
+    for (i = 0; i < count; i++) {
+        w = nodes[i]->width;
+
+        children[i].surf = nodes[i];
+        children[i].y = y;
+
+        if (align == LEFT)          children[i].x = 0;
+        else if(align == RIGHT)     children[i].x = newWidth - w;
+        else                        children[i].x = (newWidth / 2.0) - (w / 2.0);
+
+        y += nodes[i]->height;
+    }
+
+    ret = compose(newWidth, newHeight, children.data(), count);
+
+    memo_put(params, 4, surfs, count, ret);
+
+    STATS_END(STAT_ABOVE_N);
+
+    return (void*)arena_add(ret);
 }
 
-/* Free the surface */
-extern "C" void DL_free_surface(surface *surf) {
-    delete (QPixmap*)surf;
+/* Overlays all count surfaces on top of each other, aligned at the middle.
+ * The first surface is at the back and the last one is at the front. Like
+ * DL_overlay, but drawn in one go. */
+extern "C" surface *DL_overlay_n (surface **surfs, int count) {
+    node_t **nodes = (node_t**)surfs;
+    node_t *ret;
+    int params[] = { MEMO_OVERLAY_N, lazyMode, opaqueFormat };
+    QVector<child_t> children(count);
+    int newWidth, newHeight;
+    int i;
+
+    STATS_BEGIN(STAT_OVERLAY_N);
+
+    ret = memo_get(params, 3, surfs, count);
+
+    if (ret != NULL) {
+        STATS_END(STAT_OVERLAY_N);
+        return (void*)arena_add(ret);
+    }
+
+    newWidth = 0;
+    newHeight = 0;
+
+    for (i = 0; i < count; i++) {
+        if (nodes[i]->width > newWidth) {
+            newWidth = nodes[i]->width;
+        }
+
+        if (nodes[i]->height > newHeight) {
+            newHeight = nodes[i]->height;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        children[i].surf = nodes[i];
+        children[i].x = (newWidth / 2.0) - (nodes[i]->width / 2.0);
+        children[i].y = (newHeight / 2.0) - (nodes[i]->height / 2.0);
+    }
+
+    ret = compose(newWidth, newHeight, children.data(), count);
+
+    memo_put(params, 3, surfs, count, ret);
+
+    STATS_END(STAT_OVERLAY_N);
+
+    return (void*)arena_add(ret);
+}
+
+/* Creates a new surface with rows * cols cells laid out in a grid. cells is
+ * row major, so the cell at row r and column c is cells[r * cols + c], and a
+ * cell may be NULL to leave it blank. Every column is as wide as its widest
+ * cell and every row as tall as its tallest cell. Within its row a cell is
+ * aligned by rowAlign[r], TOP, BOTTOM, or CENTER, and within its column by
+ * colAlign[c], LEFT, RIGHT, or CENTER. Either array may be NULL to center
+ * everything that way. The whole grid is drawn into the result in one go. */
+extern "C" surface *DL_grid (surface **cells, int rows, int cols, align_t *rowAlign, align_t *colAlign) {
+    node_t **nodes = (node_t**)cells;
+    node_t *cell;
+    node_t *ret;
+    QVector<int> params;
+    QVector<child_t> children;
+    QVector<int> colX(cols + 1, 0), rowY(rows + 1, 0);
+    child_t child;
+    int r, c, w, h;
+    align_t align;
+
+    STATS_BEGIN(STAT_GRID);
+
+    /* The alignments are part of the call, when there are any */
+    params.append(MEMO_GRID);
+    params.append(lazyMode);
+    params.append(opaqueFormat);
+    params.append(rows);
+    params.append(cols);
+    params.append(rowAlign != NULL);
+    params.append(colAlign != NULL);
+
+    for (r = 0; rowAlign != NULL && r < rows; r++)  params.append(rowAlign[r]);
+    for (c = 0; colAlign != NULL && c < cols; c++)  params.append(colAlign[c]);
+
+    ret = memo_get(params.constData(), params.size(), cells, rows * cols);
+
+    if (ret != NULL) {
+        STATS_END(STAT_GRID);
+        return (void*)arena_add(ret);
+    }
+
+    /* colX and rowY hold where each column and row starts, with one extra
+     * entry at the end for where the grid ends. Start by finding the size of
+     * each column and row, then add them up. */
+    for (r = 0; r < rows; r++) {
+        for (c = 0; c < cols; c++) {
+            cell = nodes[r * cols + c];
+
+            if (cell == NULL) {
+                continue;
+            }
+
+            if (cell->width > colX[c + 1])     colX[c + 1] = cell->width;
+            if (cell->height > rowY[r + 1])    rowY[r + 1] = cell->height;
+        }
+    }
+
+    for (c = 0; c < cols; c++)  colX[c + 1] += colX[c];
+    for (r = 0; r < rows; r++)  rowY[r + 1] += rowY[r];
+
+    children.reserve(rows * cols);
+
+    for (r = 0; r < rows; r++) {
+        for (c = 0; c < cols; c++) {
+            cell = nodes[r * cols + c];
+
+            if (cell == NULL) {
+                continue;
+            }
+
+            w = colX[c + 1] - colX[c];
+            h = rowY[r + 1] - rowY[r];
+
+            child.surf = cell;
+
+            align = colAlign ? colAlign[c] : CENTER;
+
+            if (align == LEFT)          child.x = colX[c];
+            else if(align == RIGHT)     child.x = colX[c] + w - cell->width;
+            else                        child.x = colX[c] + (int)((w / 2.0) - (cell->width / 2.0));
+
+            align = rowAlign ? rowAlign[r] : CENTER;
+
+            if (align == TOP)           child.y = rowY[r];
+            else if(align == BOTTOM)    child.y = rowY[r] + h - cell->height;
+            else                        child.y = rowY[r] + (int)((h / 2.0) - (cell->height / 2.0));
+
+            children.append(child);
+        }
+    }
+
+    ret = compose(colX[cols], rowY[rows], children.data(), children.size());
+
+    memo_put(params.constData(), params.size(), cells, rows * cols, ret);
+
+    STATS_END(STAT_GRID);
+
+    return (void*)arena_add(ret);
+}
+
+#ifdef CDRAW_QT_IMAGE
+/* Called by QImage once the last copy of a crop is gone, to let go of the
+ * image it was cut from */
+static void release_parent(void *data) {
+    delete (QImage*)data;
+}
+
+/* The width by height part of image at x, y, reading the pixels of image in
+ * place. Returns a null image when the part does not start on a 4 byte
+ * boundary of its rows, which QImage needs of the pixels it is given. */
+static QImage view_pixels(const QImage &image, int x, int y, int width, int height) {
+    int offset = x * image.depth() / 8;
+
+    if (image.depth() % 8 != 0 || offset % 4 != 0) {
+        return QImage();
+    }
+
+    /* The data is const, so anything drawing on the crop gets a copy of its
+     * own rather than changing image */
+    return QImage(image.constBits() + (size_t)y * image.bytesPerLine() + offset, width, height,
+                  image.bytesPerLine(), image.format(), release_parent, new QImage(image));
+}
+#endif
+
+/* Creates a node showing the width by height part of node at x, y, which
+ * paints node clipped to that part */
+static node_t *view_node(node_t *node, int x, int y, int width, int height) {
+    node_t *ret;
+    child_t child;
+
+    ret = new_node(NODE_VIEW, width, height);
+    ret->opaque = node->opaque;
+    ret->bounds = node->bounds.intersected(QRect(x, y, width, height)).translated(-x, -y);
+
+    child.surf = retain_node(node);
+    child.x = -x;
+    child.y = -y;
+    child.hidden = 0;
+
+    ret->children.append(child);
+
+    return ret;
+}
+
+/* Creates a new surface showing the width by height part of surf whose top
+ * left corner is at x, y, clipped to surf. No pixels are copied, the result
+ * reads them out of surf, which it keeps alive. */
+extern "C" surface *DL_crop (surface *surf, int x, int y, int width, int height) {
+    node_t *node = (node_t*)surf;
+    node_t *ret;
+    int params[] = { MEMO_CROP, x, y, width, height };
+
+    STATS_BEGIN(STAT_CROP);
+
+    ret = memo_get(params, 5, &surf, 1);
+
+    if (ret != NULL) {
+        STATS_END(STAT_CROP);
+        return (void*)arena_add(ret);
+    }
+
+    if (x < 0) {
+        width += x;
+        x = 0;
+    }
+
+    if (y < 0) {
+        height += y;
+        y = 0;
+    }
+
+    if (width > node->width - x)      width = node->width - x;
+    if (height > node->height - y)    height = node->height - y;
+    if (width < 0)                    width = 0;
+    if (height < 0)                   height = 0;
+
+    ret = NULL;
+
+    if (x == 0 && y == 0 && width == node->width && height == node->height) {
+        ret = retain_node(node);
+    }
+    else if (width == 0 || height == 0 || node->kind == NODE_EMPTY) {
+        ret = new_node(NODE_EMPTY, width, height);
+    }
+    else if (node->kind == NODE_SOLID) {
+        ret = new_node(NODE_SOLID, width, height);
+        ret->color = node->color;
+        ret->opaque = 1;
+    }
+#ifdef CDRAW_QT_IMAGE
+    else if (node->kind == NODE_IMAGE) {
+        QImage pixels = view_pixels(node->pixels, x, y, width, height);
+
+        if (!pixels.isNull()) {
+            ret = new_image(pixels);
+            ret->opaque = node->opaque;
+            ret->mask = node->mask;
+            ret->color = node->color;
+            ret->bounds = node->bounds.intersected(QRect(x, y, width, height)).translated(-x, -y);
+        }
+    }
+#endif
+
+    if (ret == NULL) {
+        ret = view_node(node, x, y, width, height);
+    }
+
+    memo_put(params, 5, &surf, 1, ret);
+
+    STATS_END(STAT_CROP);
+
+    return (void*)arena_add(ret);
+}
+
+/* Creates a new surface with surf in it and left, top, right and bottom
+ * pixels of transparent space around it. Negative amounts are taken as 0.
+ * No pixels are copied or allocated. */
+extern "C" surface *DL_pad (surface *surf, int left, int top, int right, int bottom) {
+    node_t *node = (node_t*)surf;
+    node_t *ret;
+    child_t child;
+    int params[5];
+
+    if (left < 0)      left = 0;
+    if (top < 0)       top = 0;
+    if (right < 0)     right = 0;
+    if (bottom < 0)    bottom = 0;
+
+    params[0] = MEMO_PAD;
+    params[1] = left;
+    params[2] = top;
+    params[3] = right;
+    params[4] = bottom;
+
+    STATS_BEGIN(STAT_PAD);
+
+    ret = memo_get(params, 5, &surf, 1);
+
+    if (ret != NULL) {
+        STATS_END(STAT_PAD);
+        return (void*)arena_add(ret);
+    }
+
+    /* The space around is transparent, so surf is kept as it is in a group
+     * rather than drawn into a bigger image */
+    if (left == 0 && top == 0 && right == 0 && bottom == 0) {
+        ret = retain_node(node);
+    }
+    else {
+        child.surf = retain_node(node);
+        child.x = left;
+        child.y = top;
+        child.hidden = 0;
+
+        ret = new_node(NODE_GROUP, node->width + left + right, node->height + top + bottom);
+        ret->bounds = node->bounds.translated(left, top);
+        ret->children.append(child);
+    }
+
+    memo_put(params, 5, &surf, 1, ret);
+
+    STATS_END(STAT_PAD);
+
+    return (void*)arena_add(ret);
+}
+
+/* Get the width of the surface */
+extern "C" int DL_get_width(surface *surf) {
+    return ((node_t*)surf)->width;
+}
+
+/* Get the height of the surface */
+extern "C" int DL_get_height(surface *surf) {
+    return ((node_t*)surf)->height;
+}
+
+/* Free the surface. Surfaces are reference counted, this drops one
+ * reference and the surface goes away once the last one is dropped. */
+extern "C" void DL_free_surface(surface *surf) {
+    STATS_BEGIN(STAT_FREE_SURFACE);
+    release_node((node_t*)surf);
+    STATS_END(STAT_FREE_SURFACE);
+}
+
+/* Takes another reference to the surface and returns it. Each reference is
+ * dropped with its own call to DL_free_surface. */
+extern "C" surface *DL_retain_surface(surface *surf) {
+    return (void*)retain_node((node_t*)surf);
+}
+
+/* Turns lazy composition on or off. While lazy mode is on, DL_beside_align,
+ * DL_above_align and DL_overlay do not draw anything, they return a small
+ * node which remembers its children and where they go. The pixels are only
+ * produced once, when the final surface is passed to DL_render. Lazy mode is
+ * off by default. */
+extern "C" void DL_set_lazy(unsigned char lazy) {
+    lazyMode = lazy;
+}
+
+/* Sets what DL_text keeps text in, ARGB32 or an Alpha8 mask which its color
+ * is filled through wherever it is drawn. Text already in the text cache
+ * keeps the format it was drawn in. */
+extern "C" void DL_set_text_format(format_t format) {
+    textFormat = format == FORMAT_A8 ? QImage::Format_Alpha8 : QImage::Format_ARGB32_Premultiplied;
+}
+
+/* Sets what opaque images are kept in once drawn, ARGB32, RGB32 or RGB16 */
+extern "C" void DL_set_opaque_format(format_t format) {
+    switch (format) {
+    case FORMAT_RGB24:
+        opaqueFormat = QImage::Format_RGB32;
+        break;
+
+    case FORMAT_RGB16_565:
+        opaqueFormat = QImage::Format_RGB16;
+        break;
+
+    default:
+        opaqueFormat = QImage::Format_ARGB32_Premultiplied;
+        break;
+    }
+}
+
+/* Returns the format the pixels of the surface are kept in */
+extern "C" format_t DL_get_format(surface *surf) {
+#ifdef CDRAW_QT_IMAGE
+    node_t *node = (node_t*)surf;
+
+    if (node->kind == NODE_IMAGE) {
+        switch (node->pixels.format()) {
+        case QImage::Format_RGB32:
+            return FORMAT_RGB24;
+
+        case QImage::Format_Alpha8:
+            return FORMAT_A8;
+
+        case QImage::Format_RGB16:
+            return FORMAT_RGB16_565;
+
+        default:
+            break;
+        }
+    }
+#else
+    (void)surf;
+#endif
+
+    return FORMAT_ARGB32;
+}
+
+/* Draws node into a new image surface of its own. With keep set the image
+ * is handed back to be kept, so it is left in format, the format opaque
+ * images are kept in, otherwise it is always ARGB32. */
+static node_t *render(node_t *node, int keep, QImage::Format format) {
+    node_t *ret;
+    child_t child;
+
+    child.surf = node;
+    child.x = 0;
+    child.y = 0;
+    child.hidden = 0;
+
+    pixels_t pixels = paint_children(node->width, node->height, &child, 1, !node->opaque);
+
+    ret = new_image(keep ? pack_pixels(std::move(pixels), node->opaque, format) : pixels);
+    ret->opaque = node->opaque;
+    ret->bounds = node->bounds;
+
+    return ret;
+}
+
+/* Draws the given surface, and everything it was composed from, into a new
+ * image. This is where a surface built in lazy mode actually gets its
+ * pixels. */
+extern "C" surface *DL_render(surface *surf) {
+    node_t *ret;
+
+    STATS_BEGIN(STAT_RENDER);
+    ret = render((node_t*)surf, 1, opaqueFormat);
+    STATS_END(STAT_RENDER);
+
+    return (void*)arena_add(ret);
+}
+
+/* Sets how many threads are used to draw large images, counting the calling
+ * thread. 1, the default, draws everything on the calling thread. 0 uses
+ * one thread per core. The output is the same either way. Only builds with
+ * CDRAW_QT_IMAGE use more than one thread. Pixmaps are only safe to paint on
+ * the GUI thread, so other builds draw everything on the calling thread,
+ * DL_render_async included. */
+extern "C" void DL_set_threads(int count) {
+    if (count <= 0) {
+        count = QThread::idealThreadCount();
+    }
+
+    threadCount.storeRelease(count > 0 ? count : 1);
+}
+
+#ifdef CDRAW_QT_IMAGE
+/* Renders asked for with DL_render_async run on a pool of their own, which
+ * starts them in the order they were asked for. A pending surface can only
+ * be made from a future which already exists, so a render only ever waits
+ * on renders started before it, and the threads cannot end up all waiting
+ * on each other. Pixmaps are only safe to paint on the GUI thread, so
+ * builds without CDRAW_QT_IMAGE render on the calling thread instead. */
+static QThreadPool renderPool;
+
+class render_worker_t : public QRunnable {
+public:
+    render_worker_t(future_t *future) : future(future) {}
+
+    void run() override {
+        node_t *result, *source;
+
+        STATS_BEGIN(STAT_RENDER);
+        result = render(future->source, 1, future->opaqueFormat);
+        STATS_END(STAT_RENDER);
+
+        renderLock.lock();
+
+        source = future->source;
+        future->source = NULL;
+        future->result = result;
+        renderDone.wakeAll();
+
+        renderLock.unlock();
+
+        /* The tree may be large, and nothing needs it any more */
+        release_node(source);
+        release_future(future);
+    }
+
+private:
+    future_t *future;
+};
+#endif
+
+/* Starts drawing the given surface, and everything it was composed from,
+ * on a render thread, and returns straight away. The future holds its own
+ * reference on the surface. Without CDRAW_QT_IMAGE the surface is drawn
+ * before returning, and the future is done straight away. */
+extern "C" future_t *DL_render_async(surface *surf) {
+    future_t *future;
+
+    STATS_BEGIN(STAT_RENDER_ASYNC);
+
+    future = new future_t;
+    STATS_ALLOC(sizeof(future_t));
+
+#ifdef CDRAW_QT_IMAGE
+    /* One reference for the caller and one for the render thread */
+    future->refs = 2;
+    future->source = retain_node((node_t*)surf);
+    future->result = NULL;
+    future->opaqueFormat = opaqueFormat;
+
+    renderPool.setMaxThreadCount(threadCount.loadAcquire());
+    renderPool.start(new render_worker_t(future));
+#else
+    future->refs = 1;
+    future->source = NULL;
+    future->opaqueFormat = opaqueFormat;
+
+    STATS_BEGIN(STAT_RENDER);
+    future->result = render((node_t*)surf, 1, opaqueFormat);
+    STATS_END(STAT_RENDER);
+#endif
+
+    STATS_END(STAT_RENDER_ASYNC);
+
+    return future;
+}
+
+/* Whether the render is done, so DL_future_wait will not block */
+extern "C" int DL_future_ready(future_t *future) {
+    QMutexLocker locker(&renderLock);
+
+    return future->result != NULL;
+}
+
+/* Waits for the render to be done and returns the image it drew */
+extern "C" surface *DL_future_wait(future_t *future) {
+    node_t *node;
+
+    STATS_BEGIN(STAT_FUTURE_WAIT);
+    node = retain_node(wait_future(future));
+    STATS_END(STAT_FUTURE_WAIT);
+
+    return (void*)arena_add(node);
+}
+
+/* Returns a surface the size of the image the render will draw, which can be
+ * composed like any other while the render is still running. Only drawing
+ * it waits for the render. Once the render is done it is simply the image. */
+extern "C" surface *DL_future_get_surface(future_t *future) {
+    node_t *ret, *source;
+
+    STATS_BEGIN(STAT_FUTURE_GET_SURFACE);
+
+    renderLock.lock();
+
+    if (future->result != NULL) {
+        ret = retain_node(future->result);
+        renderLock.unlock();
+
+        STATS_END(STAT_FUTURE_GET_SURFACE);
+        return (void*)arena_add(ret);
+    }
+
+    source = retain_node(future->source);
+
+    renderLock.unlock();
+
+    ret = new_node(NODE_PENDING, source->width, source->height);
+    ret->opaque = source->opaque;
+    ret->bounds = source->bounds;
+
+    future->refs.ref();
+    ret->future = future;
+
+    release_node(source);
+
+    STATS_END(STAT_FUTURE_GET_SURFACE);
+
+    return (void*)arena_add(ret);
+}
+
+/* Drops the caller's reference to the future. A render still running is
+ * finished regardless, and what it drew goes once nothing refers to it. */
+extern "C" void DL_future_free(future_t *future) {
+    release_future(future);
+}
+
+/* Surfaces may be shared, by other references, by the text cache, or by the
+ * surfaces composed from them, so they must not be drawn on directly. This
+ * takes over the caller's reference to surf and returns an image surface
+ * which the caller is the only owner of and may draw on. If surf already is
+ * such a surface it is returned as is, otherwise it is copied. A surface
+ * owned by an arena must be retained before it is passed in, and what comes
+ * back is never owned by an arena. The pixels inside are only actually
+ * copied once they are drawn on, QPixmap and QImage take care of that for
+ * us. */
+extern "C" surface *DL_make_writable(surface *surf) {
+    node_t *node = (node_t*)surf;
+    node_t *ret;
+
+    STATS_BEGIN(STAT_MAKE_WRITABLE);
+
+    /* Whatever the caller draws may not be opaque. Masks are handed back
+     * drawn in their color. */
+    if (node->kind == NODE_IMAGE && !node->mask && node->refs.loadAcquire() == 1) {
+        node->opaque = 0;
+        node->bounds = QRect(0, 0, node->width, node->height);
+        STATS_END(STAT_MAKE_WRITABLE);
+        return surf;
+    }
+
+    if (node->kind == NODE_IMAGE && !node->mask) {
+        ret = new_image(node->pixels);
+    }
+    else {
+        ret = render(node, 0, opaqueFormat);
+    }
+
+    ret->opaque = 0;
+    ret->bounds = QRect(0, 0, ret->width, ret->height);
+
+    release_node(node);
+
+    STATS_END(STAT_MAKE_WRITABLE);
+
+    return (void*)ret;
+}
+
+#ifdef CDRAW_QT_IMAGE
+/* Get the image behind an image surface, or NULL if the surface is not an
+ * image. Call DL_make_writable first if you are going to draw on it. */
+extern "C" QImage *DL_get_image(surface *surf) {
+    node_t *node = (node_t*)surf;
+
+    if (node->kind != NODE_IMAGE) {
+        return NULL;
+    }
+
+    return &node->pixels;
+}
+#else
+/* Get the pixmap behind an image surface, or NULL if the surface is not an
+ * image. Call DL_make_writable first if you are going to draw on it. */
+extern "C" QPixmap *DL_get_pixmap(surface *surf) {
+    node_t *node = (node_t*)surf;
+
+    if (node->kind != NODE_IMAGE) {
+        return NULL;
+    }
+
+    return &node->pixels;
+}
+#endif
+
+/* How many rows DL_write_png and DL_write_raw draw at a time */
+#define BAND_HEIGHT 64
+
+/* Draws node a band of rows at a time, handing each finished band to
+ * write_band. Returns -1 as soon as write_band fails. */
+static int write_bands(node_t *node, int (*write_band)(void *closure, const uchar *data, int stride, int rows), void *closure) {
+    child_t child;
+    int rows, y, ret;
+
+    QImage band = new_image_pixels(node->width, node->height < BAND_HEIGHT ? node->height : BAND_HEIGHT, 0);
+
+    if (band.isNull() && node->width > 0 && node->height > 0) {
+        return -1;
+    }
+
+    child.surf = node;
+    child.x = 0;
+    child.hidden = 0;
+    ret = 0;
+
+    for (y = 0; y < node->height && ret == 0; y += BAND_HEIGHT) {
+        rows = node->height - y < BAND_HEIGHT ? node->height - y : BAND_HEIGHT;
+
+        /* The band is reused, so clear out the last one first, unless node
+         * is opaque and covers it anyway */
+        if (!node->opaque) {
+            band.fill(Qt::transparent);
+        }
+
+        child.y = -y;
+        paint_image(band, &child, 1);
+
+        ret = write_band(closure, band.constBits(), band.bytesPerLine(), rows);
+    }
+
+    return ret;
+}
+
+static int write_fd(void *closure, const unsigned char *data, size_t length) {
+    int fd = *(int*)closure;
+    ssize_t written;
+
+    while (length > 0) {
+        written = write(fd, data, length);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        data += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+static int write_png_band(void *closure, const uchar *data, int stride, int rows) {
+    int ret;
+
+    STATS_BEGIN(STAT_PNG_ENCODE);
+    ret = dl_png_write_rows((dl_png_t*)closure, data, stride, rows);
+    STATS_END(STAT_PNG_ENCODE);
+
+    return ret;
+}
+
+/* The raw writer needs the callback and the row width to go with it */
+typedef struct raw_writer_t {
+    write_func_t write;
+    void *closure;
+    size_t rowBytes;
+} raw_writer_t;
+
+static int write_raw_band(void *closure, const uchar *data, int stride, int rows) {
+    raw_writer_t *raw = (raw_writer_t*)closure;
+    int y;
+
+    /* Rows are packed in the output, so padding at the end of each row in
+     * the band is skipped */
+    if ((size_t)stride == raw->rowBytes) {
+        return raw->write(raw->closure, data, raw->rowBytes * rows) != 0 ? -1 : 0;
+    }
+
+    for (y = 0; y < rows; y++) {
+        if (raw->write(raw->closure, data + (size_t)y * stride, raw->rowBytes) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Like DL_write_png, but the PNG is handed to write, along with closure,
+ * instead of being written to a file descriptor. */
+extern "C" int DL_write_png_stream(surface *surf, write_func_t write, void *closure) {
+    node_t *node = (node_t*)surf;
+    dl_png_t *png;
+    int ret;
+
+    STATS_BEGIN(STAT_WRITE_PNG);
+
+    png = dl_png_begin(node->width, node->height, write, closure);
+
+    if (png == NULL) {
+        STATS_END(STAT_WRITE_PNG);
+        return -1;
+    }
+
+    ret = write_bands(node, write_png_band, png);
+
+    /* Always finish, so the encoder is freed even if a band failed */
+    if (dl_png_end(png) != 0) {
+        ret = -1;
+    }
+
+    STATS_END(STAT_WRITE_PNG);
+
+    return ret;
+}
+
+/* Draws the given surface and writes it to fd as a PNG. The image is drawn
+ * and encoded a band of rows at a time, so only a band is ever held in
+ * memory, however tall the surface is. Returns 0 on success and -1 if
+ * anything could not be written. */
+extern "C" int DL_write_png(surface *surf, int fd) {
+    return DL_write_png_stream(surf, write_fd, &fd);
+}
+
+/* Like DL_write_raw, but the pixels are handed to write, along with closure,
+ * instead of being written to a file descriptor. */
+extern "C" int DL_write_raw_stream(surface *surf, write_func_t write, void *closure) {
+    node_t *node = (node_t*)surf;
+    raw_writer_t raw;
+    int ret;
+
+    STATS_BEGIN(STAT_WRITE_RAW);
+
+    raw.write = write;
+    raw.closure = closure;
+    raw.rowBytes = (size_t)node->width * 4;
+
+    ret = write_bands(node, write_raw_band, &raw);
+    STATS_END(STAT_WRITE_RAW);
+
+    return ret;
+}
+
+/* Draws the given surface and writes its raw pixels to fd, a band of rows at
+ * a time. There is no header, the rows are written top to bottom, each
+ * width * 4 bytes long, with every pixel a native endian premultiplied ARGB32
+ * value. Returns 0 on success and -1 if anything could not be written. */
+extern "C" int DL_write_raw(surface *surf, int fd) {
+    return DL_write_raw_stream(surf, write_fd, &fd);
+}
+
+/* The directory DL_disk_cache_store and DL_disk_cache_load use, if any */
+static QMutex diskLock;
+static QString diskDir;
+
+/* Sets the directory surfaces are stored in by DL_disk_cache_store and
+ * loaded from by DL_disk_cache_load. It must already exist. Several
+ * processes may share one, each file is written whole under a temporary
+ * name and then renamed into place. NULL, the default, turns the cache off. */
+extern "C" void DL_disk_cache_set_dir(const char *dir) {
+    QMutexLocker locker(&diskLock);
+
+    diskDir = dir != NULL ? QString::fromLocal8Bit(dir) : QString();
+}
+
+/* The path of the file key is stored in, or a null string if there is no
+ * cache directory */
+static QString disk_path(const char *key) {
+    char name[DL_DISK_NAME_SIZE];
+
+    dl_disk_name(name, key);
+
+    QMutexLocker locker(&diskLock);
+
+    if (diskDir.isNull()) {
+        return QString();
+    }
+
+    return diskDir + QLatin1Char('/') + QLatin1String(name);
+}
+
+static int write_save_file(void *closure, const unsigned char *data, size_t length) {
+    QSaveFile *file = (QSaveFile*)closure;
+
+    return file->write((const char*)data, (qint64)length) == (qint64)length ? 0 : -1;
+}
+
+/* Called by QImage once the last copy of a loaded image is gone. Closing
+ * the file unmaps it. */
+static void close_mapping(void *data) {
+    delete (QFile*)data;
+}
+
+/* Draws the given surface and stores it in the disk cache under key, in place
+ * of anything stored under it before. The key should name everything the
+ * surface was made from, a later DL_disk_cache_load with the same key gets
+ * these pixels back without drawing anything. Returns 0 on success and -1 if
+ * there is no cache directory or the file could not be written. */
+extern "C" int DL_disk_cache_store(surface *surf, const char *key) {
+    node_t *node = (node_t*)surf;
+    dl_disk_header_t header;
+    QString path;
+    int bounds[4], ret;
+
+    STATS_BEGIN(STAT_DISK_CACHE_STORE);
+
+    path = disk_path(key);
+
+    if (path.isNull()) {
+        STATS_END(STAT_DISK_CACHE_STORE);
+        return -1;
+    }
+
+    /* Readers only ever see a whole file, the old one or the new one */
+    QSaveFile file(path);
+
+    if (!file.open(QIODevice::WriteOnly)) {
+        STATS_END(STAT_DISK_CACHE_STORE);
+        return -1;
+    }
+
+    bounds[0] = node->bounds.x();
+    bounds[1] = node->bounds.y();
+    bounds[2] = node->bounds.width();
+    bounds[3] = node->bounds.height();
+
+    dl_disk_header_init(&header, key, node->width, node->height, node->opaque, bounds);
+
+    if (dl_disk_write_header(&header, key, write_save_file, &file) != 0 ||
+        DL_write_raw_stream(surf, write_save_file, &file) != 0) {
+        file.cancelWriting();
+        STATS_END(STAT_DISK_CACHE_STORE);
+        return -1;
+    }
+
+    ret = file.commit() ? 0 : -1;
+
+    STATS_END(STAT_DISK_CACHE_STORE);
+
+    return ret;
+}
+
+/* Returns the surface stored in the disk cache under key, or NULL if there
+ * is none. Nothing is decoded, the file is mapped read only and shared with
+ * every other process that loaded it. Built with CDRAW_QT_IMAGE the image
+ * uses the mapped pages as they are, otherwise they are copied once into a
+ * pixmap. Drawing on the image copies it first, as with any QImage. */
+extern "C" surface *DL_disk_cache_load(const char *key) {
+    dl_disk_header_t header;
+    QString path;
+    uchar *data = NULL;
+    node_t *node;
+    QFile *file;
+
+    STATS_BEGIN(STAT_DISK_CACHE_LOAD);
+
+    path = disk_path(key);
+
+    if (path.isNull()) {
+        STATS_END(STAT_DISK_CACHE_LOAD);
+        return NULL;
+    }
+
+    /* The file stays open for as long as an image uses its pages */
+    file = new QFile(path);
+
+    if (file->open(QIODevice::ReadOnly)) {
+        data = file->map(0, file->size());
+    }
+
+    if (data == NULL || dl_disk_check(data, (size_t)file->size(), key, &header) != 0) {
+        delete file;
+        STATS_END(STAT_DISK_CACHE_LOAD);
+        return NULL;
+    }
+
+    if (header.width == 0 || header.height == 0) {
+        delete file;
+        node = new_image(new_pixels(header.width, header.height, 1));
+    }
+    else {
+        /* Built on const data, so QImage copies it before anything draws */
+        QImage image((const uchar*)data + header.dataOffset, header.width, header.height,
+                     header.stride, QImage::Format_ARGB32_Premultiplied, close_mapping, file);
+
+#ifdef CDRAW_QT_IMAGE
+        node = new_image(image);
+#else
+        node = new_image(QPixmap::fromImage(image));
+#endif
+    }
+
+    node->opaque = header.opaque;
+    node->bounds = QRect(header.bounds[0], header.bounds[1], header.bounds[2], header.bounds[3]);
+
+    STATS_END(STAT_DISK_CACHE_LOAD);
+
+    return (void*)arena_add(node);
+}
+
+/* Sets how many bytes of free pixel buffers the pool may hold on to for
+ * reuse. Images of about the same size as one freed earlier reuse its buffer
+ * rather than allocating a new one. Setting it to 0 turns the pool off. The
+ * default is 32MB. */
+extern "C" void DL_pool_set_budget(size_t bytes) {
+    dl_pool_set_budget(bytes);
+}
+
+/* Fills in stats with the pool's counters */
+extern "C" void DL_pool_get_stats(pool_stats_t *stats) {
+    dl_pool_stats_t pool;
+
+    dl_pool_get_stats(&pool);
+
+    stats->requests = pool.requests;
+    stats->reuses = pool.reuses;
+    stats->bytes = pool.bytes;
+    stats->pooled = pool.pooled;
+    stats->peak = pool.peak;
+    stats->budget = pool.budget;
+}
+
+/* Frees every buffer the pool holds and resets the counters. Buffers of live
+ * surfaces are not affected. */
+extern "C" void DL_pool_clear(void) {
+    dl_pool_clear();
+}
+
+/* Opens an arena on the calling thread. Until the matching DL_arena_end, all
+ * surfaces created on that thread belong to the arena and must not be passed
+ * to DL_free_surface. Arenas nest, a surface belongs to the innermost one.
+ * This suits building a frame out of many throwaway surfaces. */
+extern "C" void DL_arena_begin(void) {
+    arena_t *next = new arena_t;
+
+    next->prev = arena;
+    arena = next;
+}
+
+/* Closes the arena last opened on the calling thread and frees every surface
+ * created while it was open. Surfaces needed afterwards must be kept with
+ * DL_retain_surface first. */
+extern "C" void DL_arena_end(void) {
+    arena_t *done = arena;
+    int i;
+
+    if (done == NULL) {
+        return;
+    }
+
+    arena = done->prev;
+
+    for (i = 0; i < done->nodes.size(); i++) {
+        release_node(done->nodes[i]);
+    }
+
+    delete done;
+}
+
+/* A composition keeps the tree it was made from next to the image it was
+ * rendered into. Swapping a leaf builds a new tree sharing everything off
+ * the path to that leaf, and notes where the leaf was as damage, so the
+ * next update only repaints those parts of the image. Past
+ * COMPOSITION_DAMAGE rectangles the damage is merged into one. */
+#define COMPOSITION_DAMAGE 16
+
+struct composition_t {
+    node_t *root;
+    node_t *image;
+
+    int damageCount;
+    rect_t damage[COMPOSITION_DAMAGE];
+};
+
+/* Grows into so it also covers r */
+static void union_rect(rect_t *into, const rect_t *r) {
+    int x2, y2;
+
+    x2 = into->x + into->width > r->x + r->width ? into->x + into->width : r->x + r->width;
+    y2 = into->y + into->height > r->y + r->height ? into->y + into->height : r->y + r->height;
+
+    into->x = into->x < r->x ? into->x : r->x;
+    into->y = into->y < r->y ? into->y : r->y;
+    into->width = x2 - into->x;
+    into->height = y2 - into->y;
+}
+
+static void add_damage(composition_t *comp, int x, int y, int width, int height) {
+    rect_t r;
+    int x2, y2, i;
+
+    /* Only what is inside the image can be repainted */
+    x2 = x + width < comp->root->width ? x + width : comp->root->width;
+    y2 = y + height < comp->root->height ? y + height : comp->root->height;
+
+    r.x = x > 0 ? x : 0;
+    r.y = y > 0 ? y : 0;
+    r.width = x2 - r.x;
+    r.height = y2 - r.y;
+
+    if (r.width <= 0 || r.height <= 0) {
+        return;
+    }
+
+    if (comp->damageCount < COMPOSITION_DAMAGE) {
+        comp->damage[comp->damageCount++] = r;
+        return;
+    }
+
+    /* Too many pieces, repaint everything they cover in one go */
+    for (i = 1; i < comp->damageCount; i++) {
+        union_rect(&comp->damage[0], &comp->damage[i]);
+    }
+
+    union_rect(&comp->damage[0], &r);
+    comp->damageCount = 1;
+}
+
+/* Adds the damage in r, as far as it is inside clip */
+static void add_clipped_damage(composition_t *comp, const QRect &clip, const QRect &r) {
+    QRect damage = r.intersected(clip);
+
+    if (!damage.isEmpty()) {
+        add_damage(comp, damage.x(), damage.y(), damage.width(), damage.height());
+    }
+}
+
+/* Returns a copy of the group or view node, drawn at x, y, with every use of
+ * old swapped for replacement, or NULL if old is nowhere under it. Groups and
+ * views which do not lead to old are shared with the original tree. Only
+ * damage inside clip shows, which views narrow to the part they show. Crops
+ * of images read the pixels in place and are leaves of their own. */
+static node_t *replace_leaf(composition_t *comp, node_t *node, node_t *old, node_t *replacement, int x, int y,
+                            const QRect &clip, int *count) {
+    node_t *ret, *child;
+    QRect inner;
+    int i, j;
+
+    if (node->kind != NODE_GROUP && node->kind != NODE_VIEW) {
+        return NULL;
+    }
+
+    inner = clip;
+
+    if (node->kind == NODE_VIEW) {
+        inner = clip.intersected(QRect(x, y, node->width, node->height));
+    }
+
+    ret = NULL;
+
+    for (i = 0; i < node->children.size(); i++) {
+        const child_t &c = node->children[i];
+
+        if (c.surf == old) {
+            child = retain_node(replacement);
+            add_clipped_damage(comp, inner, QRect(x + c.x, y + c.y, old->width, old->height));
+            (*count)++;
+        }
+        else {
+            child = replace_leaf(comp, c.surf, old, replacement, x + c.x, y + c.y, inner, count);
+        }
+
+        if (child == NULL) {
+            continue;
+        }
+
+        /* A view has the one child, show the same part of the new one */
+        if (node->kind == NODE_VIEW) {
+            ret = view_node(child, -c.x, -c.y, node->width, node->height);
+            release_node(child);
+            break;
+        }
+
+        /* First change under this group, copy it */
+        if (ret == NULL) {
+            ret = new_node(NODE_GROUP, node->width, node->height);
+            ret->children = node->children;
+
+            for (j = 0; j < ret->children.size(); j++) {
+                retain_node(ret->children[j].surf);
+            }
+        }
+
+        release_node(ret->children[i].surf);
+        ret->children[i].surf = child;
+    }
+
+    if (ret != NULL && ret->kind == NODE_GROUP) {
+        mark_hidden(ret->children.data(), ret->children.size());
+        ret->opaque = covers(ret->width, ret->height, ret->children.constData(), ret->children.size());
+        ret->bounds = children_bounds(ret->children.constData(), ret->children.size());
+    }
+
+    return ret;
+}
+
+/* Renders root into an image and keeps both, so that leaves of root can be
+ * swapped later on and only the parts of the image they cover repainted.
+ * This suits panels redrawn many times a second where little changes from
+ * one frame to the next. root should be built in lazy mode, since a surface
+ * drawn eagerly no longer knows what it was made of. The composition takes
+ * its own reference on root. */
+extern "C" composition_t *DL_composition_new(surface *root) {
+    composition_t *comp;
+
+    STATS_BEGIN(STAT_COMPOSITION_NEW);
+
+    comp = new composition_t;
+    comp->root = retain_node((node_t*)root);
+    comp->image = render(comp->root, 0, opaqueFormat);
+    comp->damageCount = 0;
+
+    STATS_END(STAT_COMPOSITION_NEW);
+
+    return comp;
+}
+
+/* Returns the image the composition was last rendered into. It belongs to
+ * the composition and is only valid until the next DL_composition_update.
+ * Retain it to keep it, the composition then leaves it alone and repaints
+ * a copy instead. */
+extern "C" surface *DL_composition_get_image(composition_t *comp) {
+    return (void*)comp->image;
+}
+
+/* Swaps every use of the leaf old in the composition's tree for replacement,
+ * which must be the same size, and marks where it was as damaged. Nothing is
+ * drawn until DL_composition_update. Returns how many uses were swapped, or
+ * -1 if the sizes differ. To swap in a label of a different width, give the
+ * label a fixed size to begin with, say by overlaying it on a DL_empty. */
+extern "C" int DL_composition_replace(composition_t *comp, surface *old, surface *replacement) {
+    node_t *from = (node_t*)old;
+    node_t *to = (node_t*)replacement;
+    node_t *root;
+    int count;
+
+    if (from->width != to->width || from->height != to->height) {
+        return -1;
+    }
+
+    count = 0;
+
+    if (comp->root == from) {
+        root = retain_node(to);
+        add_damage(comp, 0, 0, from->width, from->height);
+        count = 1;
+    }
+    else {
+        QRect clip(0, 0, comp->root->width, comp->root->height);
+
+        root = replace_leaf(comp, comp->root, from, to, 0, 0, clip, &count);
+    }
+
+    if (root != NULL) {
+        release_node(comp->root);
+        comp->root = root;
+    }
+
+    return count;
+}
+
+/* Repaints the damaged parts of the composition's image. Up to max of the
+ * repainted rectangles are stored in damage, so just those parts can be
+ * uploaded, and the number stored is returned. If there were more than max
+ * of them, damage[0] is set to a rectangle covering all of them. Returns 0
+ * if nothing had changed. */
+extern "C" int DL_composition_update(composition_t *comp, rect_t *damage, int max) {
+    node_t *copy;
+    rect_t *r;
+    int i, count;
+
+    STATS_BEGIN(STAT_COMPOSITION_UPDATE);
+
+    if (comp->damageCount == 0) {
+        STATS_END(STAT_COMPOSITION_UPDATE);
+        return 0;
+    }
+
+    /* Someone kept the last image, so it must not change under them. The
+     * new node shares its pixels until the painter below detaches them. */
+    if (comp->image->refs.loadAcquire() > 1) {
+        copy = new_image(comp->image->pixels);
+        release_node(comp->image);
+        comp->image = copy;
+    }
+
+    QPainter p(&comp->image->pixels);
+
+    for (i = 0; i < comp->damageCount; i++) {
+        r = &comp->damage[i];
+
+        p.save();
+        p.setClipRect(r->x, r->y, r->width, r->height);
+
+        /* Clear the old pixels, then paint whatever is there now */
+        p.setCompositionMode(QPainter::CompositionMode_Clear);
+        p.fillRect(r->x, r->y, r->width, r->height, Qt::transparent);
+        p.setCompositionMode(QPainter::CompositionMode_SourceOver);
+
+        paint_surface(p, comp->root, 0, 0);
+
+        p.restore();
+    }
+
+    p.end();
+
+    comp->image->opaque = comp->root->opaque;
+    comp->image->bounds = comp->root->bounds;
+
+    STATS_END(STAT_COMPOSITION_UPDATE);
+
+    count = comp->damageCount;
+    comp->damageCount = 0;
+
+    if (count <= max) {
+        memcpy(damage, comp->damage, sizeof(rect_t) * count);
+        return count;
+    }
+
+    if (max < 1) {
+        return 0;
+    }
+
+    /* Merge everything into the first one */
+    damage[0] = comp->damage[0];
+
+    for (i = 1; i < count; i++) {
+        union_rect(&damage[0], &comp->damage[i]);
+    }
+
+    return 1;
+}
+
+/* Frees the composition, its tree, and its image unless it was retained */
+extern "C" void DL_composition_free(composition_t *comp) {
+    release_node(comp->root);
+    release_node(comp->image);
+    delete comp;
 }
@@ -0,0 +1,307 @@
+/* Instrumentation shared by the CDraw ports */
+
+#include "cdraw-stats.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef CDRAW_STATS
+#include <stdatomic.h>
+#include <time.h>
+#endif
+
+/* Counters for one DL_* function or backend operation, see DL_get_stats */
+typedef struct call_stats_t {
+    const char *name;
+    unsigned long calls;
+    unsigned long long bytes;
+    unsigned long long pixels;
+    unsigned long long nanoseconds;
+} call_stats_t;
+
+typedef int (*write_func_t)(void *closure, const unsigned char *data, size_t length);
+
+#ifdef CDRAW_STATS
+
+static const char *statNames[STAT_COUNT] = {
+    "DL_beside_align",
+    "DL_beside",
+    "DL_above_align",
+    "DL_above",
+    "DL_rectangle",
+    "DL_square",
+    "DL_empty",
+    "DL_text",
+    "DL_overlay",
+    "DL_beside_n",
+    "DL_above_n",
+    "DL_overlay_n",
+    "DL_grid",
+    "DL_render",
+    "DL_make_writable",
+    "DL_free_surface",
+    "DL_write_png",
+    "DL_write_raw",
+    "DL_text_measure",
+    "DL_crop",
+    "DL_pad",
+    "DL_paragraph",
+    "DL_from_buffer",
+    "DL_from_buffer_borrowed",
+    "DL_render_async",
+    "DL_future_wait",
+    "DL_future_get_surface",
+    "DL_disk_cache_store",
+    "DL_disk_cache_load",
+    "DL_write_pdf",
+    "DL_write_svg",
+    "DL_composition_new",
+    "DL_composition_update",
+    "DL_get_cairo_surface",
+
+    "new_image",
+    "paint",
+    "font_lookup",
+    "text_draw",
+    "png_encode"
+};
+
+typedef struct counter_t {
+    atomic_ulong calls;
+    atomic_ullong bytes;
+    atomic_ullong pixels;
+    atomic_ullong nanoseconds;
+} counter_t;
+
+static counter_t counters[STAT_COUNT];
+
+/* Bytes allocated and pixels composited on this thread so far. A scope
+ * counts the difference between its start and end, so each call is charged
+ * for everything under it. */
+static _Thread_local unsigned long long threadBytes = 0;
+static _Thread_local unsigned long long threadPixels = 0;
+
+/* While tracing, each scope also leaves an event behind for
+ * DL_write_trace. Events past the end of the buffer are dropped. */
+#define TRACE_EVENTS 65536
+
+typedef struct trace_event_t {
+    int id;
+    int thread;
+    unsigned long long start;
+    unsigned long long duration;
+} trace_event_t;
+
+static atomic_int tracing = 0;
+static trace_event_t *traceEvents = NULL;
+static atomic_int traceNext = 0;
+static atomic_int threadNext = 1;
+static _Thread_local int threadId = 0;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+dl_stats_scope_t dl_stats_begin(void) {
+    dl_stats_scope_t scope;
+
+    scope.bytes = threadBytes;
+    scope.pixels = threadPixels;
+    scope.start = now_ns();
+
+    return scope;
+}
+
+void dl_stats_end(stat_id_t id, const dl_stats_scope_t *scope) {
+    unsigned long long duration;
+    int slot;
+
+    duration = now_ns() - scope->start;
+
+    atomic_fetch_add_explicit(&counters[id].calls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters[id].bytes, threadBytes - scope->bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters[id].pixels, threadPixels - scope->pixels, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters[id].nanoseconds, duration, memory_order_relaxed);
+
+    if (!atomic_load_explicit(&tracing, memory_order_acquire)) {
+        return;
+    }
+
+    slot = atomic_fetch_add_explicit(&traceNext, 1, memory_order_relaxed);
+
+    if (slot >= TRACE_EVENTS) {
+        return;
+    }
+
+    if (threadId == 0) {
+        threadId = atomic_fetch_add(&threadNext, 1);
+    }
+
+    traceEvents[slot].id = id;
+    traceEvents[slot].thread = threadId;
+    traceEvents[slot].start = scope->start;
+    traceEvents[slot].duration = duration;
+}
+
+void dl_stats_alloc(unsigned long long bytes) {
+    threadBytes += bytes;
+}
+
+void dl_stats_pixels(unsigned long long pixels) {
+    threadPixels += pixels;
+}
+
+#endif
+
+/* Fills in up to count entries of stats, one for each DL_* function and
+ * backend operation, and returns how many entries there are in all. Returns
+ * 0 if CDraw was built without CDRAW_STATS. */
+int DL_get_stats(call_stats_t *stats, int count) {
+#ifdef CDRAW_STATS
+    int i;
+
+    for (i = 0; i < count && i < STAT_COUNT; i++) {
+        stats[i].name = statNames[i];
+        stats[i].calls = atomic_load_explicit(&counters[i].calls, memory_order_relaxed);
+        stats[i].bytes = atomic_load_explicit(&counters[i].bytes, memory_order_relaxed);
+        stats[i].pixels = atomic_load_explicit(&counters[i].pixels, memory_order_relaxed);
+        stats[i].nanoseconds = atomic_load_explicit(&counters[i].nanoseconds, memory_order_relaxed);
+    }
+
+    return STAT_COUNT;
+#else
+    (void)stats;
+    (void)count;
+
+    return 0;
+#endif
+}
+
+/* Sets every counter back to zero and throws away the trace events */
+void DL_reset_stats(void) {
+#ifdef CDRAW_STATS
+    int i;
+
+    for (i = 0; i < STAT_COUNT; i++) {
+        atomic_store(&counters[i].calls, 0);
+        atomic_store(&counters[i].bytes, 0);
+        atomic_store(&counters[i].pixels, 0);
+        atomic_store(&counters[i].nanoseconds, 0);
+    }
+
+    atomic_store(&traceNext, 0);
+#endif
+}
+
+/* Turns recording of trace events on or off. While on, every counted call
+ * also leaves an event behind for DL_write_trace, up to 65536 of them. Off by
+ * default. */
+void DL_set_tracing(unsigned char on) {
+#ifdef CDRAW_STATS
+    if (on && traceEvents == NULL) {
+        traceEvents = calloc(TRACE_EVENTS, sizeof(trace_event_t));
+    }
+
+    atomic_store_explicit(&tracing, on && traceEvents != NULL, memory_order_release);
+#else
+    (void)on;
+#endif
+}
+
+/* Writes the formatted text out through write, returns 0 on success */
+static int write_text(write_func_t write, void *closure, const char *format, ...) {
+    char buffer[256];
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    if (length < 0) {
+        return -1;
+    }
+
+    if ((size_t)length >= sizeof(buffer)) {
+        length = sizeof(buffer) - 1;
+    }
+
+    return write(closure, (const unsigned char*)buffer, length) != 0 ? -1 : 0;
+}
+
+/* Writes the counters out through write as a JSON object holding an array
+ * of calls, each with its name, calls, bytes, pixels and nanoseconds.
+ * Returns 0 on success and -1 if anything could not be written. */
+int DL_write_stats_json(write_func_t write, void *closure) {
+    call_stats_t stats[STAT_COUNT];
+    int count, i;
+
+    count = DL_get_stats(stats, STAT_COUNT);
+
+    if (write_text(write, closure, "{\"calls\": [") != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (write_text(write, closure,
+                       "%s\n  {\"name\": \"%s\", \"calls\": %lu, \"bytes\": %llu, "
+                       "\"pixels\": %llu, \"nanoseconds\": %llu}",
+                       i > 0 ? "," : "", stats[i].name, stats[i].calls,
+                       stats[i].bytes, stats[i].pixels, stats[i].nanoseconds) != 0) {
+            return -1;
+        }
+    }
+
+    return write_text(write, closure, "%s]}\n", count > 0 ? "\n" : "");
+}
+
+/* Writes the trace events recorded so far out through write in the Chrome
+ * trace event format, which chrome://tracing and Perfetto load. Should not
+ * be called while other threads are drawing. Returns 0 on success and -1 if
+ * anything could not be written. */
+int DL_write_trace(write_func_t write, void *closure) {
+#ifdef CDRAW_STATS
+    unsigned long long origin;
+    int count, i;
+
+    count = atomic_load(&traceNext);
+
+    if (count > TRACE_EVENTS) {
+        count = TRACE_EVENTS;
+    }
+
+    /* Timestamps are made relative to the first event */
+    origin = 0;
+
+    for (i = 0; i < count; i++) {
+        if (i == 0 || traceEvents[i].start < origin) {
+            origin = traceEvents[i].start;
+        }
+    }
+
+    if (write_text(write, closure, "{\"traceEvents\": [") != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (write_text(write, closure,
+                       "%s\n  {\"name\": \"%s\", \"cat\": \"cdraw\", \"ph\": \"X\", "
+                       "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d}",
+                       i > 0 ? "," : "", statNames[traceEvents[i].id],
+                       (traceEvents[i].start - origin) / 1000.0,
+                       traceEvents[i].duration / 1000.0, traceEvents[i].thread) != 0) {
+            return -1;
+        }
+    }
+
+    return write_text(write, closure, "%s]}\n", count > 0 ? "\n" : "");
+#else
+    return write_text(write, closure, "{\"traceEvents\": []}\n");
+#endif
+}
@@ -0,0 +1,96 @@
+/* Instrumentation shared by the CDraw ports */
+/* Built with CDRAW_STATS, every DL_* call which makes, draws, waits for or
+ * writes out a surface, and the backend operations under them, count their
+ * calls, the bytes they allocate, the pixels they composite and the time
+ * they take. Settings, cache and pool controls, size getters, arenas and the
+ * stats calls themselves are not counted. Without it the macros below expand
+ * to nothing. */
+
+#ifndef CDRAW_STATS_H
+#define CDRAW_STATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Everything that is counted. Keep in step with the names in cdraw-stats.c */
+typedef enum stat_id_t {
+    STAT_BESIDE_ALIGN,
+    STAT_BESIDE,
+    STAT_ABOVE_ALIGN,
+    STAT_ABOVE,
+    STAT_RECTANGLE,
+    STAT_SQUARE,
+    STAT_EMPTY,
+    STAT_TEXT,
+    STAT_OVERLAY,
+    STAT_BESIDE_N,
+    STAT_ABOVE_N,
+    STAT_OVERLAY_N,
+    STAT_GRID,
+    STAT_RENDER,
+    STAT_MAKE_WRITABLE,
+    STAT_FREE_SURFACE,
+    STAT_WRITE_PNG,
+    STAT_WRITE_RAW,
+    STAT_TEXT_MEASURE,
+    STAT_CROP,
+    STAT_PAD,
+    STAT_PARAGRAPH,
+    STAT_FROM_BUFFER,
+    STAT_FROM_BUFFER_BORROWED,
+    STAT_RENDER_ASYNC,
+    STAT_FUTURE_WAIT,
+    STAT_FUTURE_GET_SURFACE,
+    STAT_DISK_CACHE_STORE,
+    STAT_DISK_CACHE_LOAD,
+    STAT_WRITE_PDF,
+    STAT_WRITE_SVG,
+    STAT_COMPOSITION_NEW,
+    STAT_COMPOSITION_UPDATE,
+    STAT_GET_CAIRO_SURFACE,
+
+    /* Backend operations */
+    STAT_NEW_IMAGE,
+    STAT_PAINT,
+    STAT_FONT_LOOKUP,
+    STAT_TEXT_DRAW,
+    STAT_PNG_ENCODE,
+
+    STAT_COUNT
+} stat_id_t;
+
+#ifdef CDRAW_STATS
+
+/* Where a timed scope started, and the calling thread's byte and pixel
+ * totals at that point, so the scope gets what was counted under it */
+typedef struct dl_stats_scope_t {
+    unsigned long long start;
+    unsigned long long bytes;
+    unsigned long long pixels;
+} dl_stats_scope_t;
+
+dl_stats_scope_t dl_stats_begin(void);
+void dl_stats_end(stat_id_t id, const dl_stats_scope_t *scope);
+void dl_stats_alloc(unsigned long long bytes);
+void dl_stats_pixels(unsigned long long pixels);
+
+#define STATS_BEGIN(id) dl_stats_scope_t statsScope_##id = dl_stats_begin()
+#define STATS_END(id) dl_stats_end(id, &statsScope_##id)
+#define STATS_ALLOC(bytes) dl_stats_alloc(bytes)
+#define STATS_PIXELS(pixels) dl_stats_pixels(pixels)
+
+#else
+
+#define STATS_BEGIN(id) ((void)0)
+#define STATS_END(id) ((void)0)
+#define STATS_ALLOC(bytes) ((void)0)
+#define STATS_PIXELS(pixels) ((void)0)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CDRAW_STATS_H */